@@ -0,0 +1,612 @@
+/** \file
+ *
+ *  Carries out transactions with devices on the ADB (Apple Desktop Bus).
+ *  Call ADBInit() once, then queue transactions with ADBTalk(), ADBListen(),
+ *  ADBFlush() and ADBSendReset(), and call ADBTask() frequently. None of
+ *  these wait for the ADB data line. Commands are sent by the Timer1 compare
+ *  C interrupt, and responses are timed by the INT1 (ADB data line)
+ *  interrupt. ADBTask() starts each queued transaction in turn, and calls
+ *  its callback once it has finished. The callback can also find out whether
+ *  any device asked for service during the transaction, see
+ *  ADBServiceRequested().
+ *
+ *  This file is licensed as described by the file BSD.txt
+ *
+ *  Resources used to write the code here:
+ *  AN591 from Microchip: http://ww1.microchip.com/downloads/en/AppNotes/00591b.pdf
+ *  has a good overview of the transaction format, with required timings.
+ *
+ *  https://github.com/tmk/tmk_keyboard/blob/master/tmk_core/protocol/adb.c
+ *  has lots of links resources. It also describes command formats.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "ADB.h"
+#include "Scheduler.h"
+#include "Util.h"
+
+/** The port that the ADB data line is connected to.
+ *  0 = PORTA, 1 = PORTB, 2 = PORTC etc. */
+#define ADB_PORT				3
+/** The pin within a port that the ADB data line is connected to.
+ *  0 = PA0, PB0, PC1 etc., 1 = PA1, PB1, PC1 etc. */
+#define ADB_PIN					1
+/** Macro to quickly read state of ADB data line. This is used instead of
+  * "ReadPortPin(ADB_PORT, ADB_PIN)" in timing critical code. */
+#define READ_ADB_PIN			((PIND >> 1) & 1)
+/** Macro to quickly set the state of the ADB data line, which must be an
+ *  output. This is used instead of "WritePortPin(ADB_PORT, ADB_PIN, Val)" in
+ *  timing critical code. */
+#define WRITE_ADB_PIN(Val)		do { if (Val) PORTD |= (1 << 1); else PORTD &= ~(1 << 1); } while (0)
+/** Macro to quickly set the direction of the ADB data line. This is used
+ *  instead of "SetPortPinDirection(ADB_PORT, ADB_PIN, Out)" in timing
+ *  critical code. */
+#define SET_ADB_PIN_DIRECTION(Out)	do { if (Out) DDRD |= (1 << 1); else DDRD &= ~(1 << 1); } while (0)
+/** Number of microseconds to wait before timing out. This is also how long
+ *  the line must stay high for a response to be considered finished. */
+#define ADB_TIMEOUT				255
+/** Number of microseconds after the stop bit of a command before the device
+ *  might start responding. The minimum stop to start time (Tlt in AN591) is
+ *  160 us, so there is no chance of missing the start bit. */
+#define ADB_RESPONSE_DELAY		100
+/** Number of microseconds between the stop bit of a Listen command and the
+ *  start bit of its data (Tlt in AN591). */
+#define ADB_LISTEN_DELAY		200
+/** Number of microseconds after the ADB data line is released at the end of
+ *  a command's stop bit before checking whether a device is holding it low,
+ *  which is a service request (SRQ). */
+#define ADB_SRQ_SAMPLE			20
+/** Number of microseconds to wait for a service request to finish, on top of
+ *  the rest of the cell after the stop bit. A device asks for service by
+ *  holding the stop bit low for 300 us instead of 65 us. */
+#define ADB_SRQ_TIME			240
+/** Number of microseconds to hold the ADB data line low to reset every
+ *  device on the bus. The minimum is 3 ms. */
+#define ADB_RESET_TIME			4000
+/** Time (in microseconds) threshold for determining whether a bit is 0 or 1.
+ *  If the ADB line is observed to be in the low state for an amount of time
+ *  below this threshold, that means the bit was a 1. If the line was observed
+ *  to be in the low state for an amount of time above or equal to this
+ *  threshold, that means the bit was a 0. */
+#define ADB_THRESHOLD			50
+/** Maximum number of cells (periods of time where the ADB data line is held
+ *  at one level) in a transaction. These alternate between low and high,
+ *  starting with low: attention, sync, two for each of the eight command
+ *  bits, two for the stop bit, then for Listen two for the start bit, two
+ *  for each data bit, and two for the stop bit. */
+#define ADB_MAX_CELLS			(24 + (16 * ADB_MAX_DATA))
+/** Maximum number of low pulses in a response. This includes the start bit
+ *  (1), the data bits, and the stop bit (0). */
+#define ADB_MAX_PULSES			(2 + (8 * ADB_MAX_DATA))
+/** Number of transactions which can be queued, including the one in
+ *  progress. This must be a power of 2. */
+#define ADB_QUEUE_SIZE			4
+
+/** Command type bits of a command byte, which follow the address. */
+#define ADB_COMMAND_FLUSH		0x01
+#define ADB_COMMAND_LISTEN		0x08
+#define ADB_COMMAND_TALK		0x0c
+/** Not a real command byte. This is used in the queue for a reset, which is
+ *  sent by holding the line low rather than as a command. Flush with a
+ *  register number in the low bits is never sent, so it can't be confused
+ *  with a real command. */
+#define ADB_COMMAND_RESET		0x03
+
+/** Steps of an ADB transaction. */
+enum ADBStates
+{
+	ADB_STATE_IDLE = 0, /**< No transaction in progress. */
+	ADB_STATE_TRANSMIT, /**< The Timer1 compare C interrupt is sending a command (and any Listen data). */
+	ADB_STATE_RECEIVE,  /**< The INT1 interrupt is timing the response. */
+	ADB_STATE_DONE      /**< Finished, waiting for ADBTask() to call the callback. */
+};
+
+/** A transaction waiting in ADBQueue. */
+struct ADBTransaction
+{
+	uint8_t Command; /* command byte, or ADB_COMMAND_RESET */
+	uint8_t Length; /* number of bytes in Data, for Listen */
+	uint8_t Data[ADB_MAX_DATA]; /* data to send, for Listen */
+	ADBCallback Callback; /* called once the transaction is finished, may be NULL */
+};
+
+/** Number of Talk responses which were discarded because they were garbled.
+ *  Wraps around to 0. */
+uint8_t ADBReceiveErrors;
+
+/** Transactions waiting to be carried out, oldest first. The oldest is the
+ *  one in progress, and stays in the queue until it is finished. */
+static struct ADBTransaction ADBQueue[ADB_QUEUE_SIZE];
+/** Number of transactions added to ADBQueue, wrapping at 256. */
+static uint8_t ADBQueueIn;
+/** Number of transactions removed from ADBQueue, wrapping at 256. */
+static uint8_t ADBQueueOut;
+
+/** Lengths of the cells of the transaction being sent, in Timer1 counts. See
+ *  ADB_MAX_CELLS. This is filled in before the transaction is started, so
+ *  that the Timer1 compare C interrupt only has to step through it. */
+static uint16_t ADBCells[ADB_MAX_CELLS];
+/** Number of entries in ADBCells which are in use. */
+static uint8_t ADBCellCount;
+/** Index into ADBCells of the cell being sent. */
+static uint8_t ADBCell;
+/** 1 if the transaction being sent expects a response. */
+static uint8_t ADBExpectResponse;
+/** Index into ADBCells of the cell after the command's stop bit. The ADB data
+ *  line is released rather than driven high during this cell, so that a
+ *  device can hold it low to ask for service. */
+static uint8_t ADBReleaseCell;
+/** 1 while the Timer1 compare C interrupt is partway through ADBReleaseCell,
+ *  and is next to check for a service request. */
+static uint8_t ADBSampleSRQ;
+/** 1 if a device asked for service during the transaction in progress. */
+static volatile uint8_t ADBServiceRequest;
+/** Which step of a transaction is in progress (see enum ADBStates). */
+static volatile uint8_t ADBState;
+
+/** Duration (in microseconds, capped at 255) of each low pulse seen on the
+ *  ADB data line since ADBReceiveStart() was called. Filled in by the INT1
+ *  interrupt. */
+static volatile uint8_t ADBLowDuration[ADB_MAX_PULSES];
+/** Number of entries in ADBLowDuration which have been filled in. */
+static volatile uint8_t ADBReceiveCount;
+/** 1 if the INT1 interrupt saw two edges in the same direction, or more
+ *  pulses than fit in ADBLowDuration, and so the response can't be trusted. */
+static volatile uint8_t ADBReceiveMissedEdge;
+/** Value of Timer1 when the ADB data line last changed state. */
+static volatile uint16_t ADBLastEdgeTime;
+/** Value of Timer1 when the ADB data line last went low. */
+static uint16_t ADBFallTime;
+/** 1 if the ADB data line was low at the last edge, 0 if it was high. */
+static uint8_t ADBLineLow;
+/** 1 if the low pulse in progress is the end of a service request rather
+ *  than a bit, and so shouldn't be recorded. */
+static uint8_t ADBSkipPulse;
+/** Bytes decoded from the last response. */
+static uint8_t ADBResponse[ADB_MAX_DATA];
+
+/** Set up the ADB data line. */
+void ADBInit(void)
+{
+	/* Set ADB line to output mode, defaulting to a high state. */
+	SetPortPinDirection(ADB_PORT, ADB_PIN, 1);
+	WritePortPin(ADB_PORT, ADB_PIN, 1);
+	/* INT1 (which the ADB data line is on) interrupts on any edge. It is
+	 * only enabled while receiving, see ADBReceiveStart(). */
+	EICRA = (EICRA & ~(1 << ISC11)) | (1 << ISC10);
+}
+
+/** Add a transaction to the end of ADBQueue.
+ *  \param[in]     Command   Command byte, or ADB_COMMAND_RESET.
+ *  \param[in]     Data      Data to send, for Listen.
+ *  \param[in]     Length    Number of bytes in Data, at most ADB_MAX_DATA.
+ *  \param[in]     Callback  Function to call once the transaction is finished, or NULL.
+ *  \return uint8_t 1 if the transaction was queued, 0 if the queue is full.
+ */
+static uint8_t ADBQueueTransaction(const uint8_t Command, const uint8_t *Data, const uint8_t Length, const ADBCallback Callback)
+{
+	struct ADBTransaction *Transaction;
+
+	if ((uint8_t)(ADBQueueIn - ADBQueueOut) >= ADB_QUEUE_SIZE)
+		return 0;
+	Transaction = &ADBQueue[ADBQueueIn & (ADB_QUEUE_SIZE - 1)];
+	Transaction->Command = Command;
+	Transaction->Length = Length;
+	if (Length)
+		memcpy(Transaction->Data, Data, Length);
+	Transaction->Callback = Callback;
+	ADBQueueIn++;
+	return 1;
+}
+
+/** Queue a Talk command, which asks a device for the contents of one of its
+ *  registers. The callback is passed the response.
+ *  \param[in]     Address   Address of the device, 0 to 15.
+ *  \param[in]     Register  Register to read, 0 to 3.
+ *  \param[in]     Callback  Function to call once the transaction is finished, or NULL.
+ *  \return uint8_t 1 if the transaction was queued, 0 if the queue is full.
+ */
+uint8_t ADBTalk(const uint8_t Address, const uint8_t Register, const ADBCallback Callback)
+{
+	return ADBQueueTransaction((Address << 4) | ADB_COMMAND_TALK | Register, NULL, 0, Callback);
+}
+
+/** Queue a Listen command, which writes to one of a device's registers.
+ *  \param[in]     Address   Address of the device, 0 to 15.
+ *  \param[in]     Register  Register to write, 0 to 3.
+ *  \param[in]     Data      Data to write, first byte first.
+ *  \param[in]     Length    Number of bytes in Data, 2 to ADB_MAX_DATA.
+ *  \param[in]     Callback  Function to call once the transaction is finished, or NULL.
+ *  \return uint8_t 1 if the transaction was queued, 0 if the queue is full.
+ */
+uint8_t ADBListen(const uint8_t Address, const uint8_t Register, const uint8_t *Data, const uint8_t Length, const ADBCallback Callback)
+{
+	return ADBQueueTransaction((Address << 4) | ADB_COMMAND_LISTEN | Register, Data, Length, Callback);
+}
+
+/** Queue a Flush command, which clears a device's pending data.
+ *  \param[in]     Address   Address of the device, 0 to 15.
+ *  \param[in]     Callback  Function to call once the transaction is finished, or NULL.
+ *  \return uint8_t 1 if the transaction was queued, 0 if the queue is full.
+ */
+uint8_t ADBFlush(const uint8_t Address, const ADBCallback Callback)
+{
+	return ADBQueueTransaction((Address << 4) | ADB_COMMAND_FLUSH, NULL, 0, Callback);
+}
+
+/** Queue a reset of every device on the bus, which is done by holding the
+ *  ADB data line low for ADB_RESET_TIME.
+ *  \param[in]     Callback  Function to call once the reset is finished, or NULL.
+ *  \return uint8_t 1 if the reset was queued, 0 if the queue is full.
+ */
+uint8_t ADBSendReset(const ADBCallback Callback)
+{
+	return ADBQueueTransaction(ADB_COMMAND_RESET, NULL, 0, Callback);
+}
+
+/** Add the two cells for a bit to ADBCells. A 1 bit is low for 35 us then
+ *  high for 65 us, and a 0 bit is low for 65 us then high for 35 us.
+ *  \param[in]     Bit       0 or 1.
+ */
+static void ADBAddBitCells(const uint8_t Bit)
+{
+	if (Bit)
+	{
+		ADBCells[ADBCellCount++] = 35 * TIMER1_COUNTS_PER_US;
+		ADBCells[ADBCellCount++] = 65 * TIMER1_COUNTS_PER_US;
+	}
+	else
+	{
+		ADBCells[ADBCellCount++] = 65 * TIMER1_COUNTS_PER_US;
+		ADBCells[ADBCellCount++] = 35 * TIMER1_COUNTS_PER_US;
+	}
+}
+
+/** Add the cells for a byte to ADBCells, MSB first.
+ *  \param[in]     Byte      Byte to add.
+ */
+static void ADBAddByteCells(uint8_t Byte)
+{
+	uint8_t i;
+
+	for (i = 0; i < 8; i++)
+	{
+		ADBAddBitCells(Byte & 0x80);
+		Byte <<= 1;
+	}
+}
+
+/** Start sending a transaction on the ADB data line. This returns straight
+ *  away, and the Timer1 compare C interrupt steps through the cells of the
+ *  transaction. Once the transaction is sent, the interrupt starts
+ *  receiving the response, if there is one, see ADBReceiveStart().
+ *  \param[in]     Transaction   Transaction to send.
+ */
+static void ADBStartTransaction(const struct ADBTransaction *Transaction)
+{
+	uint8_t i;
+
+	ADBCellCount = 0;
+	ADBExpectResponse = 0;
+	if (Transaction->Command == ADB_COMMAND_RESET)
+	{
+		/* Reset signal: low state for ADB_RESET_TIME, then back high. */
+		ADBCells[ADBCellCount++] = ADB_RESET_TIME * TIMER1_COUNTS_PER_US;
+		ADBReleaseCell = ADBCellCount;
+		ADBCells[ADBCellCount++] = ADB_RESPONSE_DELAY * TIMER1_COUNTS_PER_US;
+	}
+	else
+	{
+		/* Attention signal: low state for 800 us. */
+		ADBCells[ADBCellCount++] = 800 * TIMER1_COUNTS_PER_US;
+		/* Sync signal: high state for 70 us. */
+		ADBCells[ADBCellCount++] = 70 * TIMER1_COUNTS_PER_US;
+		/* Command byte: eight 100 us bit cells, MSB first. */
+		ADBAddByteCells(Transaction->Command);
+		/* Stop bit: always a 0 bit. */
+		ADBAddBitCells(0);
+		ADBReleaseCell = ADBCellCount - 1;
+		if ((Transaction->Command & 0x0c) == ADB_COMMAND_LISTEN)
+		{
+			/* Stop to start time, then the data packet: a 1 start bit,
+			 * the data bytes, and a 0 stop bit. */
+			ADBCells[ADBCellCount - 1] = ADB_LISTEN_DELAY * TIMER1_COUNTS_PER_US;
+			ADBAddBitCells(1);
+			for (i = 0; i < Transaction->Length; i++)
+				ADBAddByteCells(Transaction->Data[i]);
+			ADBAddBitCells(0);
+		}
+		else if ((Transaction->Command & 0x0c) == ADB_COMMAND_TALK)
+		{
+			ADBExpectResponse = 1;
+		}
+	}
+
+	ADBCell = 0;
+	ADBSampleSRQ = 0;
+	ADBServiceRequest = 0;
+	ADBState = ADB_STATE_TRANSMIT;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		WRITE_ADB_PIN(0);
+		OCR1C = TCNT1 + ADBCells[0];
+		TIFR1 = (1 << OCF1C); /* discard any stale compare C match */
+		TIMSK1 |= (1 << OCIE1C);
+	}
+}
+
+/** Set the ADB data line to be an input, and start timing each low pulse on
+ *  it from the INT1 interrupt. The line must be high when this is called.
+ *  Call ADBReceiveStop() once the device has stopped responding. */
+static void ADBReceiveStart(void)
+{
+	SetPortPinDirection(ADB_PORT, ADB_PIN, 0);
+	ADBReceiveCount = 0;
+	ADBReceiveMissedEdge = 0;
+	EIFR = (1 << INTF1); /* discard any stale edge */
+	/* Normally the line is high here, but if a service request went on for
+	 * longer than expected, the end of it mustn't be mistaken for a bit. */
+	ADBLineLow = !READ_ADB_PIN;
+	ADBSkipPulse = ADBLineLow;
+	/* The device can't respond until ADB_RESPONSE_DELAY has passed, so
+	 * count the timeout for the start bit from then. */
+	ADBLastEdgeTime = ReadTimer1() + (ADB_RESPONSE_DELAY * TIMER1_COUNTS_PER_US);
+	EIMSK |= (1 << INT1);
+}
+
+/** Stop timing low pulses on the ADB data line, and restore it back to
+ *  being an output. */
+static void ADBReceiveStop(void)
+{
+	EIMSK &= ~(1 << INT1);
+	SetPortPinDirection(ADB_PORT, ADB_PIN, 1);
+}
+
+/** Decode bits from the low pulse durations in ADBLowDuration. A low pulse
+ *  shorter than ADB_THRESHOLD is a 1 bit, and a longer one is a 0 bit.
+ *  \param[in]     First     Index into ADBLowDuration of the first bit.
+ *  \param[in]     Count     Number of bits to decode, at most 16.
+ *  \return uint16_t The decoded bits, with the first one in the most
+ *                   significant position used.
+ */
+static uint16_t ADBDecodeBits(const uint8_t First, const uint8_t Count)
+{
+	uint16_t Value;
+	uint8_t i;
+
+	Value = 0;
+	for (i = First; i < (First + Count); i++)
+	{
+		Value <<= 1;
+		if (ADBLowDuration[i] < ADB_THRESHOLD)
+			Value |= 0x01;
+	}
+	return Value;
+}
+
+/** Decode the response timed by the INT1 interrupt into ADBResponse.
+ *  \param[out]    OutLength Number of bytes decoded.
+ *  \return uint8_t How the response was received (see enum ADBResults).
+ */
+static uint8_t ADBDecodeResponse(uint8_t *OutLength)
+{
+	uint8_t DataBits;
+	uint8_t i;
+
+	*OutLength = 0;
+	if (ADBReceiveCount == 0)
+		return ADB_RESULT_TIMEOUT;
+	/* There must be a start bit, a stop bit, and a whole number of bytes
+	 * (at least 2) in between. */
+	DataBits = ADBReceiveCount - 2;
+	if (ADBReceiveMissedEdge || (ADBReceiveCount < 18) || (DataBits & 0x07))
+	{
+		ADBReceiveErrors++;
+		return ADB_RESULT_ERROR;
+	}
+	/* Start at index 1 to skip over the start bit. */
+	for (i = 0; i < (DataBits / 8); i++)
+		ADBResponse[i] = (uint8_t)ADBDecodeBits(1 + (i * 8), 8);
+	*OutLength = DataBits / 8;
+	return ADB_RESULT_OK;
+}
+
+/** Carry out queued ADB transactions. This starts the next transaction once
+ *  the last one has finished, checks whether a response has finished, and
+ *  calls the callback of each finished transaction. It never waits for the
+ *  ADB data line, so it must be called frequently: at least soon after
+ *  ADBWakeTime(), and after any interrupt. */
+void ADBTask(void)
+{
+	const struct ADBTransaction *Transaction;
+	uint16_t LastEdgeTime;
+	uint8_t Result;
+	uint8_t Length;
+
+	if (ADBQueueOut == ADBQueueIn)
+		return;
+	Transaction = &ADBQueue[ADBQueueOut & (ADB_QUEUE_SIZE - 1)];
+
+	switch (ADBState)
+	{
+	case ADB_STATE_IDLE:
+		ADBStartTransaction(Transaction);
+		return;
+	case ADB_STATE_TRANSMIT:
+		return;
+	case ADB_STATE_RECEIVE:
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			LastEdgeTime = ADBLastEdgeTime;
+		}
+		/* The response (if any) is only finished once the line has stayed
+		 * high for long enough. If the device has nothing to report, it
+		 * doesn't respond at all, and this is a timeout. */
+		if ((int16_t)(ReadTimer1() - LastEdgeTime) < (ADB_TIMEOUT * TIMER1_COUNTS_PER_US))
+			return;
+		ADBReceiveStop();
+		Result = ADBDecodeResponse(&Length);
+		break;
+	default:
+		Result = ADB_RESULT_OK;
+		Length = 0;
+		break;
+	}
+
+	/* The transaction is finished. Remove it from the queue before calling
+	 * the callback, so that the callback can queue another. */
+	ADBState = ADB_STATE_IDLE;
+	ADBQueueOut++;
+	if (Transaction->Callback)
+		Transaction->Callback(Transaction->Command, Result, ADBResponse, Length);
+}
+
+/** Check whether a device asked for service during the last transaction.
+ *  This is only meaningful from within a transaction's callback. Devices ask
+ *  for service by holding the stop bit of a command low when they have data
+ *  to send, but aren't the device which the command was for.
+ *  \return uint8_t 1 if so, 0 if not.
+ */
+uint8_t ADBServiceRequested(void)
+{
+	return ADBServiceRequest;
+}
+
+/** Check whether any ADB transaction is queued or in progress.
+ *  \return uint8_t 1 if so, 0 if not.
+ */
+uint8_t ADBBusy(void)
+{
+	return (ADBQueueOut != ADBQueueIn);
+}
+
+/** Find out when ADBTask() next needs to be called, if ADBBusy() returns 1.
+ *  Calls are also needed after any interrupt, as transactions are timed by
+ *  interrupts.
+ *  \return uint16_t Value of Timer1 when the response finishes or times out,
+ *                   the current value of Timer1 if ADBTask() has work to do
+ *                   straight away, or a millisecond from now while a
+ *                   command is being sent.
+ */
+uint16_t ADBWakeTime(void)
+{
+	uint16_t LastEdgeTime;
+
+	switch (ADBState)
+	{
+	case ADB_STATE_TRANSMIT:
+		return ReadTimer1() + TIMER1_COUNTS_PER_MS;
+	case ADB_STATE_RECEIVE:
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			LastEdgeTime = ADBLastEdgeTime;
+		}
+		return LastEdgeTime + (ADB_TIMEOUT * TIMER1_COUNTS_PER_US);
+	default:
+		return ReadTimer1();
+	}
+}
+
+/** End of a transaction cell. This moves the ADB data line on to the next
+ *  cell, or once the transaction is sent, starts receiving the response.
+ *  Each cell is timed from when the last one was due to end, rather than
+ *  when this interrupt ran, so that interrupt latency doesn't build up over
+ *  the transaction. */
+ISR(TIMER1_COMPC_vect)
+{
+	if (ADBSampleSRQ)
+	{
+		/* Partway through the cell after the stop bit. If the line is still
+		 * low, a device is asking for service, so wait for it to finish. */
+		ADBSampleSRQ = 0;
+		OCR1C += ADBCells[ADBCell] - (ADB_SRQ_SAMPLE * TIMER1_COUNTS_PER_US);
+		if (!READ_ADB_PIN)
+		{
+			ADBServiceRequest = 1;
+			OCR1C += ADB_SRQ_TIME * TIMER1_COUNTS_PER_US;
+		}
+		return;
+	}
+	ADBCell++;
+	if ((ADBState != ADB_STATE_TRANSMIT) || (ADBCell >= ADBCellCount))
+	{
+		TIMSK1 &= ~(1 << OCIE1C);
+		if (ADBState == ADB_STATE_TRANSMIT)
+		{
+			/* ADBTask() has something to do now, and ADBWakeTime() has
+			 * changed. */
+			SchedulerRunNow(SCHEDULER_TASK_MOUSE);
+			if (ADBExpectResponse)
+			{
+				ADBState = ADB_STATE_RECEIVE;
+				ADBReceiveStart();
+			}
+			else
+			{
+				/* Drive the line high again, as it may have been released. */
+				WRITE_ADB_PIN(1);
+				SET_ADB_PIN_DIRECTION(1);
+				ADBState = ADB_STATE_DONE;
+			}
+		}
+		return;
+	}
+	if (ADBCell == ADBReleaseCell)
+	{
+		/* Release the line, and let the pull-up take it high. */
+		SET_ADB_PIN_DIRECTION(0);
+		WRITE_ADB_PIN(1);
+		ADBSampleSRQ = 1;
+		OCR1C += ADB_SRQ_SAMPLE * TIMER1_COUNTS_PER_US;
+		return;
+	}
+	/* Even cells are low, odd cells are high. */
+	if (ADBCell & 1)
+	{
+		WRITE_ADB_PIN(1);
+	}
+	else
+	{
+		WRITE_ADB_PIN(0);
+		SET_ADB_PIN_DIRECTION(1);
+	}
+	OCR1C += ADBCells[ADBCell];
+}
+
+/** Edge on the ADB data line, while receiving. This records how long each
+ *  low pulse lasted, for ADBDecodeResponse() to decode once the whole
+ *  response has been received. */
+ISR(INT1_vect)
+{
+	uint16_t Now;
+	uint16_t Duration;
+
+	Now = TCNT1;
+	if (!READ_ADB_PIN)
+	{
+		if (ADBLineLow)
+			ADBReceiveMissedEdge = 1;
+		ADBFallTime = Now;
+		ADBLineLow = 1;
+	}
+	else
+	{
+		if (!ADBLineLow)
+			ADBReceiveMissedEdge = 1;
+		Duration = (uint16_t)(Now - ADBFallTime) / TIMER1_COUNTS_PER_US;
+		if (Duration > 255)
+			Duration = 255;
+		if (ADBSkipPulse)
+			ADBSkipPulse = 0;
+		else if (ADBReceiveCount < ADB_MAX_PULSES)
+			ADBLowDuration[ADBReceiveCount++] = (uint8_t)Duration;
+		else
+			ADBReceiveMissedEdge = 1;
+		ADBLineLow = 0;
+	}
+	ADBLastEdgeTime = Now;
+}
@@ -0,0 +1,50 @@
+/** \file
+ *
+ *  Defines things exported by ADB.c
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#ifndef _ADB_H_
+#define _ADB_H_
+
+#include <stdint.h>
+
+/* Macros: */
+/** Maximum number of data bytes in a register, and so in a Talk response or
+ *  Listen command. */
+#define ADB_MAX_DATA			8
+/** Bit in the first byte of register 3 which enables service requests. */
+#define ADB_R3_SRQ_ENABLE		0x20
+
+/** How an ADB transaction finished. This is passed to its callback. */
+enum ADBResults
+{
+	ADB_RESULT_OK = 0,  /**< Finished. For Talk, the device responded. */
+	ADB_RESULT_TIMEOUT, /**< Talk only: no device responded. */
+	ADB_RESULT_ERROR    /**< Talk only: the response was garbled. */
+};
+
+/** Function called by ADBTask() once a queued transaction has finished.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      For Talk, the bytes received, first byte first.
+ *  \param[in]     Length    For Talk, the number of bytes received, 0 otherwise.
+ */
+typedef void (*ADBCallback)(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length);
+
+/* Exported Variables: */
+extern uint8_t ADBReceiveErrors;
+
+/* Function Prototypes: */
+extern void ADBInit(void);
+extern uint8_t ADBTalk(const uint8_t Address, const uint8_t Register, const ADBCallback Callback);
+extern uint8_t ADBListen(const uint8_t Address, const uint8_t Register, const uint8_t *Data, const uint8_t Length, const ADBCallback Callback);
+extern uint8_t ADBFlush(const uint8_t Address, const ADBCallback Callback);
+extern uint8_t ADBSendReset(const ADBCallback Callback);
+extern void ADBTask(void);
+extern uint8_t ADBServiceRequested(void);
+extern uint8_t ADBBusy(void);
+extern uint16_t ADBWakeTime(void);
+
+#endif // #ifndef _ADB_H_
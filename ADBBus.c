@@ -0,0 +1,382 @@
+/** \file
+ *
+ *  Manages the devices on the ADB (Apple Desktop Bus). ADBBusInit() resets
+ *  the bus, then finds every device and moves each one to an address of its
+ *  own, so that several devices of the same type (which all start at the
+ *  same default address) can share the bus. Each device is then set up by
+ *  the setup function registered for its type. After that, call ADBBusPoll()
+ *  periodically. Each poll reads register 0 of one device, and passes the
+ *  contents to the handler which was registered for that type of device
+ *  with ADBBusRegister(). Devices only have data to send when something has
+ *  changed, so polls keep going to the device which last had data, and only
+ *  move on to other devices when one of them asks for service.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ *
+ *  Resources used to write the code here:
+ *  https://developer.apple.com/legacy/library/technotes/hw/hw_01.html
+ *  describes address resolution and service requests.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <util/delay.h>
+#include "ADB.h"
+#include "ADBBus.h"
+#include "Util.h"
+
+/** Maximum number of devices on the bus. Devices are moved to addresses 8 to
+ *  15, and any that can't be moved stay at their default address. */
+#define ADB_BUS_MAX_DEVICES		8
+/** Lowest address which devices are moved to. Default addresses are all
+ *  below this. */
+#define ADB_BUS_FIRST_FREE		8
+/** Number of times to retry a Talk during address resolution, if the
+ *  response was garbled (for example, by two devices talking at once). */
+#define ADB_BUS_RETRIES			3
+/** Time (in milliseconds) to wait after the bus reset before starting
+ *  address resolution, so that devices have finished resetting. */
+#define ADB_BUS_RESET_RECOVERY_MS	50
+/** Time (in milliseconds) between repeats of address resolution while no
+ *  devices have been found, in case a device wasn't ready the first time
+ *  or has been plugged in since. */
+#define ADB_BUS_RESCAN_MS		1000
+/** Initial value of ADBBusPollDuration, in microseconds. A poll where the
+ *  device responds takes about 1.8 ms for the command, up to 260 us before
+ *  the response, 1.8 ms for the response, then ADB_TIMEOUT in ADB.c. */
+#define ADB_BUS_POLL_ESTIMATE	4200
+
+/** Register 3 handler ID which asks a device to change its address, but
+ *  only if it didn't see a collision when it last responded. */
+#define ADB_R3_MOVE_HANDLER		0xfe
+
+/** A device found by address resolution. */
+struct ADBBusDevice
+{
+	uint8_t Address; /* address the device now responds to */
+	uint8_t DefaultAddress; /* address the device started at, which identifies its type */
+};
+
+/** Time taken by the last poll which a device responded to, from when
+ *  ADBBusPoll() queued it to when it finished, in Timer1 counts. Polls
+ *  which time out are quicker, but they don't deliver a sample, so they
+ *  aren't counted. */
+uint16_t ADBBusPollDuration = ADB_BUS_POLL_ESTIMATE * TIMER1_COUNTS_PER_US;
+/** Number of devices found by address resolution. */
+uint8_t ADBBusDeviceCount;
+/** Number of polls which saw a service request. Wraps around to 0. */
+uint8_t ADBBusServiceRequests;
+
+/** Handler for each type of device, indexed by default address. */
+static ADBCallback ADBBusHandlers[16];
+/** Setup function for each type of device, indexed by default address. */
+static ADBSetupFunction ADBBusSetups[16];
+/** Devices found by address resolution. */
+static struct ADBBusDevice ADBBusDevices[ADB_BUS_MAX_DEVICES];
+/** 1 once address resolution and device setup have finished. */
+static uint8_t ADBBusReady;
+/** Default address being searched for devices by address resolution. */
+static uint8_t ResolveAddress;
+/** Address which the device found by address resolution is being moved to. */
+static uint8_t ResolveNewAddress;
+/** Lowest address which address resolution hasn't moved a device to yet. */
+static uint8_t ResolveNextFree;
+/** 1 if address resolution is waiting for ResolveWaitTime to pass before
+ *  it (re)starts. */
+static uint8_t ResolveWaiting;
+/** Value of GetMilliseconds() when the wait for address resolution began. */
+static uint16_t ResolveWaitStart;
+/** How long (in milliseconds) address resolution waits before it (re)starts. */
+static uint16_t ResolveWaitTime;
+/** Number of retries left for the Talk in progress during address resolution. */
+static uint8_t ResolveRetries;
+/** Index into ADBBusDevices of the next device to set up. */
+static uint8_t SetupDevice;
+/** Index into ADBBusDevices of the device to poll next. */
+static uint8_t PollDevice;
+/** Index into ADBBusDevices of the device which last responded to a poll. */
+static uint8_t ActiveDevice;
+/** 1 if a poll queued by ADBBusPoll() hasn't finished yet. */
+static uint8_t PollPending;
+/** Value of Timer1 when the poll in progress was queued. */
+static uint16_t PollStartTime;
+
+static void ResolveTalkDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length);
+
+/** Add a device to ADBBusDevices.
+ *  \param[in]     Address         Address the device responds to.
+ *  \param[in]     DefaultAddress  Address the device started at.
+ */
+static void AddDevice(const uint8_t Address, const uint8_t DefaultAddress)
+{
+	if (ADBBusDeviceCount >= ADB_BUS_MAX_DEVICES)
+		return;
+	ADBBusDevices[ADBBusDeviceCount].Address = Address;
+	ADBBusDevices[ADBBusDeviceCount].DefaultAddress = DefaultAddress;
+	ADBBusDeviceCount++;
+}
+
+/** Call the setup function of the next device which has one. Once every
+ *  device has been set up, polling can start. */
+static void SetupNext(void)
+{
+	ADBSetupFunction Setup;
+	uint8_t Address;
+
+	while (SetupDevice < ADBBusDeviceCount)
+	{
+		Setup = ADBBusSetups[ADBBusDevices[SetupDevice].DefaultAddress];
+		Address = ADBBusDevices[SetupDevice].Address;
+		SetupDevice++;
+		if (Setup)
+		{
+			Setup(Address);
+			return;
+		}
+	}
+	ADBBusReady = 1;
+}
+
+/** Look for a device at ResolveAddress, by reading its register 3. Default
+ *  addresses 1 to 7 are searched in turn, and once they have all been
+ *  searched, address resolution is finished, and device setup starts. */
+static void ResolveNext(void)
+{
+	if (ResolveAddress >= ADB_BUS_FIRST_FREE)
+	{
+		SetupDevice = 0;
+		SetupNext();
+		return;
+	}
+	ADBTalk(ResolveAddress, 3, ResolveTalkDone);
+}
+
+/** Called once a read of register 3 at ResolveNewAddress has finished. If the
+ *  device responded, it has moved, so there may be more devices left at
+ *  ResolveAddress. If not, it doesn't support moving, so it stays where it is.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Contents of register 3, first byte first.
+ *  \param[in]     Length    Number of bytes in Data.
+ */
+static void ResolveCheckDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	(void)Command;
+	(void)Data;
+	(void)Length;
+	if (Result == ADB_RESULT_OK)
+	{
+		AddDevice(ResolveNewAddress, ResolveAddress);
+		ResolveNextFree++;
+	}
+	else
+	{
+		AddDevice(ResolveAddress, ResolveAddress);
+		ResolveAddress++;
+	}
+	ResolveRetries = ADB_BUS_RETRIES;
+	ResolveNext();
+}
+
+/** Called once a device has been told to move to ResolveNewAddress. Check
+ *  that it did, by reading its register 3 there.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Unused.
+ *  \param[in]     Length    Unused.
+ */
+static void ResolveMoveDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	(void)Command;
+	(void)Result;
+	(void)Data;
+	(void)Length;
+	ADBTalk(ResolveNewAddress, 3, ResolveCheckDone);
+}
+
+/** Called once a read of register 3 at ResolveAddress has finished. If a
+ *  device responded, move it to the next free address. If several devices
+ *  responded at once, only the one which didn't see a collision moves. A
+ *  response which is still garbled after every retry means that devices
+ *  are colliding, so the move is tried anyway.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Contents of register 3, first byte first.
+ *  \param[in]     Length    Number of bytes in Data.
+ */
+static void ResolveTalkDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	uint8_t NewRegister[2];
+
+	(void)Command;
+	(void)Data;
+	(void)Length;
+	if ((Result == ADB_RESULT_ERROR) && ResolveRetries)
+	{
+		ResolveRetries--;
+		ADBTalk(ResolveAddress, 3, ResolveTalkDone);
+		return;
+	}
+	ResolveRetries = ADB_BUS_RETRIES;
+	if (Result == ADB_RESULT_TIMEOUT)
+	{
+		/* No devices (left) at this address. */
+		ResolveAddress++;
+		ResolveNext();
+		return;
+	}
+	ResolveNewAddress = ResolveNextFree;
+	if (ResolveNewAddress > 15)
+	{
+		/* No free addresses left, so leave any other devices where they are. */
+		AddDevice(ResolveAddress, ResolveAddress);
+		ResolveAddress++;
+		ResolveNext();
+		return;
+	}
+	NewRegister[0] = ADB_R3_SRQ_ENABLE | ResolveNewAddress;
+	NewRegister[1] = ADB_R3_MOVE_HANDLER;
+	ADBListen(ResolveAddress, 3, NewRegister, 2, ResolveMoveDone);
+}
+
+/** Start address resolution once WaitTime has passed.
+ *  \param[in]     WaitTime  Time to wait, in milliseconds.
+ */
+static void ResolveAfter(const uint16_t WaitTime)
+{
+	ResolveWaitStart = GetMilliseconds();
+	ResolveWaitTime = WaitTime;
+	ResolveWaiting = 1;
+}
+
+/** Called once address resolution's bus reset has finished. Wait for the
+ *  devices to recover before searching for them.
+ *  \param[in]     Command   Unused.
+ *  \param[in]     Result    Unused.
+ *  \param[in]     Data      Unused.
+ *  \param[in]     Length    Unused.
+ */
+static void ResetDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	(void)Command;
+	(void)Result;
+	(void)Data;
+	(void)Length;
+	ResolveAfter(ADB_BUS_RESET_RECOVERY_MS);
+}
+
+/** Reset the ADB bus, and start address resolution. This carries on in the
+ *  background, from ADBTask() and ADBBusTask(). Until it has finished,
+ *  ADBBusPoll() does nothing. */
+void ADBBusInit(void)
+{
+	ADBInit();
+	/* Give ADB controller time to start up. */
+	_delay_ms(10);
+	ADBBusDeviceCount = 0;
+	ADBBusReady = 0;
+	ResolveWaiting = 0;
+	PollDevice = 0;
+	ActiveDevice = 0;
+	ADBSendReset(ResetDone);
+}
+
+/** Carry on with address resolution when it is waiting for time to pass.
+ *  This (re)starts it once the bus has recovered from the reset, and again
+ *  every ADB_BUS_RESCAN_MS while no devices have been found. Call this
+ *  frequently, whether or not the host is polling for reports. */
+void ADBBusTask(void)
+{
+	if (ADBBusReady && (ADBBusDeviceCount == 0) && !ResolveWaiting)
+		ResolveAfter(ADB_BUS_RESCAN_MS);
+	if (!ResolveWaiting || ADBBusy())
+		return;
+	if ((uint16_t)(GetMilliseconds() - ResolveWaitStart) < ResolveWaitTime)
+		return;
+	ResolveWaiting = 0;
+	ADBBusReady = 0;
+	ADBBusDeviceCount = 0;
+	PollDevice = 0;
+	ActiveDevice = 0;
+	ResolveAddress = 1;
+	ResolveNextFree = ADB_BUS_FIRST_FREE;
+	ResolveRetries = ADB_BUS_RETRIES;
+	ResolveNext();
+}
+
+/** Register the functions which drive one type of device. The setup
+ *  function is called once for each device of that type, after address
+ *  resolution, and must call ADBBusSetupDone() once it has finished. The
+ *  handler is passed the result of each poll which the device responded to.
+ *  The addresses passed to both are the addresses the devices were moved
+ *  to, not their default address.
+ *  \param[in]     DefaultAddress  Default address of the type of device, e.g. 3 for mice.
+ *  \param[in]     Setup           Function to call to set up each device, or NULL.
+ *  \param[in]     Handler         Function to call with each poll's result.
+ */
+void ADBBusRegister(const uint8_t DefaultAddress, const ADBSetupFunction Setup, const ADBCallback Handler)
+{
+	ADBBusSetups[DefaultAddress & 0x0f] = Setup;
+	ADBBusHandlers[DefaultAddress & 0x0f] = Handler;
+}
+
+/** Tell the bus manager that a device's setup function has finished setting
+ *  it up, so that the next device can be set up. */
+void ADBBusSetupDone(void)
+{
+	SetupNext();
+}
+
+/** Called once a poll queued by ADBBusPoll() has finished. If the device
+ *  responded, pass its data on to its handler. If a device asked for
+ *  service, it wasn't this one, so the next poll moves on to the next
+ *  device. Otherwise, the next poll goes back to the device which last had
+ *  data.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Contents of register 0, first byte first.
+ *  \param[in]     Length    Number of bytes in Data.
+ */
+static void PollDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	ADBCallback Handler;
+
+	PollPending = 0;
+	if (Result == ADB_RESULT_OK)
+	{
+		ADBBusPollDuration = ReadTimer1() - PollStartTime;
+		ActiveDevice = PollDevice;
+		Handler = ADBBusHandlers[ADBBusDevices[PollDevice].DefaultAddress];
+		if (Handler)
+			Handler(Command, Result, Data, Length);
+	}
+	if (ADBServiceRequested())
+	{
+		ADBBusServiceRequests++;
+		PollDevice++;
+		if (PollDevice >= ADBBusDeviceCount)
+			PollDevice = 0;
+	}
+	else
+	{
+		PollDevice = ActiveDevice;
+	}
+}
+
+/** Poll a device on the ADB bus for updates to its state. This queues a read
+ *  of register 0, and once it finishes (in ADBTask()), the result is passed
+ *  to the device's handler.
+ *  \return uint8_t 1 if a poll was queued, 0 if the last poll hasn't
+ *                  finished yet, address resolution hasn't finished, there
+ *                  are no devices, or the ADB queue is full.
+ */
+uint8_t ADBBusPoll(void)
+{
+	if (PollPending || !ADBBusReady || (ADBBusDeviceCount == 0))
+		return 0;
+	if (!ADBTalk(ADBBusDevices[PollDevice].Address, 0, PollDone))
+		return 0;
+	PollPending = 1;
+	PollStartTime = ReadTimer1();
+	return 1;
+}
@@ -0,0 +1,32 @@
+/** \file
+ *
+ *  Defines things exported by ADBBus.c
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#ifndef _ADB_BUS_H_
+#define _ADB_BUS_H_
+
+#include <stdint.h>
+#include "ADB.h"
+
+/** Function called once for each device of a type registered with
+ *  ADBBusRegister(), to set it up after address resolution.
+ *  \param[in]     Address   Address of the device.
+ */
+typedef void (*ADBSetupFunction)(const uint8_t Address);
+
+/* Exported Variables: */
+extern uint16_t ADBBusPollDuration;
+extern uint8_t ADBBusDeviceCount;
+extern uint8_t ADBBusServiceRequests;
+
+/* Function Prototypes: */
+extern void ADBBusInit(void);
+extern void ADBBusTask(void);
+extern void ADBBusRegister(const uint8_t DefaultAddress, const ADBSetupFunction Setup, const ADBCallback Handler);
+extern void ADBBusSetupDone(void);
+extern uint8_t ADBBusPoll(void);
+
+#endif // #ifndef _ADB_BUS_H_
@@ -1,274 +1,322 @@
 /** \file
  *
- *  Interfaces with an ADB (Apple Desktop Bus) mouse. To query the mouse,
- *  call ADBMouseInit() once, then call ADBPollMouse() periodically.
+ *  Interfaces with an ADB (Apple Desktop Bus) mouse. Call ADBMouseInit()
+ *  once, after ADBBusInit(). Each mouse is then asked to switch to the
+ *  extended mouse protocol, which has more bits of movement and more
+ *  buttons. Mice which don't support it are asked to switch to the classic
+ *  protocol at 200 counts per inch instead, and if they don't support that
+ *  either, they stay in the classic protocol at 100 counts per inch. Mice
+ *  are polled by ADBBusPoll() in ADBBus.c, along with any other devices on
+ *  the bus. Movement is scaled by an acceleration curve (see
+ *  ADBMouseAccelProfile) before it is accumulated.
  *
  *  This file is licensed as described by the file BSD.txt
  *
  *  Resources used to write the code here:
- *  AN591 from Microchip: http://ww1.microchip.com/downloads/en/AppNotes/00591b.pdf
- *  has a good overview of the transaction format, with required timings.
- *
- *  https://github.com/tmk/tmk_keyboard/blob/master/tmk_core/protocol/adb.c
- *  has lots of links resources. It also describes command formats.
- *
  *  https://developer.apple.com/legacy/library/technotes/hw/hw_01.html
  *  describes the ADB mouse protocol.
+ *
+ *  https://github.com/tmk/tmk_keyboard/blob/master/tmk_core/protocol/adb.c
+ *  describes the extended mouse protocol's register 0 format.
  */
 
 #include <stdint.h>
-#include <avr/io.h>
-#include <util/delay.h>
-#include "Util.h"
-#include "KeyboardMouse.h"
+#include <avr/pgmspace.h>
+#include "ADB.h"
+#include "ADBBus.h"
+#include "ADBMouse.h"
+
+/** Default ADB address of mice. */
+#define ADB_MOUSE_ADDRESS		3
+/** Register 3 handler ID of the classic mouse protocol, at 100 counts per
+ *  inch. Mice start with this handler. */
+#define ADB_MOUSE_HANDLER_CLASSIC	1
+/** Register 3 handler ID of the classic mouse protocol, at 200 counts per
+ *  inch. */
+#define ADB_MOUSE_HANDLER_CLASSIC_200	2
+/** Register 3 handler ID of the extended mouse protocol. */
+#define ADB_MOUSE_HANDLER_EXTENDED	4
 
-/** The port that the ADB data line is connected to.
- *  0 = PORTA, 1 = PORTB, 2 = PORTC etc. */
-#define ADB_PORT				3
-/** The pin within a port that the ADB data line is connected to.
- *  0 = PA0, PB0, PC1 etc., 1 = PA1, PB1, PC1 etc. */
-#define ADB_PIN					1
-/** Macro to quickly read state of ADB data line. This is used instead of
-  * "ReadPortPin(ADB_PORT, ADB_PIN)" in timing critical code. */
-#define READ_ADB_PIN			((PIND >> 1) & 1)
-/** Number of microseconds to wait before timing out. */
-#define ADB_TIMEOUT				255
-/** Time (in microseconds) threshold for determining whether a bit is 0 or 1.
- *  If the ADB line is observed to be in the low state for an amount of time
- *  below this threshold, that means the bit was a 1. If the line was observed
- *  to be in the low state for an amount of time above or equal to this
- *  threshold, that means the bit was a 0. */
-#define ADB_THRESHOLD			50
+/** Number of entries in each acceleration profile in AccelerationGains. */
+#define ACCELERATION_STEPS		16
 
-/** Minimum value of AccumulatedX/AccumulatedY. This is currently set so
- *  that accumulated values will fit in an int8_t. */
-#define ACCUMULATED_MIN			(-127)
-/** Maximum value of AccumulatedX/AccumulatedY. This is currently set so
- *  that accumulated values will fit in an int8_t. */
-#define ACCUMULATED_MAX			127
+/** Minimum value of AccumulatedX/AccumulatedY. This only stops them from
+ *  overflowing, as movement is taken off them as it is reported. */
+#define ACCUMULATED_MIN			(-32767)
+/** Maximum value of AccumulatedX/AccumulatedY. This only stops them from
+ *  overflowing, as movement is taken off them as it is reported. */
+#define ACCUMULATED_MAX			32767
 
-/** Accumulated X movement. Updated by ADBPollMouse(). This needs to be
- *  periodically reset back to 0, otherwise it will start to clip. */
+/** Accumulated X movement which hasn't been reported yet. Updated by
+ *  ADBMouseReport(). Whatever is sent to the host must be subtracted from
+ *  this, so that movement which doesn't fit in one report isn't lost. */
 int16_t AccumulatedX;
-/** Accumulated Y movement. Updated by ADBPollMouse(). This needs to be
- *  periodically reset back to 0, otherwise it will start to clip. */
+/** Accumulated Y movement which hasn't been reported yet. Updated by
+ *  ADBMouseReport(). Whatever is sent to the host must be subtracted from
+ *  this, so that movement which doesn't fit in one report isn't lost. */
 int16_t AccumulatedY;
-/** 0 = not pressed, 1 = pressed. Updated by ADBPollMouse(). */
+/** 0 = not pressed, 1 = pressed. Updated by ADBMouseReport(). */
 uint8_t Button1State;
-/** 0 = not pressed, 1 = pressed. Updated by ADBPollMouse(). Some mice don't
+/** 0 = not pressed, 1 = pressed. Updated by ADBMouseReport(). Some mice don't
  *  have a second button, in those cases this will always be 0. */
 uint8_t Button2State;
+/** 0 = not pressed, 1 = pressed. Updated by ADBMouseReport(). Only mice
+ *  using the extended protocol can have a third button. */
+uint8_t Button3State;
+
+/** Acceleration profile applied to mouse movement (see enum
+ *  ADBMouseAccelProfiles). This can be changed at any time. */
+uint8_t ADBMouseAccelProfile = ADB_MOUSE_ACCEL_DEFAULT;
 
-/** Write a 0 bit on the ADB data line. */
-static void ADBWriteZeroBit(void)
+/** Gain applied to mouse movement by each acceleration profile, indexed by
+ *  the speed of the movement: the larger of the X and Y movement in one
+ *  poll, in hundredths of an inch. This is the same as counts for a 100
+ *  counts per inch mouse, so that every mouse gets the same curve for the
+ *  same hand movement. Faster movements use the last entry. Gains are fixed
+ *  point, with 8 fractional bits, so 256 = 1.0. Slow movements are left
+ *  alone (or slowed down, in the high profile) for precise work, and fast
+ *  movements are sped up to cross the screen quickly. */
+static const uint16_t AccelerationGains[ADB_MOUSE_ACCEL_PROFILE_COUNT][ACCELERATION_STEPS] PROGMEM =
+{
+	/* ADB_MOUSE_ACCEL_OFF */
+	{256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256},
+	/* ADB_MOUSE_ACCEL_LOW: up to 1.5x */
+	{256, 256, 256, 272, 288, 304, 320, 336, 352, 368, 384, 384, 384, 384, 384, 384},
+	/* ADB_MOUSE_ACCEL_MEDIUM: up to 2x */
+	{256, 256, 256, 288, 320, 352, 384, 416, 448, 480, 512, 512, 512, 512, 512, 512},
+	/* ADB_MOUSE_ACCEL_HIGH: 0.75x when slow, up to 3x */
+	{192, 192, 224, 256, 320, 384, 448, 512, 576, 640, 704, 768, 768, 768, 768, 768},
+};
+
+/** Fractions of a count of X and Y movement left over after acceleration,
+ *  with 8 fractional bits, indexed by address. These are carried over to
+ *  the next poll of the same mouse, so that slow movements with a gain
+ *  below 1.0 (or between whole numbers) still add up correctly, even while
+ *  several mice are moving. */
+static uint8_t RemainderX[16], RemainderY[16];
+
+/** Register 3 handler ID of each mouse, indexed by address. */
+static uint8_t MouseHandlers[16];
+/** Resolution of each mouse in counts per inch, indexed by address. Mice
+ *  using the extended protocol report it in register 1, otherwise it
+ *  depends on the handler. */
+static uint16_t MouseResolutions[16];
+/** Address of the mouse which is being set up. */
+static uint8_t SetupAddress;
+/** Register 3 handler ID which the mouse being set up has been asked to
+ *  switch to. */
+static uint8_t SetupHandler;
+
+static void MouseSetupListenDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length);
+
+/** Scale movement by a gain, carrying the fraction of a count which is left
+ *  over to the next call.
+ *  \param[in]     Delta        Movement in counts.
+ *  \param[in]     Gain         Gain, with 8 fractional bits.
+ *  \param[in,out] Remainder    Fraction left over from the last call, with 8 fractional bits.
+ *  \return int32_t The scaled movement, in whole counts.
+ */
+static int32_t Accelerate(const int16_t Delta, const uint16_t Gain, uint8_t *Remainder)
 {
-	WritePortPin(ADB_PORT, ADB_PIN, 0);
-	DelayMicroseconds(65);
-	WritePortPin(ADB_PORT, ADB_PIN, 1);
-	DelayMicroseconds(35);
+	int32_t Scaled;
+
+	Scaled = ((int32_t)Delta * Gain) + *Remainder;
+	/* Round towards minus infinity, so that the remainder is never negative. */
+	*Remainder = (uint8_t)Scaled;
+	return Scaled >> 8;
 }
 
-/** Write a 1 bit on the ADB data line. */
-static void ADBWriteOneBit(void)
+/** Add movement to AccumulatedX or AccumulatedY, without overflowing.
+ *  \param[in,out] Accumulated  AccumulatedX or AccumulatedY.
+ *  \param[in]     Delta        Movement to add.
+ */
+static void Accumulate(int16_t *Accumulated, const int32_t Delta)
 {
-	WritePortPin(ADB_PORT, ADB_PIN, 0);
-	DelayMicroseconds(35);
-	WritePortPin(ADB_PORT, ADB_PIN, 1);
-	DelayMicroseconds(65);
+	int32_t Sum;
+
+	Sum = *Accumulated + Delta;
+	if (Sum > ACCUMULATED_MAX)
+		Sum = ACCUMULATED_MAX;
+	if (Sum < ACCUMULATED_MIN)
+		Sum = ACCUMULATED_MIN;
+	*Accumulated = (int16_t)Sum;
 }
 
-/** Write a command to the ADB data line.
- *  \param[in]     Command   Command to write. See https://github.com/tmk/tmk_keyboard/blob/master/tmk_core/protocol/adb.c#L315
- *                           for command format.
+/** Called by ADBBusPoll() once a mouse has responded to a poll. A mouse only
+ *  responds when it has something to report (a change in its state). The
+ *  response is decoded according to the protocol the mouse is using.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Contents of register 0, first byte first.
+ *  \param[in]     Length    Number of bytes in Data.
  */
-static void ADBWriteCommand(uint8_t Command)
+static void ADBMouseReport(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
 {
+	uint16_t X, Y;
+	uint16_t Speed, SpeedY;
+	uint16_t Gain;
+	uint16_t Resolution;
+	uint8_t Address;
+	uint8_t Bits;
+	uint8_t Buttons;
 	uint8_t i;
 
-	/* Attention signal: low state for 800 us. */
-	WritePortPin(ADB_PORT, ADB_PIN, 0);
-	DelayMicroseconds(800);
-	/* Sync signal: high state for 70 us. */
-	WritePortPin(ADB_PORT, ADB_PIN, 1);
-	DelayMicroseconds(70);
-	/* Command byte: eight 100 us bit cells, MSB first. */
-	for (i = 0; i < 8; i++)
+	if ((Result != ADB_RESULT_OK) || (Length < 2))
+		return;
+	Address = (Command >> 4) & 0x0f;
+	/* Classic protocol: the first two bytes have button 1 and 2 in bit 7,
+	 * and 7 bits of Y and X movement respectively. See
+	 * https://developer.apple.com/legacy/library/technotes/hw/hw_01.html
+	 * section "Classic Apple Mouse Protocol" for more information. */
+	Y = Data[0] & 0x7f;
+	X = Data[1] & 0x7f;
+	Bits = 7;
+	Buttons = ((Data[0] >> 7) & 0x01) | ((Data[1] >> 6) & 0x02) | 0x04;
+	/* Extended protocol: each extra byte has another button in bit 7 and
+	 * bit 3, and 3 more bits of Y and X movement, most significant last.
+	 * Movement is at most 16 bits, so there are at most 3 extra bytes. */
+	if (MouseHandlers[Address] == ADB_MOUSE_HANDLER_EXTENDED)
 	{
-		if (Command & 0x80)
-			ADBWriteOneBit();
-		else
-			ADBWriteZeroBit();
-		Command <<= 1;
+		for (i = 2; (i < Length) && (i < 5); i++)
+		{
+			Y |= (uint16_t)((Data[i] >> 4) & 0x07) << Bits;
+			X |= (uint16_t)(Data[i] & 0x07) << Bits;
+			Bits += 3;
+			if (i == 2)
+			  Buttons = (Buttons & 0x03) | ((Data[i] >> 5) & 0x04);
+		}
 	}
-	/* Stop bit: always a 0 bit. */
-	ADBWriteZeroBit();
+	/* Sign extend, by moving the sign bit up to bit 15 and back. */
+	Y = (uint16_t)((int16_t)(Y << (16 - Bits)) >> (16 - Bits));
+	X = (uint16_t)((int16_t)(X << (16 - Bits)) >> (16 - Bits));
+
+	/* Buttons are 0 when pressed. */
+	Button1State = !(Buttons & 0x01);
+	Button2State = !(Buttons & 0x02);
+	Button3State = !(Buttons & 0x04);
+
+	/* Look up the gain for this speed. Both axes use the same gain, so that
+	 * the direction of movement doesn't change. */
+	Speed = ((int16_t)X < 0) ? (uint16_t)-X : X;
+	SpeedY = ((int16_t)Y < 0) ? (uint16_t)-Y : Y;
+	if (SpeedY > Speed)
+		Speed = SpeedY;
+	Resolution = MouseResolutions[Address];
+	if ((Resolution != 100) && (Resolution != 0))
+		Speed = (uint16_t)(((uint32_t)Speed * 100) / Resolution);
+	if (Speed >= ACCELERATION_STEPS)
+		Speed = ACCELERATION_STEPS - 1;
+	if (ADBMouseAccelProfile >= ADB_MOUSE_ACCEL_PROFILE_COUNT)
+		ADBMouseAccelProfile = ADB_MOUSE_ACCEL_OFF;
+	Gain = pgm_read_word(&AccelerationGains[ADBMouseAccelProfile][Speed]);
+
+	/* Accumulate X/Y values into AccumulatedX and AccumulatedY. */
+	Accumulate(&AccumulatedX, Accelerate((int16_t)X, Gain, &RemainderX[Address]));
+	Accumulate(&AccumulatedY, Accelerate((int16_t)Y, Gain, &RemainderY[Address]));
 }
 
-/** Wait until ADB line is in the specified state. The ADB port/pin must
- *  be set to input mode before calling this.
- *  \param[in]     DesiredLineState   0 = wait until line is low, 1 = wait
- *                                    until line is high.
- *  \return uint16_t Number of microseconds it took for the ADB line to
- *                   transition to the desired state, or ADB_TIMEOUT if a
- *                   timeout occurred.
+/** Called once register 1 of the mouse being set up has been read. This has
+ *  the mouse's resolution and number of buttons. Setup is then finished.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Contents of register 1, first byte first.
+ *  \param[in]     Length    Number of bytes in Data.
  */
-static uint16_t ADBWait(const uint8_t DesiredLineState)
+static void MouseSetupRegister1Done(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
 {
-	uint16_t StartTime, Microseconds;
-
-	Microseconds = 0;
-	StartTime = TCNT1;
-	while (READ_ADB_PIN != DesiredLineState)
+	(void)Command;
+	/* Bytes 0 to 3 are an ID, 4 and 5 are the resolution, 6 is the class
+	 * (mouse, trackball etc.) and 7 is the number of buttons. */
+	if ((Result == ADB_RESULT_OK) && (Length >= 8))
 	{
-		Microseconds = (TCNT1 - StartTime) / 2;
-		if (Microseconds >= ADB_TIMEOUT)
-			return ADB_TIMEOUT;
+		MouseResolutions[SetupAddress] = ((uint16_t)Data[4] << 8) | Data[5];
+		if (MouseResolutions[SetupAddress] == 0)
+			MouseResolutions[SetupAddress] = 100;
 	}
-	return Microseconds;
+	ADBBusSetupDone();
 }
 
-/** Read 16 data bits from the ADB data line.
- *  \param[in]     OutRegisterValue   The 16 data bits will be written here, if
- *                                    the operation was successful.
- *  \return uint8_t 1 if operation was successful valid, 0 if a timeout occurred.
+/** Ask the mouse being set up to switch to a protocol handler, by writing
+ *  the handler ID to register 3. The rest of register 3 is written with the
+ *  mouse's address, and service requests enabled, so that they stay the
+ *  same.
+ *  \param[in]     Handler   Register 3 handler ID to switch to.
  */
-static uint8_t ADBRead16(uint16_t *OutRegisterValue)
+static void MouseSetupTry(const uint8_t Handler)
 {
-	uint16_t LowDuration[18]; // timings for low state
-	uint16_t RegisterValue;
-	uint8_t i;
+	uint8_t NewRegister[2];
+
+	SetupHandler = Handler;
+	NewRegister[0] = ADB_R3_SRQ_ENABLE | SetupAddress;
+	NewRegister[1] = Handler;
+	ADBListen(SetupAddress, 3, NewRegister, 2, MouseSetupListenDone);
+}
 
-	/* Set ADB line to be input. This must be restored back to output mode
-	 * before returning from this function. */
-	SetPortPinDirection(ADB_PORT, ADB_PIN, 0);
-	/* Stop to Start (Tlt in AN591) wait time. The minimum time is 160 us, but
-	 * we only wait for 100 us so that there is time to get to the ADBWait()
-	 * call below. */
-	DelayMicroseconds(100);
-	/* Take timing measurements of the low state for the next 18 bits.
-	 * This includes the start bit (1), 16 data bits, and the stop bit (0). */
-	for (i = 0; i < 18; i++)
+/** Called once register 3 of the mouse being set up has been read back, to
+ *  check whether the mouse accepted the handler it was asked to switch to.
+ *  If it accepted the extended protocol, read its register 1. If it didn't,
+ *  try the 200 counts per inch classic protocol instead, and if it didn't
+ *  accept that either, it stays in the 100 counts per inch classic protocol.
+ *  \param[in]     Command   Command byte that was sent.
+ *  \param[in]     Result    How the transaction finished (see enum ADBResults).
+ *  \param[in]     Data      Contents of register 3, first byte first.
+ *  \param[in]     Length    Number of bytes in Data.
+ */
+static void MouseSetupCheckDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	(void)Command;
+	if ((Result == ADB_RESULT_OK) && (Length >= 2) && (Data[1] == SetupHandler))
 	{
-		/* Wait until ADB line goes low. */
-		if (ADBWait(0) == ADB_TIMEOUT)
-		{
-			/* Timeout waiting for line to go low. Set ADB line to be an output
-			 * and return 0 to indicate that a timeout occurred. */
-			SetPortPinDirection(ADB_PORT, ADB_PIN, 1);
-			return 0;
-		}
-		/* Wait until ADB line goes high. */
-		LowDuration[i] = ADBWait(1);
-		if (LowDuration[i] == ADB_TIMEOUT)
+		MouseHandlers[SetupAddress] = SetupHandler;
+		if (SetupHandler == ADB_MOUSE_HANDLER_EXTENDED)
 		{
-			/* Timeout waiting for line to go high. Set ADB line to be an output
-			 * and return 0 to indicate that a timeout occurred. */
-			SetPortPinDirection(ADB_PORT, ADB_PIN, 1);
-			return 0;
+			ADBTalk(SetupAddress, 1, MouseSetupRegister1Done);
+			return;
 		}
+		MouseResolutions[SetupAddress] = 200;
 	}
-	/* Restore ADB line back to being an output. */
-	SetPortPinDirection(ADB_PORT, ADB_PIN, 1);
-	/* Examine timing measurements to determine whether bits were 0 or 1. */
-	RegisterValue = 0;
-	for (i = 0; i < 16; i++)
+	else if (SetupHandler == ADB_MOUSE_HANDLER_EXTENDED)
 	{
-		RegisterValue <<= 1;
-		/* Need a " + 1" here to skip over the start bit */
-		if (LowDuration[i + 1] < ADB_THRESHOLD)
-			RegisterValue |= 0x01;
+		MouseSetupTry(ADB_MOUSE_HANDLER_CLASSIC_200);
+		return;
 	}
-	*OutRegisterValue = RegisterValue;
-	return 1; /* 1 = success */
+	ADBBusSetupDone();
 }
 
-/** Initialize/reset ADB mouse hardware. */
-void ADBMouseInit(void)
+/** Called once the mouse being set up has been asked to switch to a
+ *  protocol handler. Read back its register 3 to see if it did.
+ *  \param[in]     Command   Unused.
+ *  \param[in]     Result    Unused.
+ *  \param[in]     Data      Unused.
+ *  \param[in]     Length    Unused.
+ */
+static void MouseSetupListenDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
 {
-	/* Set ADB line to output mode, defaulting to a high state. */
-	SetPortPinDirection(ADB_PORT, ADB_PIN, 1);
-	WritePortPin(ADB_PORT, ADB_PIN, 1);
-	/* Give ADB controller time to start up. */
-	_delay_ms(10);
-
-	/* Reset trackball controller by holding ADB line low for at least 3 ms. */
-	WritePortPin(ADB_PORT, ADB_PIN, 0);
-	_delay_ms(4);
-	WritePortPin(ADB_PORT, ADB_PIN, 1);
+	(void)Command;
+	(void)Result;
+	(void)Data;
+	(void)Length;
+	ADBTalk(SetupAddress, 3, MouseSetupCheckDone);
 }
 
-/** Poll ADB-connected mouse for updates to its state. This will update
- *  Button1State, Button2State, AccumulatedX, and AccumulatedY accordingly.
- *  \return uint8_t 1 if mouse reported something (a change in its state),
- *                  0 if mouse did not report anything. A mouse has two
- *                  reasons for not reporting anything: the mouse state might
- *                  not have physically changed, or the controller is not
- *                  ready to be polled.
+/** Called by the bus manager to set up each mouse it found. Ask the mouse
+ *  to switch to the extended protocol handler first, as it has the most
+ *  resolution.
+ *  \param[in]     Address   Address of the mouse.
  */
-uint8_t ADBPollMouse(void)
+static void MouseSetup(const uint8_t Address)
 {
-	uint16_t RegisterValue;
-	uint8_t X, Y;
-	uint8_t valid;
+	SetupAddress = Address & 0x0f;
+	MouseHandlers[SetupAddress] = ADB_MOUSE_HANDLER_CLASSIC;
+	MouseResolutions[SetupAddress] = 100;
+	RemainderX[SetupAddress] = 0;
+	RemainderY[SetupAddress] = 0;
+	MouseSetupTry(ADB_MOUSE_HANDLER_EXTENDED);
+}
 
-	GlobalInterruptDisable();
-	/* Command 0x3c = 0b00111100:
-	 * 0011 = address, which is 3 - the default for mice,
-	 * 11 = command type, which is 3 - talk (i.e. read register),
-	 * 00 = register, which is 0, where classic Apple mice store button/pointer information. */
-	ADBWriteCommand(0x3c);
-	/* If the mouse has nothing to report (because nothing has changed), the
-	 * attempt to read the register will fail due to timeout. If a timeout
-	 * occurs, then we don't do anything. */
-	valid = ADBRead16(&RegisterValue);
-	GlobalInterruptEnable();
-	if (valid)
-	{
-		/* Parse the register value. See https://developer.apple.com/legacy/library/technotes/hw/hw_01.html
-		 * section "Classic Apple Mouse Protocol" for more information. */
-		Button1State = 0;
-		Button2State = 0;
-		if ((RegisterValue & 0x8000) == 0)
-		{
-			/* First button pressed. */
-			Button1State = 1;
-		}
-		if ((RegisterValue & 0x0080) == 0)
-		{
-			/* Second button pressed. */
-			Button2State = 1;
-		}
-		/* Accumulate X/Y values into AccumulatedX and AccumulatedY. */
-		X = (uint8_t)(RegisterValue & 0x007f);
-		Y = (uint8_t)((RegisterValue & 0x7f00) >> 8);
-		if (X < 0x40)
-		{
-			/* Positive X. */
-			AccumulatedX += X;
-			if (AccumulatedX > ACCUMULATED_MAX)
-				AccumulatedX = ACCUMULATED_MAX;
-		}
-		else
-		{
-			/* Negative X. */
-			AccumulatedX += (int16_t)X - (int16_t)0x80;
-			if (AccumulatedX < ACCUMULATED_MIN)
-				AccumulatedX = ACCUMULATED_MIN;
-		}
-		if (Y < 0x40)
-		{
-			/* Positive Y. */
-			AccumulatedY += Y;
-			if (AccumulatedY > ACCUMULATED_MAX)
-				AccumulatedY = ACCUMULATED_MAX;
-		}
-		else
-		{
-			/* Negative Y. */
-			AccumulatedY += (int16_t)Y - (int16_t)0x80;
-			if (AccumulatedY < ACCUMULATED_MIN)
-				AccumulatedY = ACCUMULATED_MIN;
-		}
-	}
-	return valid;
+/** Initialize ADB mouse handling. Any mice found by ADBBusInit() are polled
+ *  from then on, and all of them update the same state. */
+void ADBMouseInit(void)
+{
+	ADBBusRegister(ADB_MOUSE_ADDRESS, MouseSetup, ADBMouseReport);
 }
@@ -10,14 +10,34 @@
 
 #include <stdint.h>
 
+/* Macros: */
+/** Acceleration profile used from start-up (see enum ADBMouseAccelProfiles).
+ *  Movement is passed on unscaled by default, so that the host's own
+ *  acceleration isn't applied on top. Builds can opt in to a profile by
+ *  defining this, e.g. -DADB_MOUSE_ACCEL_DEFAULT=ADB_MOUSE_ACCEL_MEDIUM. */
+#ifndef ADB_MOUSE_ACCEL_DEFAULT
+#define ADB_MOUSE_ACCEL_DEFAULT		ADB_MOUSE_ACCEL_OFF
+#endif
+
+/** Acceleration profiles which can be selected with ADBMouseAccelProfile. */
+enum ADBMouseAccelProfiles
+{
+	ADB_MOUSE_ACCEL_OFF = 0,      /**< Movement is passed on unscaled. */
+	ADB_MOUSE_ACCEL_LOW,          /**< Fast movement is sped up by up to 1.5x. */
+	ADB_MOUSE_ACCEL_MEDIUM,       /**< Fast movement is sped up by up to 2x. */
+	ADB_MOUSE_ACCEL_HIGH,         /**< Slow movement is slowed to 0.75x, fast movement is sped up by up to 3x. */
+	ADB_MOUSE_ACCEL_PROFILE_COUNT /**< Number of profiles, not a profile itself. */
+};
+
 /* Exported Variables: */
 extern int16_t AccumulatedX;
 extern int16_t AccumulatedY;
 extern uint8_t Button1State;
 extern uint8_t Button2State;
+extern uint8_t Button3State;
+extern uint8_t ADBMouseAccelProfile;
 
 /* Function Prototypes: */
 extern void ADBMouseInit(void);
-extern uint8_t ADBPollMouse(void);
 
 #endif // #ifndef _ADB_MOUSE_H_
@@ -44,7 +44,8 @@
  *  the device will send, and what it may be sent back from the host. Refer to the HID specification for
  *  more details on HID report descriptors.
  *
- *  This descriptor describes the mouse HID interface's report structure.
+ *  This descriptor describes the mouse HID interface's report structure. X and Y movement are 16 bits if
+ *  MOUSE_REPORT_16BIT is 1 (see USB_MouseReport16_Data_t), otherwise 8 bits as in the boot mouse report.
  */
 const USB_Descriptor_HIDReport_Datatype_t PROGMEM MouseReport[] =
 {
@@ -67,18 +68,30 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM MouseReport[] =
 			HID_RI_USAGE_PAGE(8, 0x01), /* Generic Desktop */
 			HID_RI_USAGE(8, 0x30), /* Usage X */
 			HID_RI_USAGE(8, 0x31), /* Usage Y */
+#if MOUSE_REPORT_16BIT
+			HID_RI_LOGICAL_MINIMUM(16, -32767),
+			HID_RI_LOGICAL_MAXIMUM(16, 32767),
+			HID_RI_PHYSICAL_MINIMUM(16, -32767),
+			HID_RI_PHYSICAL_MAXIMUM(16, 32767),
+			HID_RI_REPORT_COUNT(8, 0x02),
+			HID_RI_REPORT_SIZE(8, 0x10),
+#else
 			HID_RI_LOGICAL_MINIMUM(16, -127),
 			HID_RI_LOGICAL_MAXIMUM(16, 127),
 			HID_RI_PHYSICAL_MINIMUM(16, -127),
 			HID_RI_PHYSICAL_MAXIMUM(16, 127),
 			HID_RI_REPORT_COUNT(8, 0x02),
 			HID_RI_REPORT_SIZE(8, 0x08),
+#endif
 			HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_RELATIVE),
 		HID_RI_END_COLLECTION(0),
 	HID_RI_END_COLLECTION(0),
 };
 
-/** Same as the MouseReport structure, but defines the keyboard HID interface's report structure. */
+/** Same as the MouseReport structure, but defines the keyboard HID interface's report structure. This is the
+ *  N-key rollover report (see USB_KeyboardNKROReport_Data_t), which is used when the host selects the report
+ *  protocol. In the boot protocol, the standard 8-byte boot keyboard report is used instead.
+ */
 const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
 {
 	HID_RI_USAGE_PAGE(8, 0x01), /* Generic Desktop */
@@ -105,13 +118,13 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
 		HID_RI_REPORT_SIZE(8, 0x03),
 		HID_RI_OUTPUT(8, HID_IOF_CONSTANT),
 		HID_RI_LOGICAL_MINIMUM(8, 0x00),
-		HID_RI_LOGICAL_MAXIMUM(8, 0x65),
+		HID_RI_LOGICAL_MAXIMUM(8, 0x01),
 		HID_RI_USAGE_PAGE(8, 0x07), /* Keyboard */
 		HID_RI_USAGE_MINIMUM(8, 0x00), /* Reserved (no event indicated) */
-		HID_RI_USAGE_MAXIMUM(8, 0x65), /* Keyboard Application */
-		HID_RI_REPORT_COUNT(8, 0x06),
-		HID_RI_REPORT_SIZE(8, 0x08),
-		HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_ARRAY | HID_IOF_ABSOLUTE),
+		HID_RI_USAGE_MAXIMUM(8, (KEYBOARD_NKRO_BITMAP_SIZE * 8) - 1),
+		HID_RI_REPORT_COUNT(8, KEYBOARD_NKRO_BITMAP_SIZE * 8),
+		HID_RI_REPORT_SIZE(8, 0x01),
+		HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
 	HID_RI_END_COLLECTION(0),
 };
 
@@ -159,7 +172,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.ConfigurationNumber    = 1,
 			.ConfigurationStrIndex  = NO_DESCRIPTOR,
 
-			.ConfigAttributes       = (USB_CONFIG_ATTR_RESERVED | USB_CONFIG_ATTR_SELFPOWERED),
+			.ConfigAttributes       = (USB_CONFIG_ATTR_RESERVED | USB_CONFIG_ATTR_SELFPOWERED | USB_CONFIG_ATTR_REMOTEWAKEUP),
 
 			.MaxPowerConsumption    = USB_CONFIG_POWER_MA(100)
 		},
@@ -197,8 +210,8 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 
 			.EndpointAddress        = KEYBOARD_IN_EPADDR,
 			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-			.EndpointSize           = HID_EPSIZE,
-			.PollingIntervalMS      = 10
+			.EndpointSize           = KEYBOARD_IN_EPSIZE,
+			.PollingIntervalMS      = HID_IN_POLLING_INTERVAL_MS
 		},
 
 	.HID1_ReportOUTEndpoint =
@@ -245,7 +258,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.EndpointAddress        = MOUSE_IN_EPADDR,
 			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 			.EndpointSize           = HID_EPSIZE,
-			.PollingIntervalMS      = 10
+			.PollingIntervalMS      = HID_IN_POLLING_INTERVAL_MS
 		}
 };
 
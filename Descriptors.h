@@ -42,6 +42,20 @@
 
 		#include <avr/pgmspace.h>
 
+	/* Macros: */
+		/** Number of bytes in the key bitmap of the N-key rollover keyboard report. This covers every keyboard
+		 *  scan code below the modifier keys (0x00 to 0xDF), which are reported separately.
+		 */
+		#define KEYBOARD_NKRO_BITMAP_SIZE 28
+
+		/** Set to 1 to use a mouse report with 16-bit X and Y movement when the host has selected the report
+		 *  protocol (see USB_MouseReport16_Data_t), so that large movements fit in a single report. Set to 0 to
+		 *  use the 8-bit boot mouse report in both protocols.
+		 */
+		#if !defined(MOUSE_REPORT_16BIT)
+			#define MOUSE_REPORT_16BIT    1
+		#endif
+
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
 		 *  application code, as the configuration descriptor contains several sub-descriptors which
@@ -63,6 +77,32 @@
 			USB_Descriptor_Endpoint_t             HID2_ReportINEndpoint;
 		} USB_Descriptor_Configuration_t;
 
+		/** Type define for the keyboard HID report sent when the host has selected the report protocol. This is an
+		 *  N-key rollover report, which has one bit for every key (rather than a short list of pressed keys), so
+		 *  any number of keys can be reported as pressed at once. Its layout is described by KeyboardReport.
+		 */
+		typedef struct
+		{
+			uint8_t Modifier; /**< Keyboard modifier byte, indicating pressed modifier keys (a combination of
+			                   *   \c HID_KEYBOARD_MODIFER_* masks).
+			                   */
+			uint8_t Reserved; /**< Reserved for OEM use, always set to 0. */
+			uint8_t KeyBitmap[KEYBOARD_NKRO_BITMAP_SIZE]; /**< One bit per key scan code, starting from scan code 0
+			                                               *   in the least significant bit of the first byte.
+			                                               */
+		} USB_KeyboardNKROReport_Data_t;
+
+		/** Type define for the mouse HID report sent when the host has selected the report protocol, and
+		 *  MOUSE_REPORT_16BIT is 1. This is the same as the boot mouse report, but with 16-bit X and Y movement.
+		 *  Its layout is described by MouseReport.
+		 */
+		typedef struct
+		{
+			uint8_t Button; /**< Button mask for currently pressed buttons in the mouse. */
+			int16_t X; /**< Current delta X movement of the mouse. */
+			int16_t Y; /**< Current delta Y movement on the mouse. */
+		} USB_MouseReport16_Data_t;
+
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
 		 *  should have a unique ID index associated with it, which can be used to refer to the
 		 *  interface from other descriptors.
@@ -94,9 +134,20 @@
 		/** Endpoint address of the Mouse HID reporting IN endpoint. */
 		#define MOUSE_IN_EPADDR           (ENDPOINT_DIR_IN  | 3)
 
-		/** Size in bytes of each of the HID reporting IN and OUT endpoints. */
+		/** Size in bytes of each of the HID reporting IN and OUT endpoints, except the Keyboard IN endpoint. */
 		#define HID_EPSIZE                8
 
+		/** Size in bytes of the Keyboard HID reporting IN endpoint. This must be large enough to hold the N-key
+		 *  rollover report.
+		 */
+		#define KEYBOARD_IN_EPSIZE        32
+
+		/** Polling interval in milliseconds requested for the Keyboard and Mouse HID reporting IN endpoints. At 1ms,
+		 *  the keyboard report is built in step with the USB start of frame, see Keyboard_HID_Task(). Set this to 10
+		 *  to go back to the slower polling rate.
+		 */
+		#define HID_IN_POLLING_INTERVAL_MS 1
+
 	/* Function Prototypes: */
 		uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 		                                    const uint16_t wIndex,
@@ -37,24 +37,314 @@
 
 #include <stdint.h>
 #include <util/delay.h>
+#include <util/atomic.h>
+#include <avr/sleep.h>
 #include "KeyboardMouse.h"
+#include "ADB.h"
+#include "ADBBus.h"
 #include "ADBMouse.h"
 #include "KeyboardSwitchMatrix.h"
 #include "Util.h"
+#include "Scheduler.h"
 
 /** Maximum number of non-modifier keys that can be pressed at once. This
  * is a limitation of the USB keyboard boot protocol, don't change this
- * unless you know what you're doing. */
+ * unless you know what you're doing. It doesn't apply to the N-key
+ * rollover report used by the report protocol. */
 #define MAX_KEYS_PRESSED		6
 
+/** Maximum number of non-modifier keys which are tracked as being held down at once. Presses beyond this are
+ *  ignored until some keys are released.
+ */
+#define MAX_ACTIVE_KEYS			32
+
+/** Time after each USB start of frame by which the keyboard report should have been built and written, in
+ *  microseconds, when the keyboard is polled every frame. Hosts usually send the IN tokens for interrupt endpoints
+ *  early in the frame, so by default the report is made ready just before the next start of frame.
+ */
+#define KEYBOARD_REPORT_READY_US	900
+
+/** Extra time allowed for a full matrix scan pass, on top of how long the last pass took, in microseconds. This
+ *  covers the time taken to build and write the report once the pass is done.
+ */
+#define KEYBOARD_SCAN_MARGIN_US		50
+
+/** Longest full matrix scan pass, in Timer1 counts, which can be finished by KEYBOARD_REPORT_READY_US when it is
+ *  started at the start of frame. Passes which take longer than this are counted in KeyboardScanOverruns.
+ */
+#define KEYBOARD_SCAN_BUDGET		((KEYBOARD_REPORT_READY_US - KEYBOARD_SCAN_MARGIN_US) * TIMER1_COUNTS_PER_US)
+
+/** Number of USB frames between one ADB mouse poll and the next. A poll where the mouse responds takes just over
+ *  4 ms, so polling more often than this would leave no time on the bus for anything else.
+ */
+#define MOUSE_POLL_INTERVAL_FRAMES	5
+
+/** Time after a USB start of frame by which each ADB mouse poll should have finished, in microseconds. As with
+ *  KEYBOARD_REPORT_READY_US, this is just before the next start of frame, so that the host's next IN token for the
+ *  mouse endpoint collects a report built from the freshest possible sample.
+ */
+#define MOUSE_SAMPLE_READY_US		900
+
+/** Extra time allowed for an ADB mouse poll, on top of how long the last one took, in microseconds. */
+#define MOUSE_POLL_MARGIN_US		100
+
+/** Number of keyboard reports which can be waiting to be written to the keyboard IN endpoint. This must be a
+ *  power of 2.
+ */
+#define KEYBOARD_REPORT_QUEUE_SIZE	4
+
+/** Number of banks used by each of the HID reporting IN endpoints. With two banks, the next report can be written
+ *  while the host is still to collect the last one.
+ */
+#define HID_IN_EPBANKS			2
+
+/** Macro to test whether a scan code is one of the modifier keys, which run contiguously from
+ *  HID_KEYBOARD_SC_LEFT_CONTROL to HID_KEYBOARD_SC_RIGHT_GUI in the same order as the report's Modifier bits.
+ */
+#define IS_MODIFIER_KEY(ScanCode)		(((ScanCode) & 0xF8) == HID_KEYBOARD_SC_LEFT_CONTROL)
+
+/** Macro to test whether the bit for a scan code is set in a bitmap of keys. */
+#define IS_KEY_BIT_SET(Bitmap, ScanCode)	((Bitmap)[(ScanCode) >> 3] & (1 << ((ScanCode) & 0x07)))
+
+/** Macro to set the bit for a scan code in a bitmap of keys. */
+#define SET_KEY_BIT(Bitmap, ScanCode)		((Bitmap)[(ScanCode) >> 3] |= (1 << ((ScanCode) & 0x07)))
+
 /** Global structure to hold the current keyboard interface HID report, for transmission to the host */
 static USB_KeyboardReport_Data_t KeyboardReportData;
 
-/** Global structure to hold the current mouse interface HID report, for transmission to the host */
+/** Global structure to hold the current keyboard interface N-key rollover HID report, for transmission to the host
+ *  when the report protocol is in use
+ */
+static USB_KeyboardNKROReport_Data_t KeyboardNKROReportData;
+
+/** Indicates if the keyboard interface is currently in report protocol mode (N-key rollover report) or boot
+ *  protocol mode (standard 8-byte boot keyboard report)
+ */
+static bool KeyboardUsingReportProtocol = true;
+
+/** Indicates if the mouse interface is currently in report protocol mode or boot protocol mode */
+static bool MouseUsingReportProtocol = true;
+
+/** Enum for the stages of a control request which are finished off by Control_Task(), rather than waited for. */
+enum ControlStates
+{
+	CONTROL_STATE_IDLE            = 0, /**< No control request in progress */
+	CONTROL_STATE_SETREPORT_DATA  = 1, /**< Waiting for the LED report in the data stage of a SetReport request */
+	CONTROL_STATE_STATUS_IN       = 2, /**< Waiting to send the status stage of a host to device request */
+	CONTROL_STATE_STATUS_OUT      = 3, /**< Waiting to receive the status stage of a device to host request */
+};
+
+/** Type define for a keyboard report waiting in KeyboardReportQueue to be written to the keyboard IN endpoint. */
+typedef struct
+{
+	uint8_t  Data[sizeof(USB_KeyboardNKROReport_Data_t)]; /**< Report, in whichever format the protocol used when it was built */
+	uint8_t  Size; /**< Size of the report in bytes */
+	uint16_t ScanTime; /**< Timer1 count when the matrix scan pass which the report was built from finished */
+} KeyboardQueuedReport_t;
+
+/** Global structure to hold the current mouse interface HID report, for transmission to the host. This is the boot
+ *  mouse report, which is used in the boot protocol, and in the report protocol unless MOUSE_REPORT_16BIT is 1.
+ */
 static USB_MouseReport_Data_t MouseReportData;
 
-/** This is used to stop the keyboard switch matrix from being polled/scanned too often. */
-static uint8_t KeyboardSuppressPolling;
+#if MOUSE_REPORT_16BIT
+/** Global structure to hold the current mouse interface HID report with 16-bit movement, for transmission to the host
+ *  when it has selected the report protocol.
+ */
+static USB_MouseReport16_Data_t MouseReport16Data;
+#endif
+
+/** Copy of the last keyboard report sent to the host, in whichever format the current protocol uses. A new report
+ *  is only sent when it differs from this, or the idle period has expired.
+ */
+static uint8_t PrevKeyboardReport[sizeof(USB_KeyboardNKROReport_Data_t)];
+
+/** Indicates if the next keyboard report must be sent even if it matches PrevKeyboardReport, as it is the first
+ *  report since the device was configured or the protocol was changed.
+ */
+static bool KeyboardReportForced;
+
+/** Mouse buttons in the last mouse report sent to the host. */
+static uint8_t PrevMouseButtons;
+
+/** Current idle period of the keyboard interface, in milliseconds. This is set by the host via a SetIdle HID
+ *  class request, and zero means reports are only sent on change.
+ */
+static uint16_t KeyboardIdleCount = 500;
+
+/** Current idle period of the mouse interface, in milliseconds. This is set by the host via a SetIdle HID
+ *  class request, and zero means reports are only sent on change.
+ */
+static uint16_t MouseIdleCount = 0;
+
+/** Milliseconds remaining until the keyboard idle period expires, counted down on each USB start of frame. When
+ *  this reaches zero, a report is sent even if nothing has changed.
+ */
+static volatile uint16_t KeyboardIdleMSRemaining;
+
+/** Milliseconds remaining until the mouse idle period expires, counted down on each USB start of frame. When
+ *  this reaches zero, a report is sent even if nothing has changed.
+ */
+static volatile uint16_t MouseIdleMSRemaining;
+
+/** Scan codes of the non-modifier keys which the keyboard report is built from, oldest press first. This is
+ *  kept up to date with the key events queued by the keyboard switch matrix scanner.
+ */
+static uint8_t ActiveKeys[MAX_ACTIVE_KEYS];
+
+/** Number of entries in ActiveKeys which are in use. */
+static uint8_t ActiveKeyCount;
+
+/** Modifier keys which the keyboard report is built from, in the format of the report's Modifier bitfield. */
+static uint8_t ActiveModifiers;
+
+/** Which keys have changed state since the last keyboard report was sent, as a bitmap indexed by scan code. */
+static uint8_t ReportKeyChanged[32];
+
+/** Stage of the current control request which Control_Task() is waiting for. */
+static uint8_t ControlState = CONTROL_STATE_IDLE;
+
+/** Indicates if a remote wakeup has been sent since the host last suspended the bus. */
+static bool RemoteWakeupSent;
+
+/** Value of FrameCount for the frame in which the next ADB mouse poll should finish, MOUSE_SAMPLE_READY_US after
+ *  its start of frame.
+ */
+static uint8_t MouseSampleFrame;
+
+/** Timer1 count at the most recent USB start of frame. */
+static volatile uint16_t FrameStartTime;
+
+/** Number of USB start of frame events seen, wrapping at 256. */
+static volatile uint8_t FrameCount;
+
+/** Value of FrameCount when the last full matrix scan pass for a keyboard report was started. */
+static uint8_t ScanFrame;
+
+/** Indicates if a full matrix scan pass for the next keyboard report is in progress. */
+static bool ScanInProgress;
+
+/** Indicates if a full matrix scan pass has finished since the last keyboard report was built. */
+static bool ScanFresh;
+
+/** Timer1 count when the last full matrix scan pass was started. */
+static uint16_t ScanStartTime;
+
+/** How long the last full matrix scan pass took, in Timer1 counts. */
+static uint16_t ScanDuration;
+
+/** Timer1 count when the last full matrix scan pass finished. */
+static uint16_t ReportScanTime;
+
+/** Keyboard reports built from the key events, waiting to be written to the keyboard IN endpoint, oldest first. */
+static KeyboardQueuedReport_t KeyboardReportQueue[KEYBOARD_REPORT_QUEUE_SIZE];
+
+/** Number of reports added to KeyboardReportQueue, wrapping at 256. */
+static uint8_t KeyboardReportQueueIn;
+
+/** Number of reports removed from KeyboardReportQueue, wrapping at 256. */
+static uint8_t KeyboardReportQueueOut;
+
+/** ScanTime of each keyboard report which has been written to the IN endpoint and not yet collected by the host,
+ *  oldest first.
+ */
+static uint16_t InFlightScanTime[HID_IN_EPBANKS];
+
+/** Number of entries in InFlightScanTime which are in use. */
+static uint8_t ReportsInFlight;
+
+/** Age of the last keyboard report collected by the host, in microseconds. This is the time from the end of the
+ *  matrix scan pass which the report was built from, to when its endpoint bank was found free. As the banks
+ *  are only checked by Keyboard_HID_Task(), this is an upper bound.
+ */
+uint16_t KeyboardReportAge;
+
+/** Largest value of KeyboardReportAge seen since the device was configured, in microseconds. */
+uint16_t KeyboardReportAgeMax;
+
+/** Number of full matrix scan passes which took too long to finish by KEYBOARD_REPORT_READY_US after the start of
+ *  frame, however early they were started, since the device was configured. While the last pass took that long,
+ *  passes are run back to back instead of once per frame. Wraps around to 0.
+ */
+uint16_t KeyboardScanOverruns;
+
+/** Time between when the last ADB mouse poll was planned to start and when it was started, in microseconds. This
+ *  is the jitter in the mouse sample timing, caused by other tasks and by waiting for the ADB bus.
+ */
+uint16_t MousePollLateness;
+
+/** Largest value of MousePollLateness seen since the device was configured, in microseconds. */
+uint16_t MousePollLatenessMax;
+
+/** Number of ADB mouse polls which were skipped because their frame had already passed, since the device was
+ *  configured. Wraps around to 0.
+ */
+uint8_t MousePollSlips;
+
+/** Writes a HID report of a size known at compile time to the currently selected endpoint. Unlike
+ *  Endpoint_Write_Stream_LE(), this doesn't check whether the bank is full after each byte, so it must only be used
+ *  when Endpoint_IsReadWriteAllowed() has just returned true and the report fits in one endpoint bank. As it is
+ *  always inlined with a constant Size, the switch below folds down to one store per byte.
+ *
+ *  \param[in] Buffer  Pointer to the report to write.
+ *  \param[in] Size    Size of the report in bytes, at most 32.
+ */
+static inline void Endpoint_Write_Report(const void* const Buffer,
+                                         const uint8_t Size) ATTR_ALWAYS_INLINE ATTR_NON_NULL_PTR_ARG(1);
+static inline void Endpoint_Write_Report(const void* const Buffer,
+                                         const uint8_t Size)
+{
+	const uint8_t* DataStream = (const uint8_t*)Buffer;
+
+	switch (Size)
+	{
+		case 32: Endpoint_Write_8(*(DataStream++));
+		case 31: Endpoint_Write_8(*(DataStream++));
+		case 30: Endpoint_Write_8(*(DataStream++));
+		case 29: Endpoint_Write_8(*(DataStream++));
+		case 28: Endpoint_Write_8(*(DataStream++));
+		case 27: Endpoint_Write_8(*(DataStream++));
+		case 26: Endpoint_Write_8(*(DataStream++));
+		case 25: Endpoint_Write_8(*(DataStream++));
+		case 24: Endpoint_Write_8(*(DataStream++));
+		case 23: Endpoint_Write_8(*(DataStream++));
+		case 22: Endpoint_Write_8(*(DataStream++));
+		case 21: Endpoint_Write_8(*(DataStream++));
+		case 20: Endpoint_Write_8(*(DataStream++));
+		case 19: Endpoint_Write_8(*(DataStream++));
+		case 18: Endpoint_Write_8(*(DataStream++));
+		case 17: Endpoint_Write_8(*(DataStream++));
+		case 16: Endpoint_Write_8(*(DataStream++));
+		case 15: Endpoint_Write_8(*(DataStream++));
+		case 14: Endpoint_Write_8(*(DataStream++));
+		case 13: Endpoint_Write_8(*(DataStream++));
+		case 12: Endpoint_Write_8(*(DataStream++));
+		case 11: Endpoint_Write_8(*(DataStream++));
+		case 10: Endpoint_Write_8(*(DataStream++));
+		case 9:  Endpoint_Write_8(*(DataStream++));
+		case 8:  Endpoint_Write_8(*(DataStream++));
+		case 7:  Endpoint_Write_8(*(DataStream++));
+		case 6:  Endpoint_Write_8(*(DataStream++));
+		case 5:  Endpoint_Write_8(*(DataStream++));
+		case 4:  Endpoint_Write_8(*(DataStream++));
+		case 3:  Endpoint_Write_8(*(DataStream++));
+		case 2:  Endpoint_Write_8(*(DataStream++));
+		case 1:  Endpoint_Write_8(*(DataStream++));
+	}
+}
+
+/** Sets the board LEDs. LEDs_SetAllLEDs() changes the LED port with a read-modify-write, and the ADB transmit
+ *  interrupt writes the ADB data line on the same port, so this must not be interrupted part way through.
+ *
+ *  \param[in] LEDMask  Mask of the board LEDs to turn on, the rest are turned off.
+ */
+static void SetStatusLEDs(const uint8_t LEDMask)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		LEDs_SetAllLEDs(LEDMask);
+	}
+}
 
 /** Main program entry point. This routine configures the hardware required by the application, then
  *  enters a loop to run the application tasks in sequence.
@@ -63,14 +353,17 @@ int main(void)
 {
 	SetupHardware();
 
-	LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
+	SetStatusLEDs(LEDMASK_USB_NOTREADY);
 	GlobalInterruptEnable();
 
 	for (;;)
 	{
 		Keyboard_HID_Task();
 		Mouse_HID_Task();
+		Control_Task();
+		Suspend_Task();
 		USB_USBTask();
+		SchedulerSleep();
 	}
 }
 
@@ -104,9 +397,13 @@ void SetupHardware(void)
 	TCCR1A = 0x00; // normal counting mode (just count up to 0xffff)
 	TCCR1B = (1 << CS01); // clock source = clkIO / 8 = 2 MHz
 	TCCR1C = 0x00; // no force output compare
+	OCR1A = TIMER1_COUNTS_PER_MS; // first millisecond tick, see GetMilliseconds()
+	TIFR1 = (1 << OCF1A); // discard any stale compare A match
+	TIMSK1 = (1 << OCIE1A); // enable compare A interrupt
 	
 	KeyboardInit();
 	
+	ADBBusInit();
 	ADBMouseInit();
 
 	USB_Init();
@@ -118,7 +415,7 @@ void SetupHardware(void)
 void EVENT_USB_Device_Connect(void)
 {
 	/* Indicate USB enumerating */
-	LEDs_SetAllLEDs(LEDMASK_USB_ENUMERATING);
+	SetStatusLEDs(LEDMASK_USB_ENUMERATING);
 }
 
 /** Event handler for the USB_Disconnect event. This indicates that the device is no longer connected to a host via
@@ -127,7 +424,38 @@ void EVENT_USB_Device_Connect(void)
 void EVENT_USB_Device_Disconnect(void)
 {
 	/* Indicate USB not ready */
-	LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
+	SetStatusLEDs(LEDMASK_USB_NOTREADY);
+
+	/* Abandon any control request in progress */
+	ControlState = CONTROL_STATE_IDLE;
+}
+
+/** Event handler for the USB_Reset event. This abandons any control request which Control_Task() was finishing
+ *  off, as the control endpoint is reset along with the bus.
+ */
+void EVENT_USB_Device_Reset(void)
+{
+	ControlState = CONTROL_STATE_IDLE;
+}
+
+/** Event handler for the USB_Suspend event. This is fired when the host suspends the bus, after which
+ *  Suspend_Task() puts the MCU to sleep until the bus is resumed or a key is pressed.
+ */
+void EVENT_USB_Device_Suspend(void)
+{
+	RemoteWakeupSent = false;
+
+	SchedulerRunNow(SCHEDULER_TASK_USB);
+}
+
+/** Event handler for the USB_WakeUp event. This is fired when the bus is resumed, and makes sure that the host is
+ *  sent the current state of the keyboard, as a key may have been pressed to wake it up.
+ */
+void EVENT_USB_Device_WakeUp(void)
+{
+	KeyboardReportForced = true;
+
+	SchedulerRunNow(SCHEDULER_TASK_KEYBOARD);
 }
 
 /** Event handler for the USB_ConfigurationChanged event. This is fired when the host sets the current configuration
@@ -138,25 +466,57 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	bool ConfigSuccess = true;
 
 	/* Setup Keyboard HID Report Endpoints */
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(KEYBOARD_IN_EPADDR, EP_TYPE_INTERRUPT, HID_EPSIZE, 1);
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(KEYBOARD_IN_EPADDR, EP_TYPE_INTERRUPT, KEYBOARD_IN_EPSIZE, HID_IN_EPBANKS);
 	ConfigSuccess &= Endpoint_ConfigureEndpoint(KEYBOARD_OUT_EPADDR, EP_TYPE_INTERRUPT, HID_EPSIZE, 1);
 
 	/* Setup Mouse HID Report Endpoint */
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(MOUSE_IN_EPADDR, EP_TYPE_INTERRUPT, HID_EPSIZE, 1);
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(MOUSE_IN_EPADDR, EP_TYPE_INTERRUPT, HID_EPSIZE, HID_IN_EPBANKS);
+
+	/* HID devices must start in the report protocol */
+	KeyboardUsingReportProtocol = true;
+	MouseUsingReportProtocol    = true;
+
+	/* Restart the keyboard report timing and instrumentation */
+	ScanInProgress       = false;
+	ScanFresh            = false;
+	ReportsInFlight      = 0;
+	KeyboardReportAgeMax = 0;
+	KeyboardScanOverruns = 0;
+
+	/* Restart the mouse poll timing and instrumentation */
+	MouseSampleFrame     = FrameCount + MOUSE_POLL_INTERVAL_FRAMES;
+	MousePollLatenessMax = 0;
+	MousePollSlips       = 0;
+
+	/* Discard any keyboard reports which were waiting to be sent */
+	KeyboardReportQueueOut = KeyboardReportQueueIn;
+
+	/* Restart the idle periods from their defaults, and send the first reports straight away */
+	KeyboardIdleCount    = 500;
+	MouseIdleCount       = 0;
+	KeyboardReportForced = true;
+	PrevMouseButtons     = 0;
+
+	/* Start of frame events set the phase of the matrix scan */
+	USB_Device_EnableSOFEvents();
 
 	/* Indicate endpoint configuration success or failure */
-	LEDs_SetAllLEDs(ConfigSuccess ? LEDMASK_USB_READY : LEDMASK_USB_ERROR);
+	SetStatusLEDs(ConfigSuccess ? LEDMASK_USB_READY : LEDMASK_USB_ERROR);
 }
 
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
  *  the device from the USB host before passing along unhandled control requests to the library for processing
- *  internally.
+ *  internally. Stages which depend on the host, other than the data stage of GetReport, are not waited for here
+ *  but left to Control_Task(), so that a slow host doesn't hold up the keyboard and mouse.
  */
 void EVENT_USB_Device_ControlRequest(void)
 {
 	uint8_t* ReportData;
 	uint8_t  ReportSize;
 
+	/* A new request replaces any which hadn't finished */
+	ControlState = CONTROL_STATE_IDLE;
+
 	/* Handle HID Class specific requests */
 	switch (USB_ControlRequest.bRequest)
 	{
@@ -168,13 +528,31 @@ void EVENT_USB_Device_ControlRequest(void)
 				/* Determine if it is the mouse or the keyboard data that is being requested */
 				if (!(USB_ControlRequest.wIndex))
 				{
-					ReportData = (uint8_t*)&KeyboardReportData;
-					ReportSize = sizeof(KeyboardReportData);
+					if (KeyboardUsingReportProtocol)
+					{
+						ReportData = (uint8_t*)&KeyboardNKROReportData;
+						ReportSize = sizeof(KeyboardNKROReportData);
+					}
+					else
+					{
+						ReportData = (uint8_t*)&KeyboardReportData;
+						ReportSize = sizeof(KeyboardReportData);
+					}
 				}
 				else
 				{
-					ReportData = (uint8_t*)&MouseReportData;
-					ReportSize = sizeof(MouseReportData);
+#if MOUSE_REPORT_16BIT
+					if (MouseUsingReportProtocol)
+					{
+						ReportData = (uint8_t*)&MouseReport16Data;
+						ReportSize = sizeof(MouseReport16Data);
+					}
+					else
+#endif
+					{
+						ReportData = (uint8_t*)&MouseReportData;
+						ReportSize = sizeof(MouseReportData);
+					}
 				}
 
 				/* Write the report data to the control endpoint */
@@ -191,27 +569,211 @@ void EVENT_USB_Device_ControlRequest(void)
 			{
 				Endpoint_ClearSETUP();
 
-				/* Wait until the LED report has been sent by the host */
-				while (!(Endpoint_IsOUTReceived()))
+				/* The LED report is read by Control_Task() once the host has sent it */
+				ControlState = CONTROL_STATE_SETREPORT_DATA;
+			}
+
+			break;
+		case HID_REQ_GetProtocol:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+
+				/* Write the current protocol flag of the keyboard or mouse interface to the host */
+				if (!(USB_ControlRequest.wIndex))
+				  Endpoint_Write_8(KeyboardUsingReportProtocol);
+				else
+				  Endpoint_Write_8(MouseUsingReportProtocol);
+
+				Endpoint_ClearIN();
+
+				/* The status stage is finished off by Control_Task() */
+				ControlState = CONTROL_STATE_STATUS_OUT;
+			}
+
+			break;
+		case HID_REQ_SetProtocol:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+
+				/* Set or clear the flag depending on what the host indicates that the current Protocol should be */
+				if (!(USB_ControlRequest.wIndex))
+				{
+					KeyboardUsingReportProtocol = (USB_ControlRequest.wValue != 0);
+
+					/* The report format has changed, so discard any reports in the old format which are waiting to
+					 * be sent, including those already written to the endpoint banks, and don't compare the next
+					 * report with the last one */
+					KeyboardReportQueueOut = KeyboardReportQueueIn;
+					Endpoint_ResetEndpoint(KEYBOARD_IN_EPADDR);
+					ReportsInFlight        = 0;
+					KeyboardReportForced   = true;
+				}
+				else
 				{
-					if (USB_DeviceState == DEVICE_STATE_Unattached)
-					  return;
+					MouseUsingReportProtocol = (USB_ControlRequest.wValue != 0);
 				}
+			}
+
+			break;
+		case HID_REQ_SetIdle:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+
+				/* Get idle period in MSB, IdleCount must be multiplied by 4 to get number of milliseconds */
+				if (!(USB_ControlRequest.wIndex))
+				  KeyboardIdleCount = ((USB_ControlRequest.wValue & 0xFF00) >> 6);
+				else
+				  MouseIdleCount = ((USB_ControlRequest.wValue & 0xFF00) >> 6);
+			}
+
+			break;
+		case HID_REQ_GetIdle:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
+			{
+				Endpoint_ClearSETUP();
+
+				/* Write the current idle duration to the host, must be divided by 4 before sent to host */
+				if (!(USB_ControlRequest.wIndex))
+				  Endpoint_Write_8(KeyboardIdleCount >> 2);
+				else
+				  Endpoint_Write_8(MouseIdleCount >> 2);
+
+				Endpoint_ClearIN();
+
+				/* The status stage is finished off by Control_Task() */
+				ControlState = CONTROL_STATE_STATUS_OUT;
+			}
+
+			break;
+	}
+}
+
+/** Suspend task. While the host has the bus suspended, this stops the keyboard and mouse from being polled,
+ *  and sleeps in the lowest power mode the wakeup sources allow. If a key is pressed and the host has enabled
+ *  remote wakeup, the host is woken up.
+ */
+void Suspend_Task(void)
+{
+	if (USB_DeviceState != DEVICE_STATE_Suspended)
+	  return;
+
+	/* Timer1 stops while asleep, so let any ADB transaction finish first, rather than leave the ADB data line held low */
+	while (ADBBusy())
+	  ADBTask();
+
+	KeyboardSuspend();
+
+	for (;;)
+	{
+		/* Interrupts are only enabled again on the instruction after sei, so a wakeup can't be missed
+		 * between checking the state and going to sleep */
+		cli();
+		if (USB_DeviceState != DEVICE_STATE_Suspended)
+		{
+			sei();
+			break;
+		}
+
+		set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+
+		if (!(RemoteWakeupSent) && USB_Device_RemoteWakeupEnabled && KeyboardNewKeyDown())
+		{
+			USB_Device_SendRemoteWakeup();
+			RemoteWakeupSent = true;
+		}
+	}
+
+	KeyboardResume();
+}
+
+/** Control endpoint task. This finishes off the stages of a control request which EVENT_USB_Device_ControlRequest()
+ *  left waiting on the host, without blocking, so it must be called repeatedly from the main loop.
+ */
+void Control_Task(void)
+{
+	/* Until the device is configured there are no start of frame events to wake the CPU, and control requests need
+	 * answering promptly, so don't let the CPU sleep */
+	if ((USB_DeviceState != DEVICE_STATE_Configured) || (ControlState != CONTROL_STATE_IDLE))
+	  SchedulerRunNow(SCHEDULER_TASK_USB);
+
+	if (ControlState == CONTROL_STATE_IDLE)
+	  return;
+
+	/* Select the Control Endpoint */
+	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+
+	/* The host has given up on the request and started a new one, which USB_USBTask() will process */
+	if (Endpoint_IsSETUPReceived())
+	{
+		ControlState = CONTROL_STATE_IDLE;
+		return;
+	}
 
+	switch (ControlState)
+	{
+		case CONTROL_STATE_SETREPORT_DATA:
+			if (Endpoint_IsOUTReceived())
+			{
 				/* Read in the LED report from the host */
 				uint8_t LEDStatus = Endpoint_Read_8();
 
 				Endpoint_ClearOUT();
-				Endpoint_ClearStatusStage();
+				ControlState = CONTROL_STATE_STATUS_IN;
 
 				/* Process the incoming LED report */
 				Keyboard_ProcessLEDReport(LEDStatus);
 			}
 
+			break;
+		case CONTROL_STATE_STATUS_IN:
+			if (Endpoint_IsINReady())
+			{
+				/* Send the zero length status packet */
+				Endpoint_ClearIN();
+				ControlState = CONTROL_STATE_IDLE;
+			}
+
+			break;
+		case CONTROL_STATE_STATUS_OUT:
+			if (Endpoint_IsOUTReceived())
+			{
+				/* Acknowledge the zero length status packet */
+				Endpoint_ClearOUT();
+				ControlState = CONTROL_STATE_IDLE;
+			}
+
 			break;
 	}
 }
 
+/** Event handler for the USB device Start Of Frame event. This records when the frame started, so that the next
+ *  keyboard report can be built just before the host asks for it, and counts down the idle periods.
+ */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+	FrameStartTime = ReadTimer1();
+	FrameCount++;
+
+	/* The keyboard task plans its next matrix scan pass from the start of frame */
+	SchedulerRunNow(SCHEDULER_TASK_KEYBOARD);
+
+	/* One millisecond has elapsed, decrement the idle time remaining counters if they have not already elapsed */
+	if (KeyboardIdleMSRemaining)
+	  KeyboardIdleMSRemaining--;
+
+	if (MouseIdleMSRemaining)
+	  MouseIdleMSRemaining--;
+}
+
 /** Processes a given Keyboard LED report from the host, and sets the board LEDs to match. Since the Keyboard
  *  LED report can be sent through either the control endpoint (via a HID SetReport request) or the HID OUT
  *  endpoint, the processing code is placed here to avoid duplicating it and potentially having different
@@ -225,89 +787,308 @@ void Keyboard_ProcessLEDReport(const uint8_t LEDStatus)
 	 * But the powerbook keyboard has no LEDs. So we don't do anything here. */
 }
 
+/** Updates ActiveKeys and ActiveModifiers to reflect a key being pressed or released.
+ *
+ *  \param[in] ScanCode  HID keyboard report scan code of the key.
+ *  \param[in] Pressed   true if the key was pressed, false if it was released.
+ */
+void Keyboard_SetKeyState(const uint8_t ScanCode,
+                          const bool Pressed)
+{
+	uint8_t i;
+
+	if (IS_MODIFIER_KEY(ScanCode))
+	{
+		if (Pressed)
+		  ActiveModifiers |=  (1 << (ScanCode & 0x07));
+		else
+		  ActiveModifiers &= ~(1 << (ScanCode & 0x07));
+
+		return;
+	}
+
+	if (Pressed)
+	{
+		if (ActiveKeyCount < MAX_ACTIVE_KEYS)
+		  ActiveKeys[ActiveKeyCount++] = ScanCode;
+
+		return;
+	}
+
+	/* Remove the released key, keeping the remaining keys in the order they were pressed */
+	for (i = 0; i < ActiveKeyCount; i++)
+	{
+		if (ActiveKeys[i] == ScanCode)
+		{
+			ActiveKeyCount--;
+			memmove(&ActiveKeys[i], &ActiveKeys[i + 1], ActiveKeyCount - i);
+			break;
+		}
+	}
+}
+
+/** Applies queued key events from the keyboard switch matrix scanner to ActiveKeys and ActiveModifiers. An event
+ *  is held back (along with all events after it) if its key has already changed state since the last report was
+ *  sent, so that a key which is pressed and released between two reports still appears in a report.
+ */
+void Keyboard_ApplyKeyEvents(void)
+{
+	struct KeyEvent Event;
+	uint16_t ScanCode; /* needs to be uint16_t so that we can loop over all 256 scan codes */
+
+	if (KeyEventQueueOverflow)
+	{
+		/* Some events were lost, so discard the rest and start again from the scanner's key states */
+		while (KeyboardPeekEvent(&Event))
+		  KeyboardRemoveEvent();
+
+		KeyEventQueueOverflow = 0;
+
+		ActiveKeyCount  = 0;
+		ActiveModifiers = 0;
+		for (ScanCode = 1; ScanCode < 256; ScanCode++)
+		{
+			if (KeyPressed[ScanCode])
+			  Keyboard_SetKeyState(ScanCode, true);
+		}
+
+		return;
+	}
+
+	while (KeyboardPeekEvent(&Event))
+	{
+		if (IS_KEY_BIT_SET(ReportKeyChanged, Event.ScanCode))
+		  break;
+
+		SET_KEY_BIT(ReportKeyChanged, Event.ScanCode);
+		Keyboard_SetKeyState(Event.ScanCode, Event.Pressed);
+		KeyboardRemoveEvent();
+	}
+}
+
+/** Builds the next keyboard HID report from ActiveKeys and ActiveModifiers. In the report protocol, this is the
+ *  N-key rollover report, stored in KeyboardNKROReportData. In the boot protocol, this is the boot keyboard report,
+ *  stored in KeyboardReportData. This takes time proportional to the number of keys held down. If more than
+ *  MAX_KEYS_PRESSED non-modifier keys are held down in the boot protocol, the ones pressed first are reported, so
+ *  that the keys already held aren't disturbed by new ones.
+ */
+void Keyboard_BuildReport(void)
+{
+	uint8_t UsedKeyCodes = ActiveKeyCount; /* current number of scan codes in report */
+	uint8_t i;
+
+	if (KeyboardUsingReportProtocol)
+	{
+		memset(&KeyboardNKROReportData, 0, sizeof(KeyboardNKROReportData));
+		KeyboardNKROReportData.Modifier = ActiveModifiers;
+		for (i = 0; i < UsedKeyCodes; i++)
+		{
+			if (ActiveKeys[i] < (KEYBOARD_NKRO_BITMAP_SIZE * 8))
+			  SET_KEY_BIT(KeyboardNKROReportData.KeyBitmap, ActiveKeys[i]);
+		}
+
+		return;
+	}
+
+	if (UsedKeyCodes > MAX_KEYS_PRESSED)
+	  UsedKeyCodes = MAX_KEYS_PRESSED;
+
+	memset(&KeyboardReportData, 0, sizeof(KeyboardReportData));
+	KeyboardReportData.Modifier = ActiveModifiers;
+	memcpy(KeyboardReportData.KeyCode, ActiveKeys, UsedKeyCodes);
+}
+
+/** Builds keyboard reports from the key events queued by the keyboard switch matrix scanner, and adds each one
+ *  that needs to be sent to KeyboardReportQueue. A key which changes state more than once since the last report
+ *  gets one report for each change, so that a quick press, release and press again all reach the host in order.
+ *  If KeyboardReportQueue fills up, the remaining key events are left for later.
+ */
+void Keyboard_QueueReports(void)
+{
+	struct KeyEvent Event;
+
+	do
+	{
+		KeyboardQueuedReport_t* QueuedReport;
+		uint8_t* ReportData;
+		uint8_t  ReportSize;
+		bool     SendReport = KeyboardReportForced;
+
+		/* Leave the key events where they are if there is no room for another report */
+		if ((uint8_t)(KeyboardReportQueueIn - KeyboardReportQueueOut) >= KEYBOARD_REPORT_QUEUE_SIZE)
+		  return;
+
+		/* Build the report from the next key events */
+		Keyboard_ApplyKeyEvents();
+		Keyboard_BuildReport();
+		memset(ReportKeyChanged, 0, sizeof(ReportKeyChanged));
+
+		if (KeyboardUsingReportProtocol)
+		{
+			ReportData = (uint8_t*)&KeyboardNKROReportData;
+			ReportSize = sizeof(KeyboardNKROReportData);
+		}
+		else
+		{
+			ReportData = (uint8_t*)&KeyboardReportData;
+			ReportSize = sizeof(KeyboardReportData);
+		}
+
+		/* Check if the idle period is set and has elapsed */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (KeyboardIdleCount && (!(KeyboardIdleMSRemaining)))
+			  SendReport = true;
+		}
+
+		/* Check to see if the report data has changed - if so a report MUST be sent */
+		if (memcmp(PrevKeyboardReport, ReportData, ReportSize) != 0)
+		  SendReport = true;
+
+		if (SendReport)
+		{
+			/* Save the current report data for later comparison to check for changes */
+			memcpy(PrevKeyboardReport, ReportData, ReportSize);
+			KeyboardReportForced = false;
+
+			/* Reset the idle time remaining counter */
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				KeyboardIdleMSRemaining = KeyboardIdleCount;
+			}
+
+			QueuedReport = &KeyboardReportQueue[KeyboardReportQueueIn & (KEYBOARD_REPORT_QUEUE_SIZE - 1)];
+			memcpy(QueuedReport->Data, ReportData, ReportSize);
+			QueuedReport->Size     = ReportSize;
+			QueuedReport->ScanTime = ReportScanTime;
+			KeyboardReportQueueIn++;
+		}
+	} while (KeyboardPeekEvent(&Event));
+}
+
 /** Keyboard task. This generates the next keyboard HID report for the host, and transmits it via the
  *  keyboard IN endpoint when the host is ready for more data. Additionally, it processes host LED status
  *  reports sent to the device via the keyboard OUT reporting endpoint.
  */
 void Keyboard_HID_Task(void)
 {
-	uint8_t UsedKeyCodes = 0; /* current number of scan codes in report */
-	uint16_t ScanCode; /* needs to be uint16_t so that we can loop over all 256 scan codes */
-	uint8_t i;
-
 	/* Device must be connected and configured for the task to run */
 	if (USB_DeviceState != DEVICE_STATE_Configured)
 		return;
 	
-	if (KeyboardSuppressPolling == 0)
+	/* KeyboardScanMatrix() never waits for the switch matrix to settle, so
+	 * it must be called repeatedly. Key presses and releases are queued as
+	 * they are found, and picked up when the next report is built. */
+	if (HID_IN_POLLING_INTERVAL_MS == 1)
 	{
-		KeyboardScanMatrix();
+		/* The host asks for a report every frame, so scan the matrix once
+		 * per frame, starting a full pass just in time for it to finish by
+		 * KEYBOARD_REPORT_READY_US after the start of frame. */
+		uint16_t CurrentFrameStartTime;
+		uint8_t  CurrentFrameCount;
+		uint16_t Now;
+		bool     ScanOverrun;
 
-		/* Build the report */
-		memset(&KeyboardReportData, 0, sizeof(KeyboardReportData));
-		for (ScanCode = 1; ScanCode < 256; ScanCode++)
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 		{
-			if (KeyPressed[ScanCode])
-			{
-				/* Check if it is a modifier key. If it is a modifier key, it
-				 * doesn't go into the KeyCode part of the report - it goes in
-				 * the Modifier bitfield. */
-				if (ScanCode == HID_KEYBOARD_SC_LEFT_CONTROL)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_LEFTCTRL;
-				else if (ScanCode == HID_KEYBOARD_SC_LEFT_SHIFT)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_LEFTSHIFT;
-				else if (ScanCode == HID_KEYBOARD_SC_LEFT_ALT)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_LEFTALT;
-				else if (ScanCode == HID_KEYBOARD_SC_LEFT_GUI)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_LEFTGUI;
-				else if (ScanCode == HID_KEYBOARD_SC_RIGHT_CONTROL)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_RIGHTCTRL;
-				else if (ScanCode == HID_KEYBOARD_SC_RIGHT_SHIFT)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_RIGHTSHIFT;
-				else if (ScanCode == HID_KEYBOARD_SC_RIGHT_ALT)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_RIGHTALT;
-				else if (ScanCode == HID_KEYBOARD_SC_RIGHT_GUI)
-					KeyboardReportData.Modifier |= HID_KEYBOARD_MODIFIER_RIGHTGUI;
-				else
-				{
-					/* Not a modifier key:
-					 * Put up to MAX_KEYS_PRESSED scan codes into the report */
-					if (UsedKeyCodes < MAX_KEYS_PRESSED)
-					{
-						KeyboardReportData.KeyCode[UsedKeyCodes++] = ScanCode;
-					}
-					else
-					{
-						/* Too many keys being pressed simultaneously. HID specification says
-						 * that all scan codes must be HID_KEYBOARD_SC_ERROR_ROLLOVER. */
-						for (i = 0; i < 6; i++)
-						{
-							KeyboardReportData.KeyCode[i] = HID_KEYBOARD_SC_ERROR_ROLLOVER;
-						}
-						break;
-					}
-				}
-			}
+			CurrentFrameStartTime = FrameStartTime;
+			CurrentFrameCount     = FrameCount;
 		}
-		
-		/* Only scan keyboard once per HID report. */
-		KeyboardSuppressPolling = 1;
+
+		Now = ReadTimer1();
+
+		/* If the last pass took too long to be finished by KEYBOARD_REPORT_READY_US even when started at the start of
+		 * frame, phasing passes to the frame would only add latency, so start each pass as soon as the last one ends */
+		ScanOverrun = (ScanDuration > KEYBOARD_SCAN_BUDGET);
+
+		if (!(ScanInProgress) && (ScanOverrun ||
+		    ((ScanFrame != CurrentFrameCount) &&
+		     ((uint16_t)(Now - CurrentFrameStartTime) + ScanDuration +
+		      (KEYBOARD_SCAN_MARGIN_US * TIMER1_COUNTS_PER_US) >= (KEYBOARD_REPORT_READY_US * TIMER1_COUNTS_PER_US)))))
+		{
+			ScanInProgress = true;
+			ScanFrame      = CurrentFrameCount;
+			ScanStartTime  = Now;
+		}
+
+		if (ScanInProgress && KeyboardScanMatrix())
+		{
+			Now            = ReadTimer1();
+			ScanDuration   = Now - ScanStartTime;
+			ReportScanTime = Now;
+			ScanInProgress = false;
+			ScanFresh      = true;
+
+			if (ScanDuration > KEYBOARD_SCAN_BUDGET)
+			  KeyboardScanOverruns++;
+		}
+
+		/* Sleep until the next settling delay ends, or until this frame's pass is due to start. Once this frame's
+		 * pass has finished, the next start of frame will wake the CPU. */
+		if (ScanInProgress)
+		  SchedulerRunAt(SCHEDULER_TASK_KEYBOARD, KeyboardScanWakeTime());
+		else if (ScanOverrun)
+		  SchedulerRunNow(SCHEDULER_TASK_KEYBOARD);
+		else if (ScanFrame != CurrentFrameCount)
+		  SchedulerRunAt(SCHEDULER_TASK_KEYBOARD, CurrentFrameStartTime - ScanDuration +
+		                 ((KEYBOARD_REPORT_READY_US - KEYBOARD_SCAN_MARGIN_US) * TIMER1_COUNTS_PER_US));
+	}
+	else
+	{
+		if (KeyboardScanMatrix())
+		{
+			ReportScanTime = ReadTimer1();
+			ScanFresh      = true;
+		}
+
+		/* Sleep until the next settling delay ends */
+		SchedulerRunAt(SCHEDULER_TASK_KEYBOARD, KeyboardScanWakeTime());
+	}
+
+	/* Only build reports once a full matrix scan pass has finished, so they are as fresh as possible */
+	if (ScanFresh)
+	{
+		ScanFresh = false;
+		Keyboard_QueueReports();
 	}
 
 	/* Select the Keyboard Report Endpoint */
 	Endpoint_SelectEndpoint(KEYBOARD_IN_EPADDR);
 
+	/* Each bank which has been freed since the last check held a report that the host has now collected, so
+	 * record how old it was */
+	while (ReportsInFlight > Endpoint_GetBusyBanks())
+	{
+		uint16_t ReportAge = (uint16_t)(ReadTimer1() - InFlightScanTime[0]) / TIMER1_COUNTS_PER_US;
+
+		KeyboardReportAge = ReportAge;
+		if (ReportAge > KeyboardReportAgeMax)
+		  KeyboardReportAgeMax = ReportAge;
+
+		memmove(&InFlightScanTime[0], &InFlightScanTime[1], (HID_IN_EPBANKS - 1) * sizeof(InFlightScanTime[0]));
+		ReportsInFlight--;
+	}
+
 	/* Check if Keyboard Endpoint Ready for Read/Write */
 	if (Endpoint_IsReadWriteAllowed())
 	{
-		/* Reset KeyboardSuppressPolling to resume scanning keyboard matrix. */
-		KeyboardSuppressPolling = 0;
-		
-		/* Write Keyboard Report Data */
-		Endpoint_Write_Stream_LE(&KeyboardReportData, sizeof(KeyboardReportData), NULL);
-
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
+		/* Write the oldest waiting report, if there is one */
+		if (KeyboardReportQueueOut != KeyboardReportQueueIn)
+		{
+			KeyboardQueuedReport_t* QueuedReport = &KeyboardReportQueue[KeyboardReportQueueOut & (KEYBOARD_REPORT_QUEUE_SIZE - 1)];
+
+			/* Write Keyboard Report Data */
+			if (QueuedReport->Size == sizeof(USB_KeyboardNKROReport_Data_t))
+			  Endpoint_Write_Report(QueuedReport->Data, sizeof(USB_KeyboardNKROReport_Data_t));
+			else
+			  Endpoint_Write_Report(QueuedReport->Data, sizeof(USB_KeyboardReport_Data_t));
+
+			/* Finalize the stream transfer to send the last packet */
+			Endpoint_ClearIN();
+
+			InFlightScanTime[ReportsInFlight++] = QueuedReport->ScanTime;
+			KeyboardReportQueueOut++;
+		}
 	}
 
 	/* Select the Keyboard LED Report Endpoint */
@@ -329,13 +1110,74 @@ void Keyboard_HID_Task(void)
  */
 void Mouse_HID_Task(void)
 {
+	uint16_t Now;
+
+	/* Start queued ADB transactions and finish off completed ones, which updates the mouse state */
+	ADBTask();
+
+	/* Carry on with ADB address resolution if it is waiting for the bus */
+	ADBBusTask();
+
 	/* Device must be connected and configured for the task to run */
 	if (USB_DeviceState != DEVICE_STATE_Configured)
+	{
+		if (ADBBusy())
+		  SchedulerRunAt(SCHEDULER_TASK_MOUSE, ADBWakeTime());
+
 		return;
+	}
 	
-	/* The trackball seems to respond most smoothly if it is continuously polled,
-	 * as opposed to only polling once per report. */
-	ADBPollMouse();
+	/* Poll the ADB bus once every MOUSE_POLL_INTERVAL_FRAMES frames, starting each poll so that it finishes just
+	 * before the host collects the next mouse report. How long polls take varies with the device's response, so the
+	 * start time is worked out from how long the last response took. */
+	{
+		uint16_t CurrentFrameStartTime;
+		uint8_t  CurrentFrameCount;
+		uint16_t PollStartTime;
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			CurrentFrameStartTime = FrameStartTime;
+			CurrentFrameCount     = FrameCount;
+		}
+
+		/* If the host missed some frames, or the bus was busy for too long, skip to the next poll that can still
+		 * be made on time */
+		if ((int8_t)(MouseSampleFrame - CurrentFrameCount) < 0)
+		{
+			MouseSampleFrame = CurrentFrameCount + MOUSE_POLL_INTERVAL_FRAMES;
+			MousePollSlips++;
+		}
+
+		PollStartTime = CurrentFrameStartTime - ADBBusPollDuration +
+		                ((uint8_t)(MouseSampleFrame - CurrentFrameCount) * TIMER1_COUNTS_PER_MS) +
+		                ((MOUSE_SAMPLE_READY_US - MOUSE_POLL_MARGIN_US) * TIMER1_COUNTS_PER_US);
+
+		Now = ReadTimer1();
+		if ((int16_t)(Now - PollStartTime) >= 0)
+		{
+			if (ADBBusPoll())
+			{
+				MousePollLateness = (Now - PollStartTime) / TIMER1_COUNTS_PER_US;
+				if (MousePollLateness > MousePollLatenessMax)
+				  MousePollLatenessMax = MousePollLateness;
+
+				MouseSampleFrame += MOUSE_POLL_INTERVAL_FRAMES;
+				ADBTask();
+			}
+			else if (!(ADBBusy()))
+			{
+				/* Nothing on the bus to poll, so don't wait around for it */
+				MouseSampleFrame += MOUSE_POLL_INTERVAL_FRAMES;
+				PollStartTime    += (MOUSE_POLL_INTERVAL_FRAMES * TIMER1_COUNTS_PER_MS);
+			}
+		}
+
+		if (ADBBusy())
+		  SchedulerRunAt(SCHEDULER_TASK_MOUSE, ADBWakeTime());
+		else
+		  SchedulerRunAt(SCHEDULER_TASK_MOUSE, PollStartTime);
+	}
 
 	/* Select the Mouse Report Endpoint */
 	Endpoint_SelectEndpoint(MOUSE_IN_EPADDR);
@@ -343,21 +1185,82 @@ void Mouse_HID_Task(void)
 	/* Check if Mouse Endpoint Ready for Read/Write */
 	if (Endpoint_IsReadWriteAllowed())
 	{
-		/* Build the Mouse Report. */
-		memset(&MouseReportData, 0, sizeof(MouseReportData));
-		MouseReportData.Button = Button1State | (Button2State << 1);
-		MouseReportData.X = (int8_t)AccumulatedX;
-		MouseReportData.Y = (int8_t)AccumulatedY;
-		/* Reset AccumulatedX/AccumulatedY so that ADBPollMouse() will begin
-		 * accumulating from 0 again. */
-		AccumulatedX = 0;
-		AccumulatedY = 0;
-		
-		/* Write Mouse Report Data */
-		Endpoint_Write_Stream_LE(&MouseReportData, sizeof(MouseReportData), NULL);
-
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
+		bool     SendReport = false;
+		int16_t  MaxMovement;
+		int16_t  X;
+		int16_t  Y;
+		uint8_t  Buttons;
+
+		/* Movement beyond what fits in one report is carried over to the next report, rather than lost */
+#if MOUSE_REPORT_16BIT
+		MaxMovement = MouseUsingReportProtocol ? 32767 : 127;
+#else
+		MaxMovement = 127;
+#endif
+		X = AccumulatedX;
+		if (X > MaxMovement)
+		  X = MaxMovement;
+		else if (X < -MaxMovement)
+		  X = -MaxMovement;
+
+		Y = AccumulatedY;
+		if (Y > MaxMovement)
+		  Y = MaxMovement;
+		else if (Y < -MaxMovement)
+		  Y = -MaxMovement;
+
+		Buttons = Button1State | (Button2State << 1) | (Button3State << 2);
+
+		/* Check if the idle period is set and has elapsed */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (MouseIdleCount && (!(MouseIdleMSRemaining)))
+			  SendReport = true;
+		}
+
+		/* Movement is relative, so a report only needs to be sent if
+		 * there is some, or the buttons have changed. */
+		if (X || Y || (Buttons != PrevMouseButtons))
+		  SendReport = true;
+
+		if (SendReport)
+		{
+			PrevMouseButtons = Buttons;
+
+			/* Reset the idle time remaining counter */
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				MouseIdleMSRemaining = MouseIdleCount;
+			}
+
+			/* Take the reported movement off AccumulatedX/AccumulatedY, leaving whatever didn't fit for the next
+			 * report. */
+			AccumulatedX -= X;
+			AccumulatedY -= Y;
+
+			/* Build and write the Mouse Report, in whichever format the current protocol uses */
+#if MOUSE_REPORT_16BIT
+			if (MouseUsingReportProtocol)
+			{
+				MouseReport16Data.Button = Buttons;
+				MouseReport16Data.X      = X;
+				MouseReport16Data.Y      = Y;
+
+				Endpoint_Write_Report(&MouseReport16Data, sizeof(MouseReport16Data));
+			}
+			else
+#endif
+			{
+				MouseReportData.Button = Buttons;
+				MouseReportData.X      = (int8_t)X;
+				MouseReportData.Y      = (int8_t)Y;
+
+				Endpoint_Write_Report(&MouseReportData, sizeof(MouseReportData));
+			}
+
+			/* Finalize the stream transfer to send the last packet */
+			Endpoint_ClearIN();
+		}
 	}
 }
 
@@ -59,14 +59,32 @@
 		/** LED mask for the library LED driver, to indicate that an error has occurred in the USB interface. */
 		#define LEDMASK_USB_ERROR           (LEDS_LED1 | LEDS_LED3)
 
+	/* Exported Variables: */
+		extern uint16_t KeyboardReportAge;
+		extern uint16_t KeyboardReportAgeMax;
+		extern uint16_t KeyboardScanOverruns;
+		extern uint16_t MousePollLateness;
+		extern uint16_t MousePollLatenessMax;
+		extern uint8_t  MousePollSlips;
+
 	/* Function Prototypes: */
 		void SetupHardware(void);
 		void Keyboard_ProcessLEDReport(const uint8_t LEDStatus);
+		void Keyboard_SetKeyState(const uint8_t ScanCode,
+		                          const bool Pressed);
+		void Keyboard_ApplyKeyEvents(void);
+		void Keyboard_BuildReport(void);
+		void Keyboard_QueueReports(void);
 		void Keyboard_HID_Task(void);
 		void Mouse_HID_Task(void);
+		void Control_Task(void);
+		void Suspend_Task(void);
 
 		void EVENT_USB_Device_Connect(void);
 		void EVENT_USB_Device_Disconnect(void);
+		void EVENT_USB_Device_Reset(void);
+		void EVENT_USB_Device_Suspend(void);
+		void EVENT_USB_Device_WakeUp(void);
 		void EVENT_USB_Device_ConfigurationChanged(void);
 		void EVENT_USB_Device_ControlRequest(void);
 		void EVENT_USB_Device_StartOfFrame(void);
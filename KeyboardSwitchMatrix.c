@@ -9,13 +9,15 @@
  *  Rows and column lines may not correspond to physical rows and columns.
  *
  *  To use this code, call KeyboardInit() once, then call KeyboardScanMatrix()
- *  periodically. KeyPressed will be updated with key states.
+ *  frequently. KeyPressed will be updated with key states.
  *
  *  This file is licensed as described by the file BSD.txt
  */
 
 #include <stdint.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include "KeyboardSwitchMatrix.h"
 #include "Util.h"
@@ -27,12 +29,58 @@
  *  correspond to the actual number of physical columns. */
 #define MATRIX_COLUMNS			16
 
-/** Number of rows to scan per HID report. This will determine how quickly
- *  key presses/releases will be detected. See the HID descriptor for the
- *  HID report interval (in milliseconds). Setting this too low will cause
- *  the keyboard to respond slowly. Setting this too high may cause key
- *  bounce issues. */
-#define ROWS_PER_REPORT			2
+/** Longest time (in microseconds) to wait after driving a row low, before
+ *  sampling the column pins. This lets the column voltages settle. The time
+ *  actually used is measured by KeyboardCalibrate(), which falls back to
+ *  this if the measurement fails. */
+#define ROW_SETTLE_TIME_MAX		100
+/** Shortest time (in microseconds) to wait after driving a row low, before
+ *  sampling the column pins. */
+#define ROW_SETTLE_TIME_MIN		5
+/** The settle time is this many times the slowest measured column rise
+ *  time, to allow for variation between scans. */
+#define ROW_SETTLE_SAFETY_FACTOR	2
+/** Number of times each column's rise time is measured by
+ *  KeyboardCalibrate(). The slowest measurement is used. */
+#define CALIBRATION_PASSES		4
+/** Time (in microseconds) to drive a row high after it has been sampled,
+ *  before returning it to the pulled-up state. */
+#define ROW_RELEASE_TIME		20
+
+/** Debounce algorithm: a press is reported as soon as it is sampled, and
+ *  a release is only reported once the switch has been sampled as released
+ *  for DEBOUNCE_RELEASE_MS. This gives the lowest press latency. */
+#define DEBOUNCE_EAGER_PRESS	0
+/** Debounce algorithm: a press or release is only reported once the switch
+ *  has been sampled in its new state for DEBOUNCE_PRESS_MS or
+ *  DEBOUNCE_RELEASE_MS respectively. This also rejects electrical noise. */
+#define DEBOUNCE_DEFERRED		1
+/** Which debounce algorithm to use, DEBOUNCE_EAGER_PRESS or
+ *  DEBOUNCE_DEFERRED. This can be set on the compiler command line. */
+#ifndef DEBOUNCE_MODE
+#define DEBOUNCE_MODE			DEBOUNCE_EAGER_PRESS
+#endif
+/** Time (in milliseconds) that a switch must stay pressed before the press
+ *  is reported. This is only used when DEBOUNCE_MODE is DEBOUNCE_DEFERRED.
+ *  Times are measured to the nearest millisecond and must be less than 256. */
+#define DEBOUNCE_PRESS_MS		5
+/** Time (in milliseconds) that a switch must stay released before the
+ *  release is reported. */
+#define DEBOUNCE_RELEASE_MS		5
+
+/** Number of key events which can be queued between the scanner and the
+ *  report builder. This must be a power of 2. */
+#define KEY_EVENT_QUEUE_SIZE	16
+
+/** Steps of the row scan sequence performed by KeyboardScanMatrix(). */
+enum ScanStates
+{
+	SCAN_STATE_DRIVE_ROW = 0, /**< Drive the current row (or every row, if idle) low. */
+	SCAN_STATE_SETTLE,        /**< Wait for columns to settle, then sample them and drive the row high. */
+	SCAN_STATE_RELEASE,       /**< Wait for the row to settle, then return it to the pulled-up state. */
+	SCAN_STATE_IDLE_SETTLE,   /**< Wait for columns to settle, then check for any key press and drive every row high. */
+	SCAN_STATE_IDLE_RELEASE   /**< Wait for the rows to settle, then return them to the pulled-up state. */
+};
 
 /** This is used to unambiguously specify a connection to an external pin. */
 struct GPIOPin
@@ -73,6 +121,20 @@ const struct GPIOPin ColumnPins[MATRIX_COLUMNS] = {
 	{5, 7}  /* PF7 */
 };
 
+/** Macro to quickly sample all column pins at once. This is used instead of
+ *  calling "ReadPortPin()" for each column in timing critical code. PB0-PB5
+ *  and PE6-PE7 end up in the upper byte of the result, and PF0-PF7 end up in
+ *  the lower byte. This must agree with ColumnPins and COLUMN_SAMPLE_SHIFT. */
+#define READ_COLUMN_PINS()		((uint16_t)(((PINB & 0x3f) | (PINE & 0xc0)) << 8) | PINF)
+/** How far a column pin on the specified port is shifted within the result of
+ *  READ_COLUMN_PINS(). */
+#define COLUMN_SAMPLE_SHIFT(port)	(((port) == 5) ? 0 : 8)
+/** Pin change interrupt mask (for PCMSK0) which covers the column pins on
+ *  port B. These are the only column pins which have pin change interrupts,
+ *  so the rest are checked by waking up on the watchdog timer instead, see
+ *  KeyboardSuspend(). */
+#define COLUMN_PCINT_MASK		0x3f
+
 /** Keyboard switch matrix that describes which switches connect a given
  *  row/column. For example, if the driver detects that row 2 is connected
  *  to column 5, then KeyboardMatrix[2][5] describes the key that was
@@ -132,27 +194,147 @@ static const uint8_t KeyboardMatrix[MATRIX_ROWS][MATRIX_COLUMNS] = {
  *  another key is pressed simultaneously. */
 #define IS_GHOST_FREE_COLUMN(x)		(((x) == 9) || ((x) == 10) || ((x) == 12) || ((x) == 13) || ((x) == 14))
 
+/** Evaluates to non-zero if more than one bit is set in x. */
+#define MORE_THAN_ONE_BIT(x)		((x) & ((x) - 1))
+
 /** Raw keyboard matrix state, keeping track of which switches in the keyboard
  *  matrix are currently pressed. This is "raw" in the sense that de-ghosting
- *  hasn't been applied yet. */
-static uint8_t RawSwitchPressed[MATRIX_ROWS][MATRIX_COLUMNS];
-/** Total number of raw switch presses in each row. */
-static uint8_t TotalInRow[MATRIX_ROWS];
-/** Total number of raw switch presses in each column. */
-static uint8_t TotalInColumn[MATRIX_COLUMNS];
-/** Whether a row has a ghost. 0 = no ghost, 1 = has ghost. If a row has a
- *  ghost then presses in that row will be ignored. */
-static uint8_t RowHasGhost[MATRIX_ROWS];
-/** Whether a column has a ghost. 0 = no ghost, 1 = has ghost. If a column has
- *  a ghost then presses in that column will be ignored. */
-static uint8_t ColumnHasGhost[MATRIX_COLUMNS];
+ *  hasn't been applied yet, though switch bounce has been filtered out by
+ *  DebounceRow(). There is one bitmap per row, laid out like the result of
+ *  READ_COLUMN_PINS(), with a bit set for each pressed switch. */
+static uint16_t RawRowPressed[MATRIX_ROWS];
+/** Switches which have been sampled in a different state to RawRowPressed,
+ *  and are waiting for their debounce time to expire. One bitmap per row,
+ *  laid out like RawRowPressed. */
+static uint16_t DebouncePending[MATRIX_ROWS];
+/** Lower 8 bits of GetMilliseconds() at the time each pending switch was
+ *  first sampled in its new state. This is indexed by row, then by bit
+ *  number within the result of READ_COLUMN_PINS(). */
+static uint8_t DebounceStartTime[MATRIX_ROWS][16];
+/** Debounced state of the switches in ghost-free columns, laid out like the
+ *  result of READ_COLUMN_PINS(). Each of those switches appears in every row,
+ *  so it has one debouncer here instead of one per row. */
+static uint16_t SharedPressed;
+/** Like DebouncePending, but for the switches in SharedPressed. */
+static uint16_t SharedPending;
+/** Like DebounceStartTime, but for the switches in SharedPressed. This is
+ *  indexed by bit number within the result of READ_COLUMN_PINS(). */
+static uint8_t SharedStartTime[16];
+/** Which rows have a ghost. Bit 0 = first row, bit 1 = second row etc. If a
+ *  row has a ghost then presses in that row will be ignored. */
+static uint8_t GhostRows;
+/** Which columns have a ghost, laid out like the result of
+ *  READ_COLUMN_PINS(). If a column has a ghost then presses in that column
+ *  will be ignored. */
+static uint16_t GhostColumns;
+/** Columns for which IS_GHOST_FREE_COLUMN() is true, laid out like the result
+ *  of READ_COLUMN_PINS(). This is filled in by KeyboardInit(). */
+static uint16_t GhostFreeColumns;
+/** Bit mask for each column within the result of READ_COLUMN_PINS(). This
+ *  is filled in from ColumnPins by KeyboardInit(). */
+static uint16_t ColumnMask[MATRIX_COLUMNS];
 /** Keeps track of which keys are pressed (1) or not pressed (0).
  *  This is indexed by (HID keyboard report) scan code. This is the
  *  post-processed version, which should be ghost-free. */
 uint8_t KeyPressed[256];
+/** Queue of key press/release events, in the order they were detected. The
+ *  scanner is the only writer of KeyEventQueueIn, and the report builder is
+ *  the only writer of KeyEventQueueOut, so no locking is needed. */
+static struct KeyEvent KeyEventQueue[KEY_EVENT_QUEUE_SIZE];
+/** Index into KeyEventQueue where the next event will be stored. This only
+ *  ever increases (wrapping around), so it must be masked before use. */
+static volatile uint8_t KeyEventQueueIn;
+/** Index into KeyEventQueue where the next event will be retrieved from.
+ *  This only ever increases (wrapping around), so it must be masked before
+ *  use. */
+static volatile uint8_t KeyEventQueueOut;
+/** Set to 1 if an event had to be discarded because KeyEventQueue was full.
+ *  KeyPressed is still correct, so the consumer of events should resync
+ *  with it and then clear this. */
+volatile uint8_t KeyEventQueueOverflow;
 /** Current keyboard matrix row that is being scanned. If no row is being
  *  scanned right now, then this is the next row to be scanned. */
 static uint8_t CurrentRow;
+/** Which step of the row scan sequence KeyboardScanMatrix() will perform next. */
+static enum ScanStates ScanState;
+/** Value of Timer1 when the current scan state was entered. This is used to
+ *  time the settling delays without busy-waiting. */
+static uint16_t StateStartTime;
+/** 0 if the last full scan found no pressed or bouncing switches, in which
+ *  case KeyboardScanMatrix() only checks whether any key is down, instead of
+ *  scanning each row. 1 otherwise. */
+static uint8_t MatrixActive;
+/** Whether the last "any key down" check found a pressed key. */
+static uint8_t IdleCheckFoundKey;
+/** Columns which have read low continuously since KeyboardSuspend(), laid
+ *  out like the result of READ_COLUMN_PINS(). Keys held down when the bus
+ *  was suspended are in these columns, so they are ignored by
+ *  KeyboardNewKeyDown() until they are released. */
+static uint16_t SuspendHeldColumns;
+/** Time (in Timer1 counts) that KeyboardCalibrate() measured each column
+ *  taking to rise from low to high through its pull-up, indexed by column.
+ *  255 means the column didn't rise within the measurement period. */
+uint8_t ColumnRiseTime[MATRIX_COLUMNS];
+/** Time (in Timer1 counts) to wait after driving a row low, before sampling
+ *  the column pins. This is set by KeyboardCalibrate(). */
+uint16_t RowSettleTime;
+
+/** Measure how long each column takes to rise back to a high state through
+ *  its pull-up, and use the slowest column to choose the smallest safe time
+ *  to wait between driving a row low and sampling the columns. This sets
+ *  ColumnRiseTime and RowSettleTime. The column pins must already be set as
+ *  inputs with pull-ups enabled. */
+static void KeyboardCalibrate(void)
+{
+	uint8_t Pass;
+	uint8_t i;
+	uint16_t Elapsed;
+	uint8_t SlowestRise;
+	uint16_t StartTime;
+
+	SlowestRise = 0;
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+	{
+		ColumnRiseTime[i] = 0;
+		for (Pass = 0; Pass < CALIBRATION_PASSES; Pass++)
+		{
+			/* Discharge the column by driving it low, like a pressed switch
+			 * in a scanned row would, then let the pull-up take it high
+			 * again, like releasing the row does. */
+			SetPortPinDirection(ColumnPins[i].port, ColumnPins[i].num, 1);
+			WritePortPin(ColumnPins[i].port, ColumnPins[i].num, 0);
+			DelayMicroseconds(10);
+			StartTime = ReadTimer1();
+			SetPortPinDirection(ColumnPins[i].port, ColumnPins[i].num, 0);
+			do
+			{
+				Elapsed = ReadTimer1() - StartTime;
+				if ((READ_COLUMN_PINS() & ColumnMask[i]) != 0)
+					break;
+			} while (Elapsed < 255);
+			if (Elapsed > 255)
+				Elapsed = 255;
+			if (Elapsed > ColumnRiseTime[i])
+				ColumnRiseTime[i] = (uint8_t)Elapsed;
+		}
+		if (ColumnRiseTime[i] > SlowestRise)
+			SlowestRise = ColumnRiseTime[i];
+	}
+
+	if (SlowestRise == 255)
+	{
+		/* A column never went high, so the measurement can't be trusted. */
+		RowSettleTime = ROW_SETTLE_TIME_MAX * TIMER1_COUNTS_PER_US;
+	}
+	else
+	{
+		RowSettleTime = (uint16_t)SlowestRise * ROW_SETTLE_SAFETY_FACTOR;
+		if (RowSettleTime < (ROW_SETTLE_TIME_MIN * TIMER1_COUNTS_PER_US))
+			RowSettleTime = ROW_SETTLE_TIME_MIN * TIMER1_COUNTS_PER_US;
+		if (RowSettleTime > (ROW_SETTLE_TIME_MAX * TIMER1_COUNTS_PER_US))
+			RowSettleTime = ROW_SETTLE_TIME_MAX * TIMER1_COUNTS_PER_US;
+	}
+}
 
 /** Initialise hardware which scans keyboard switch matrix. */
 void KeyboardInit(void)
@@ -174,139 +356,469 @@ void KeyboardInit(void)
 	for (i = 0; i < MATRIX_COLUMNS; i++)
 	{
 		SetPortPinDirection(ColumnPins[i].port, ColumnPins[i].num, 0);
+		ColumnMask[i] = (uint16_t)1 << (ColumnPins[i].num + COLUMN_SAMPLE_SHIFT(ColumnPins[i].port));
+		if (IS_GHOST_FREE_COLUMN(i))
+			GhostFreeColumns |= ColumnMask[i];
 	}
+
+	KeyboardCalibrate();
 }
 
 /** Check to see if any current key presses are possibly creating a
  *  ghost situation. A ghost situation is where certain combinations
  *  of simultaneous key presses causes spurious ghost presses to appear.
- *  This will update RowHasGhost and ColumnHasGhost accordingly. */
+ *  This will update GhostRows and GhostColumns accordingly.
+ *  This works on whole rows at a time, so its running time doesn't depend
+ *  on how many keys are pressed. */
 static void CheckForGhosts(void)
 {
-	uint8_t Row, Column;
-	uint8_t i, j;
+	uint16_t InOneRow; /* columns with at least one press */
+	uint16_t InTwoRows; /* columns with at least two presses */
+	uint16_t CornerColumns; /* columns containing a corner key */
+	uint16_t RowCorners;
+	uint16_t Ghosts;
+	uint8_t Row;
+	uint8_t RowMask;
+
+	InOneRow = 0;
+	InTwoRows = 0;
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		InTwoRows |= InOneRow & RawRowPressed[Row];
+		InOneRow |= RawRowPressed[Row];
+	}
+
+	CornerColumns = 0;
+	Ghosts = 0;
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		/* Each switch in the matrix is checked to see if it is provoking a ghosting situation.
+		 * A ghosting situation is where 3 keys are simultaneously pressed, where one of those
+		 * keys (the corner key) shares a row with another key, and the corner key also shares
+		 * a column with another key, like in this example ("x" = key press):
+		 * -----------------
+		 * ---x------x------
+		 * -----------------
+		 * ----------x------
+		 * -----------------
+		 * In the above example the top right press is the corner key.
+		 * The next lines detect corner keys, for a whole row at a time.
+		 */
+		if (!MORE_THAN_ONE_BIT(RawRowPressed[Row]))
+			continue;
+		RowCorners = RawRowPressed[Row] & InTwoRows & ~GhostFreeColumns;
+		if (RowCorners == 0)
+			continue;
+		/* If a key is provoking a ghosting situation, then suppress all subsequent key
+		 * presses in any row or column that also shares a row or column with the
+		 * corner key. Using the above example:
+		 * SUPPRESS SUPPRESS
+		 *    |      |
+		 *    v      v
+		 * -----------------
+		 * ---x------x------   <- SUPPRESS
+		 * -----------------
+		 * ----------x------   <- SUPPRESS
+		 * -----------------
+		 * Columns are suppressed here. Rows are suppressed below, once all
+		 * the corner keys are known.
+		 */
+		CornerColumns |= RowCorners;
+		Ghosts |= RawRowPressed[Row] & ~GhostFreeColumns;
+	}
+	GhostColumns = Ghosts;
 
-	memset(RowHasGhost, 0, sizeof(RowHasGhost));
-	memset(ColumnHasGhost, 0, sizeof(ColumnHasGhost));
+	GhostRows = 0;
+	if (CornerColumns == 0)
+		return;
+	RowMask = 1;
 	for (Row = 0; Row < MATRIX_ROWS; Row++)
 	{
-		for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+		if (RawRowPressed[Row] & CornerColumns)
+			GhostRows |= RowMask;
+		RowMask <<= 1;
+	}
+}
+
+/** Filter switch bounce out of a new sample of a group of switches, using
+ *  the algorithm selected by DEBOUNCE_MODE. Each switch is timed separately.
+ *  \param[in]     Sample      Which switches were sampled as pressed.
+ *  \param[in]     Debounced   Which switches are currently considered
+ *                             pressed.
+ *  \param[in,out] Pending     Which switches are waiting for their debounce
+ *                             time to expire.
+ *  \param[in,out] StartTime   When each pending switch was first sampled in
+ *                             its new state, indexed by bit number.
+ *  \return uint16_t Which switches should now be considered pressed.
+ */
+static uint16_t DebounceSwitches(const uint16_t Sample, uint16_t Debounced, uint16_t *Pending, uint8_t *StartTime)
+{
+	uint16_t Changed;
+	uint16_t StillPending;
+	uint16_t Mask;
+	uint8_t Bit;
+	uint8_t Now;
+	uint8_t Elapsed;
+
+	Changed = Sample ^ Debounced;
+#if (DEBOUNCE_MODE == DEBOUNCE_EAGER_PRESS)
+	/* Presses take effect straight away. */
+	Debounced |= Changed & Sample;
+	Changed &= ~Sample;
+#endif
+	/* Switches which have returned to their debounced state before their
+	 * debounce time expired were bouncing, so stop timing them. */
+	StillPending = *Pending & Changed;
+	if (Changed != 0)
+	{
+		Now = (uint8_t)GetMilliseconds();
+		Mask = 1;
+		for (Bit = 0; Bit < 16; Bit++)
 		{
-			if (IS_GHOST_FREE_COLUMN(Column))
-				continue;
-			/* Each switch in the matrix is checked to see if it is provoking a ghosting situation.
-			 * A ghosting situation is where 3 keys are simultaneously pressed, where one of those
-			 * keys (the corner key) shares a row with another key, and the corner key also shares
-			 * a column with another key, like in this example ("x" = key press):
-			 * -----------------
-			 * ---x------x------
-			 * -----------------
-			 * ----------x------
-			 * -----------------
-			 * In the above example the top right press is the corner key.
-			 * The next line detects corner keys.
-			 */
-			if (RawSwitchPressed[Row][Column] && (TotalInRow[Row] >= 2) && (TotalInColumn[Column] >= 2))
+			if (Changed & Mask)
 			{
-				/* If a key is provoking a ghosting situation, then suppress all subsequent key
-				 * presses in any row or column that also shares a row or column with the
-				 * corner key. Using the above example:
-				 * SUPPRESS SUPPRESS
-				 *    |      |
-				 *    v      v
-				 * -----------------
-				 * ---x------x------   <- SUPPRESS
-				 * -----------------
-				 * ----------x------   <- SUPPRESS
-				 * -----------------
-				 */
-				for (i = 0; i < MATRIX_ROWS; i++)
+				if (!(StillPending & Mask))
 				{
-					if (RawSwitchPressed[i][Column])
-						RowHasGhost[i] = 1;
+					/* Start timing a switch which has just changed state. */
+					StartTime[Bit] = Now;
+					StillPending |= Mask;
 				}
-				for (j = 0; j < MATRIX_COLUMNS; j++)
+				else
 				{
-					if (IS_GHOST_FREE_COLUMN(j))
-						continue;
-					if (RawSwitchPressed[Row][j])
-						ColumnHasGhost[j] = 1;
+					/* Accept the new state of a switch once it has been
+					 * stable for long enough. */
+					Elapsed = (uint8_t)(Now - StartTime[Bit]);
+					if (Elapsed >= ((Sample & Mask) ? DEBOUNCE_PRESS_MS : DEBOUNCE_RELEASE_MS))
+					{
+						Debounced ^= Mask;
+						StillPending &= ~Mask;
+					}
 				}
 			}
+			Mask <<= 1;
 		}
 	}
+	*Pending = StillPending;
+	return Debounced;
+}
+
+/** Filter switch bounce out of a new sample of the current row. Switches in
+ *  ghost-free columns are connected to every row, so they share a single
+ *  debouncer (SharedPressed) instead of being debounced once per row.
+ *  \param[in]     Sample   Which switches in the current row were sampled as
+ *                          pressed, laid out like RawRowPressed.
+ *  \return uint16_t Which switches in the current row should be considered
+ *                   pressed.
+ */
+static uint16_t DebounceRow(const uint16_t Sample)
+{
+	uint16_t Debounced;
+
+	Debounced = DebounceSwitches(Sample & ~GhostFreeColumns,
+		RawRowPressed[CurrentRow] & ~GhostFreeColumns,
+		&DebouncePending[CurrentRow], DebounceStartTime[CurrentRow]);
+	SharedPressed = DebounceSwitches(Sample & GhostFreeColumns, SharedPressed,
+		&SharedPending, SharedStartTime);
+	return Debounced | SharedPressed;
 }
 
-/** Scan some rows of the keyboard switch matrix, detecting pressed or
- *  released keys. This will update KeyPressed accordingly. */
-void KeyboardScanMatrix(void)
+/** Drive every row low, or release every row. This is used to check whether
+ *  any key at all is down, by sampling the columns while every row is low.
+ *  \param[in]     State   0 = drive rows low, 1 = drive rows high,
+ *                         2 = return rows to the pulled-up state.
+ */
+static void KeyboardSetAllRows(const uint8_t State)
 {
 	uint8_t i;
+
+	for (i = 0; i < MATRIX_ROWS; i++)
+	{
+		if (State == 2)
+		{
+			SetPortPinDirection(RowPins[i].port, RowPins[i].num, 0);
+		}
+		else
+		{
+			SetPortPinDirection(RowPins[i].port, RowPins[i].num, 1);
+			WritePortPin(RowPins[i].port, RowPins[i].num, State);
+		}
+	}
+}
+
+/** Add a key event to the end of KeyEventQueue. If the queue is full, the
+ *  event is discarded and KeyEventQueueOverflow is set.
+ *  \param[in]     ScanCode  HID keyboard report scan code of the key.
+ *  \param[in]     Pressed   1 if the key was pressed, 0 if it was released.
+ *  \param[in]     Time      Value of Timer1 when the key was sampled.
+ */
+static void KeyboardQueueEvent(const uint8_t ScanCode, const uint8_t Pressed, const uint16_t Time)
+{
+	struct KeyEvent *Event;
+	uint8_t In;
+
+	In = KeyEventQueueIn;
+	if ((uint8_t)(In - KeyEventQueueOut) >= KEY_EVENT_QUEUE_SIZE)
+	{
+		KeyEventQueueOverflow = 1;
+		return;
+	}
+	Event = &KeyEventQueue[In & (KEY_EVENT_QUEUE_SIZE - 1)];
+	Event->ScanCode = ScanCode;
+	Event->Pressed = Pressed;
+	Event->Time = Time;
+	/* Only make the event visible once it has been completely written. */
+	KeyEventQueueIn = In + 1;
+}
+
+/** Look at the oldest key event in the queue, without removing it.
+ *  \param[out]    OutEvent   The event will be copied here, if there is one.
+ *  \return uint8_t 1 if there was an event, 0 if the queue is empty.
+ */
+uint8_t KeyboardPeekEvent(struct KeyEvent *OutEvent)
+{
+	uint8_t Out;
+
+	Out = KeyEventQueueOut;
+	if (Out == KeyEventQueueIn)
+		return 0;
+	*OutEvent = KeyEventQueue[Out & (KEY_EVENT_QUEUE_SIZE - 1)];
+	return 1;
+}
+
+/** Remove the oldest key event from the queue. This should only be called
+ *  after KeyboardPeekEvent() has returned 1. */
+void KeyboardRemoveEvent(void)
+{
+	KeyEventQueueOut++;
+}
+
+/** Sample every column of the current row, which must already be driven low
+ *  and settled. This will update KeyPressed accordingly, and queue an event
+ *  for each key which changed state. */
+static void KeyboardSampleRow(void)
+{
 	uint8_t SwitchPressed;
 	uint8_t CurrentColumn;
-	uint16_t ScanCode; /* needs to be uint16_t so that we can loop over all 256 scan codes */
-	uint8_t SwitchChanged;
+	uint8_t ScanCode;
+	uint16_t ColumnSample;
+	uint16_t Mask;
+	uint16_t SampleTime;
 
-	/* Scan ROWS_PER_REPORT rows. */
-	for (i = 0; i < ROWS_PER_REPORT; i++)
+	/* Sample all columns at the same time. Column pins which are reading
+	 * low indicate a key press. */
+	SampleTime = ReadTimer1();
+	ColumnSample = DebounceRow(~READ_COLUMN_PINS());
+	/* Update raw keyboard state. Only check for ghosts if a switch state
+	 * changed, and then only once for the whole row. */
+	if (ColumnSample != RawRowPressed[CurrentRow])
 	{
-		/* Scan a row.
-		 * A row is activated by driving it low */
-		SetPortPinDirection(RowPins[CurrentRow].port, RowPins[CurrentRow].num, 1);
-		WritePortPin(RowPins[CurrentRow].port, RowPins[CurrentRow].num, 0);
-		_delay_us(100); /* let voltages settle */
-		for (CurrentColumn = 0; CurrentColumn < MATRIX_COLUMNS; CurrentColumn++)
+		RawRowPressed[CurrentRow] = ColumnSample;
+		CheckForGhosts();
+	}
+	for (CurrentColumn = 0; CurrentColumn < MATRIX_COLUMNS; CurrentColumn++)
+	{
+		Mask = ColumnMask[CurrentColumn];
+		ScanCode = KeyboardMatrix[CurrentRow][CurrentColumn];
+		if (GhostFreeColumns & Mask)
 		{
-			/* Check which column pins are reading low - this indicates a key press. */
-			/* Update raw keyboard state. */
-			SwitchPressed = 0;
-			if (ReadPortPin(ColumnPins[CurrentColumn].port, ColumnPins[CurrentColumn].num) == 0)
-			{
-				/* Key has been pressed */
-				SwitchPressed = 1;
-			}
-			else if (ScanCode != 0x00) /* ignore row/column combinations with no switch */
-			{
-				/* Key has been released */
-				SwitchPressed = 0;
-			}
-			SwitchChanged = 0;
-			if (!RawSwitchPressed[CurrentRow][CurrentColumn] && SwitchPressed)
-			{
-				/* Transition from unpressed -> pressed state. */
-				TotalInRow[CurrentRow]++;
-				TotalInColumn[CurrentColumn]++;
-				SwitchChanged = 1;
-			}
-			if (RawSwitchPressed[CurrentRow][CurrentColumn] && !SwitchPressed)
-			{
-				/* Transition from pressed -> unpressed state. */
-				TotalInRow[CurrentRow]--;
-				TotalInColumn[CurrentColumn]--;
-				SwitchChanged = 1;
-			}
-			RawSwitchPressed[CurrentRow][CurrentColumn] = SwitchPressed;
-			/* Only check for ghosts if a switch state changed, otherwise the
-			 * row scan takes too long and can lag. */
-			if (SwitchChanged)
-				CheckForGhosts();
-			/* Update post-processed keyboard state. */
-			ScanCode = KeyboardMatrix[CurrentRow][CurrentColumn];
-			if (!SwitchPressed ||
-				(!RowHasGhost[CurrentRow] && !ColumnHasGhost[CurrentColumn]))
-			{
-				KeyPressed[ScanCode] = SwitchPressed;
-			}
+			/* Every row has the same key in a ghost-free column, so use the
+			 * state of the one switch rather than this row's view of it.
+			 * Otherwise a row which was sampled (or suppressed by a ghost)
+			 * differently to the others would toggle the key within a
+			 * single pass. */
+			SwitchPressed = ((SharedPressed & Mask) != 0);
+			if ((KeyPressed[ScanCode] != SwitchPressed) && (ScanCode != 0x00))
+				KeyboardQueueEvent(ScanCode, SwitchPressed, SampleTime);
+			KeyPressed[ScanCode] = SwitchPressed;
+			continue;
+		}
+		SwitchPressed = ((ColumnSample & Mask) != 0);
+		/* Update post-processed keyboard state. */
+		if (!SwitchPressed ||
+			(!(GhostRows & (1 << CurrentRow)) && !(GhostColumns & Mask)))
+		{
+			if ((KeyPressed[ScanCode] != SwitchPressed) && (ScanCode != 0x00))
+				KeyboardQueueEvent(ScanCode, SwitchPressed, SampleTime);
+			KeyPressed[ScanCode] = SwitchPressed;
 		}
-		/* Deactivate row by driving it high (so that voltages settle quickly),
-		 * then returning it back into the pulled-up state. */
+	}
+}
+
+/** Advance the scan of the keyboard switch matrix, detecting pressed or
+ *  released keys. This will update KeyPressed accordingly.
+ *
+ *  This never waits for row/column voltages to settle. Instead, each call
+ *  performs whatever step of the row drive -> settle -> sample -> release
+ *  sequence is due (according to Timer1) and then returns immediately, so
+ *  it should be called often, e.g. on every pass through the main loop.
+ *  While no key is down, the same sequence is applied to every row at once,
+ *  and the per-row scan only resumes when a column reads low.
+ *  \return uint8_t 1 if the whole matrix has been scanned since the last
+ *                  time 1 was returned, 0 otherwise.
+ */
+uint8_t KeyboardScanMatrix(void)
+{
+	uint8_t i;
+
+	switch (ScanState)
+	{
+	case SCAN_STATE_DRIVE_ROW:
+		if ((CurrentRow == 0) && !MatrixActive)
+		{
+			/* Nothing was pressed last time, so instead of scanning each row,
+			 * drive every row low and see if any column reads low. */
+			KeyboardSetAllRows(0);
+			StateStartTime = ReadTimer1();
+			ScanState = SCAN_STATE_IDLE_SETTLE;
+			break;
+		}
+		/* Activate a row by driving it low. */
+		SetPortPinDirection(RowPins[CurrentRow].port, RowPins[CurrentRow].num, 1);
+		WritePortPin(RowPins[CurrentRow].port, RowPins[CurrentRow].num, 0);
+		StateStartTime = ReadTimer1();
+		ScanState = SCAN_STATE_SETTLE;
+		break;
+	case SCAN_STATE_SETTLE:
+		/* Let voltages settle before sampling the columns. */
+		if ((uint16_t)(ReadTimer1() - StateStartTime) < RowSettleTime)
+			break;
+		KeyboardSampleRow();
+		/* Deactivate row by driving it high (so that voltages settle quickly). */
 		WritePortPin(RowPins[CurrentRow].port, RowPins[CurrentRow].num, 1);
-		_delay_us(20); /* let voltages settle */
+		StateStartTime = ReadTimer1();
+		ScanState = SCAN_STATE_RELEASE;
+		break;
+	case SCAN_STATE_RELEASE:
+		/* Let voltages settle, then return the row back into the pulled-up
+		 * state. */
+		if ((uint16_t)(ReadTimer1() - StateStartTime) < (ROW_RELEASE_TIME * TIMER1_COUNTS_PER_US))
+			break;
 		SetPortPinDirection(RowPins[CurrentRow].port, RowPins[CurrentRow].num, 0);
+		ScanState = SCAN_STATE_DRIVE_ROW;
 		CurrentRow++;
 		if (CurrentRow >= MATRIX_ROWS)
 		{
 			CurrentRow = 0;
+			/* Decide whether the next scan can take the idle fast path. */
+			MatrixActive = (SharedPending != 0);
+			for (i = 0; i < MATRIX_ROWS; i++)
+			{
+				if (RawRowPressed[i] || DebouncePending[i])
+					MatrixActive = 1;
+			}
+			return 1;
 		}
+		break;
+	case SCAN_STATE_IDLE_SETTLE:
+		if ((uint16_t)(ReadTimer1() - StateStartTime) < RowSettleTime)
+			break;
+		IdleCheckFoundKey = (READ_COLUMN_PINS() != 0xffff);
+		KeyboardSetAllRows(1);
+		StateStartTime = ReadTimer1();
+		ScanState = SCAN_STATE_IDLE_RELEASE;
+		break;
+	case SCAN_STATE_IDLE_RELEASE:
+		if ((uint16_t)(ReadTimer1() - StateStartTime) < (ROW_RELEASE_TIME * TIMER1_COUNTS_PER_US))
+			break;
+		KeyboardSetAllRows(2);
+		/* If a key is down, go straight on to a full scan. Otherwise,
+		 * the whole matrix has been checked and found idle. */
+		MatrixActive = IdleCheckFoundKey;
+		ScanState = SCAN_STATE_DRIVE_ROW;
+		if (!IdleCheckFoundKey)
+			return 1;
+		break;
+	}
+	return 0;
+}
+
+/** Find out when KeyboardScanMatrix() next has something to do, so that the
+ *  CPU can sleep until then.
+ *  \return uint16_t Value of Timer1 when the current settling delay ends, or
+ *                   the current value of Timer1 if there is no delay.
+ */
+uint16_t KeyboardScanWakeTime(void)
+{
+	switch (ScanState)
+	{
+	case SCAN_STATE_SETTLE:
+	case SCAN_STATE_IDLE_SETTLE:
+		return StateStartTime + RowSettleTime;
+	case SCAN_STATE_RELEASE:
+	case SCAN_STATE_IDLE_RELEASE:
+		return StateStartTime + (ROW_RELEASE_TIME * TIMER1_COUNTS_PER_US);
+	default:
+		return ReadTimer1();
 	}
 }
+
+/** Get the switch matrix ready for the MCU to sleep while the USB bus is
+ *  suspended. Every row is driven low, so that pressing any key pulls its
+ *  column low. Pin change interrupts are armed on the columns which have
+ *  them, to wake the MCU straight away, and the watchdog timer is set to
+ *  wake the MCU every 16 ms so that the other columns can be checked by
+ *  calling KeyboardNewKeyDown(). Call KeyboardResume() before scanning the
+ *  matrix again. */
+void KeyboardSuspend(void)
+{
+	KeyboardSetAllRows(0);
+
+	/* Note which keys are already down, so that they don't count as new
+	 * presses. Suspend is rare, so just wait for the columns to settle. */
+	StateStartTime = ReadTimer1();
+	while ((uint16_t)(ReadTimer1() - StateStartTime) < RowSettleTime)
+		;
+	SuspendHeldColumns = ~READ_COLUMN_PINS();
+
+	PCMSK0 = COLUMN_PCINT_MASK;
+	PCIFR = (1 << PCIF0); /* discard any stale pin change */
+	PCICR |= (1 << PCIE0);
+
+	/* Watchdog timer in interrupt mode (no reset), 2K cycles = 16 ms. */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		wdt_reset();
+		WDTCSR = (1 << WDCE) | (1 << WDE);
+		WDTCSR = (1 << WDIE);
+	}
+}
+
+/** Check whether a key has been pressed while the matrix is suspended. Keys
+ *  which were already down at KeyboardSuspend() don't count until they have
+ *  been released. Another key in the same column as a held key can't be told
+ *  apart from it, so it doesn't count either. This must only be called
+ *  between KeyboardSuspend() and KeyboardResume().
+ *  \return uint8_t 1 if a column has gone low since it was last checked
+ *                  and found high, 0 otherwise.
+ */
+uint8_t KeyboardNewKeyDown(void)
+{
+	uint16_t Down;
+
+	Down = ~READ_COLUMN_PINS();
+	SuspendHeldColumns &= Down;
+	return ((Down & ~SuspendHeldColumns) != 0);
+}
+
+/** Undo KeyboardSuspend(), and restart scanning from the first row. A full
+ *  scan is done first, so that a key which woke the MCU is found straight
+ *  away. */
+void KeyboardResume(void)
+{
+	PCICR &= ~(1 << PCIE0);
+	PCMSK0 = 0;
+	wdt_disable();
+
+	KeyboardSetAllRows(2);
+	CurrentRow = 0;
+	ScanState = SCAN_STATE_DRIVE_ROW;
+	MatrixActive = 1;
+}
+
+/** Pin change interrupt on a port B column, while suspended. This only needs
+ *  to wake the MCU. */
+EMPTY_INTERRUPT(PCINT0_vect);
+
+/** Watchdog timer interrupt, while suspended. This only needs to wake the
+ *  MCU. */
+EMPTY_INTERRUPT(WDT_vect);
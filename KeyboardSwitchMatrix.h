@@ -8,11 +8,30 @@
 #ifndef _KEYBOARD_SWITCH_MATRIX_H_
 #define _KEYBOARD_SWITCH_MATRIX_H_
 
+#include <stdint.h>
+
+/** A key press or release, as detected by KeyboardScanMatrix(). */
+struct KeyEvent
+{
+	uint8_t ScanCode; /* HID keyboard report scan code */
+	uint8_t Pressed; /* 1 = pressed, 0 = released */
+	uint16_t Time; /* value of Timer1 when the key was sampled */
+};
+
 /* Exported Variables: */
 extern uint8_t KeyPressed[256];
+extern volatile uint8_t KeyEventQueueOverflow;
+extern uint8_t ColumnRiseTime[16];
+extern uint16_t RowSettleTime;
 
 /* Function Prototypes: */
 extern void KeyboardInit(void);
-extern void KeyboardScanMatrix(void);
+extern uint8_t KeyboardScanMatrix(void);
+extern uint16_t KeyboardScanWakeTime(void);
+extern uint8_t KeyboardPeekEvent(struct KeyEvent *OutEvent);
+extern void KeyboardRemoveEvent(void);
+extern void KeyboardSuspend(void);
+extern uint8_t KeyboardNewKeyDown(void);
+extern void KeyboardResume(void);
 
 #endif // #ifndef _KEYBOARD_SWITCH_MATRIX_H_
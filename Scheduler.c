@@ -0,0 +1,176 @@
+/** \file
+ *
+ *  Lets the main loop sleep between work items. On each pass through the
+ *  main loop, every task tells the scheduler when it next has work to do,
+ *  by calling SchedulerRunNow() or SchedulerRunAt(). A task which is only
+ *  waiting on an interrupt (such as the USB start of frame) doesn't need to
+ *  call either, as the interrupt handler calls SchedulerRunNow() instead.
+ *  SchedulerSleep() is then called at the end of the pass, and
+ *  puts the CPU in idle sleep until the earliest deadline, or until any
+ *  interrupt occurs. The deadline is timed with Timer1's compare B unit.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "Scheduler.h"
+#include "Util.h"
+
+/** Deadlines closer than this (in microseconds) are not worth sleeping for,
+ *  as the time taken to go to sleep and wake up again would use most of it. */
+#define SCHEDULER_MIN_SLEEP_US	10
+
+/** Number of times the CPU was woken by each task's deadline, indexed by
+ *  task (see enum SchedulerTasks). Wraps around to 0. */
+uint16_t SchedulerTaskWakes[SCHEDULER_TASK_COUNT];
+/** Number of times the CPU was woken before any deadline was reached, by an
+ *  interrupt which gave a task work to do (see SchedulerRunNow()). Wraps
+ *  around to 0. */
+uint16_t SchedulerOtherWakes;
+/** Number of times the CPU was woken before any deadline was reached, by an
+ *  interrupt which gave no task work to do, such as the millisecond tick.
+ *  Wraps around to 0. */
+uint16_t SchedulerTickWakes;
+/** Number of main loop passes where the CPU didn't sleep at all, because a
+ *  task had work to do straight away. Wraps around to 0. */
+uint16_t SchedulerBusyPasses;
+/** Longest time (in microseconds) between a deadline and the CPU waking up
+ *  for it. */
+uint16_t SchedulerMaxLateness;
+
+/** Whether a task or an interrupt handler called SchedulerRunNow() during
+ *  this pass. */
+static volatile uint8_t RunNowRequested;
+/** Whether a task called SchedulerRunAt() during this pass. */
+static uint8_t WakeTimeRequested;
+/** Earliest value of Timer1 passed to SchedulerRunAt() during this pass. */
+static uint16_t WakeTime;
+/** Task which asked for WakeTime. */
+static uint8_t WakeTask;
+
+/** Tell the scheduler that a task has work to do straight away, so the CPU
+ *  must not sleep at the end of this main loop pass. Interrupt handlers which
+ *  give a task work must call this too, in case the task has already looked
+ *  for work during this pass.
+ *  \param[in]     Task      Which task has work to do (see enum SchedulerTasks).
+ */
+void SchedulerRunNow(const uint8_t Task)
+{
+	(void)Task;
+	RunNowRequested = 1;
+}
+
+/** Tell the scheduler that a task next has work to do when Timer1 reaches
+ *  the specified value. This must be less than 32 ms away.
+ *  \param[in]     Task      Which task has work to do (see enum SchedulerTasks).
+ *  \param[in]     Time      Value of Timer1 when the task has work to do.
+ */
+void SchedulerRunAt(const uint8_t Task, const uint16_t Time)
+{
+	if (!WakeTimeRequested || ((int16_t)(Time - WakeTime) < 0))
+	{
+		WakeTime = Time;
+		WakeTask = Task;
+		WakeTimeRequested = 1;
+	}
+}
+
+/** Sleep until the earliest deadline given to SchedulerRunAt() during this
+ *  main loop pass, or until any interrupt occurs, whichever is first. This
+ *  returns straight away if SchedulerRunNow() was called. Call this once at
+ *  the end of each pass.
+ */
+void SchedulerSleep(void)
+{
+	uint16_t Lateness;
+	uint8_t TooSoon;
+	uint8_t Slept;
+
+	if (RunNowRequested)
+	{
+		SchedulerBusyPasses++;
+		RunNowRequested = 0;
+		WakeTimeRequested = 0;
+		return;
+	}
+
+	if (WakeTimeRequested)
+	{
+		/* OCR1B is written through the 16-bit TEMP register, which
+		 * interrupt handlers reading Timer1 also use, and TIMSK1 is also
+		 * changed by interrupts (see ADB.c), so arm the compare match with
+		 * interrupts disabled. */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			OCR1B = WakeTime;
+			TIFR1 = (1 << OCF1B); /* discard any stale compare B match */
+			/* If the deadline passed before the compare B match was armed,
+			 * the match would never happen (until Timer1 wraps around). If
+			 * it passes after this check, the pending interrupt will wake
+			 * the CPU as soon as it sleeps. */
+			TooSoon = ((int16_t)(WakeTime - ReadTimer1()) < (SCHEDULER_MIN_SLEEP_US * TIMER1_COUNTS_PER_US));
+			if (!TooSoon)
+				TIMSK1 |= (1 << OCIE1B);
+		}
+		if (TooSoon)
+		{
+			SchedulerBusyPasses++;
+			WakeTimeRequested = 0;
+			return;
+		}
+	}
+
+	/* An interrupt which gave a task work after the check above has already
+	 * happened, so it won't wake the CPU. Check again with interrupts
+	 * disabled: they are only enabled again on the instruction after sei, so
+	 * no interrupt can be missed between here and going to sleep. */
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	Slept = !RunNowRequested;
+	if (Slept)
+	{
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	else
+	{
+		sei();
+		SchedulerBusyPasses++;
+	}
+
+	if (WakeTimeRequested)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			TIMSK1 &= ~(1 << OCIE1B);
+		}
+		Lateness = ReadTimer1() - WakeTime;
+		if (Slept && ((int16_t)Lateness >= 0))
+		{
+			SchedulerTaskWakes[WakeTask]++;
+			Lateness /= TIMER1_COUNTS_PER_US;
+			if (Lateness > SchedulerMaxLateness)
+				SchedulerMaxLateness = Lateness;
+			Slept = 0;
+		}
+		WakeTimeRequested = 0;
+	}
+	if (Slept)
+	{
+		if (RunNowRequested)
+			SchedulerOtherWakes++;
+		else
+			SchedulerTickWakes++;
+	}
+	RunNowRequested = 0;
+}
+
+/** Timer1 compare B interrupt, which fires at the deadline passed to
+ *  SchedulerRunAt(). This only needs to wake the CPU. */
+EMPTY_INTERRUPT(TIMER1_COMPB_vect);
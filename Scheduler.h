@@ -0,0 +1,35 @@
+/** \file
+ *
+ *  Defines things exported by Scheduler.c
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdint.h>
+
+/** Tasks which can ask the scheduler to wake the CPU. Each has its own wake
+ *  counter in SchedulerTaskWakes. */
+enum SchedulerTasks
+{
+	SCHEDULER_TASK_KEYBOARD = 0, /**< Keyboard switch matrix scan and reports */
+	SCHEDULER_TASK_MOUSE,        /**< ADB mouse polls and reports */
+	SCHEDULER_TASK_USB,          /**< USB control requests and enumeration */
+	SCHEDULER_TASK_COUNT         /**< Number of tasks, not a task itself */
+};
+
+/* Exported Variables: */
+extern uint16_t SchedulerTaskWakes[SCHEDULER_TASK_COUNT];
+extern uint16_t SchedulerOtherWakes;
+extern uint16_t SchedulerTickWakes;
+extern uint16_t SchedulerBusyPasses;
+extern uint16_t SchedulerMaxLateness;
+
+/* Function Prototypes: */
+extern void SchedulerRunNow(const uint8_t Task);
+extern void SchedulerRunAt(const uint8_t Task, const uint16_t Time);
+extern void SchedulerSleep(void);
+
+#endif // #ifndef _SCHEDULER_H_
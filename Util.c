@@ -8,8 +8,14 @@
 
 #include <stdint.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "Util.h"
 
+/** Number of milliseconds since Timer1 was started. This is incremented by
+ *  the Timer1 compare A interrupt, and will wrap around to 0. */
+static volatile uint16_t MillisecondCount;
+
 /** Configure GPIO pin as an input (with pull-up) or as an output.
  *  \param[in]     Port      0 = PORTA, 1 = PORTB, 2 = PORTC etc.
  *  \param[in]     Num       0 = pin 0 of the specified port, 1 = pin 1 of the specified port etc.
@@ -146,9 +152,55 @@ void DelayMicroseconds(uint16_t MicroSeconds)
 	uint16_t StartTime, CurrentTime, DesiredCount;
 
 	DesiredCount = MicroSeconds * 2; /* assume counter counts at a rate of 2 MHz */
-	StartTime = TCNT1;
+	StartTime = ReadTimer1();
 	do
 	{
-		CurrentTime = TCNT1;
+		CurrentTime = ReadTimer1();
 	} while ((CurrentTime - StartTime) < DesiredCount);
 }
+
+/** Read the current value of Timer1. Reading TCNT1 directly is not safe
+ *  when interrupts are enabled, because the 16-bit access goes through a
+ *  temporary register which is shared with every other 16-bit Timer1
+ *  register (see the Timer1 interrupt below).
+ *  \return uint16_t Value of TCNT1. This counts at a rate of 2 MHz.
+ */
+uint16_t ReadTimer1(void)
+{
+	uint16_t Count;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		Count = TCNT1;
+	}
+	return Count;
+}
+
+/** Get the number of milliseconds which have elapsed since Timer1 was
+ *  started. This is intended for measuring intervals, so callers should
+ *  only look at the difference between two values.
+ *  \return uint16_t Millisecond count. This wraps around to 0 after 65535.
+ */
+uint16_t GetMilliseconds(void)
+{
+	uint16_t Count;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		Count = MillisecondCount;
+	}
+	return Count;
+}
+
+/** Timer1 compare A interrupt, which occurs every millisecond. The compare
+ *  point is moved forward each time, since Timer1 is left free-running for
+ *  use as a timing reference. If interrupts were disabled for more than a
+ *  millisecond, this catches up on the milliseconds which were missed. */
+ISR(TIMER1_COMPA_vect)
+{
+	do
+	{
+		OCR1A += TIMER1_COUNTS_PER_MS;
+		MillisecondCount++;
+	} while ((int16_t)(TCNT1 - OCR1A) >= 0);
+}
@@ -10,10 +10,19 @@
 
 #include <stdint.h>
 
+/* Macros: */
+/** Number of Timer1 counts per microsecond. Timer1 is set up by
+ *  SetupHardware() to count at 2 MHz. */
+#define TIMER1_COUNTS_PER_US	2
+/** Number of Timer1 counts per millisecond. */
+#define TIMER1_COUNTS_PER_MS	(1000 * TIMER1_COUNTS_PER_US)
+
 /* Function Prototypes: */
 extern void SetPortPinDirection(const uint8_t Port, const uint8_t Num, const uint8_t IsOutput);
 extern void WritePortPin(const uint8_t Port, const uint8_t Num, const uint8_t Val);
 extern uint8_t ReadPortPin(const uint8_t Port, const uint8_t Num);
 extern void DelayMicroseconds(uint16_t MicroSeconds);
+extern uint16_t ReadTimer1(void);
+extern uint16_t GetMilliseconds(void);
 
 #endif // #ifndef _KEYBOARD_MOUSE_UTIL_H_
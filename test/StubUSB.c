@@ -0,0 +1,260 @@
+/** \file
+ *
+ *  A fake USB device, standing in for the LUFA device and endpoint
+ *  functions. Each IN endpoint has as many banks as it was configured with.
+ *  A packet fills a bank when the firmware calls Endpoint_ClearIN(), and
+ *  is recorded when the test polls the endpoint with StubUSBPoll(), like a
+ *  host polling an interrupt endpoint, which frees the bank again. Packets
+ *  on the control endpoint are recorded straight away. The test hands the
+ *  firmware a packet from the host with StubUSBOut(), and signals a new
+ *  SETUP packet on the control endpoint with StubUSBSetup().
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include <LUFA/Drivers/USB/USB.h>
+
+/** What the fake device knows about one endpoint. */
+struct StubEndpoint
+{
+	/** 1 if the endpoint was configured as an IN endpoint. */
+	uint8_t In;
+	/** Number of banks, and how many hold packets waiting for the host. */
+	uint8_t Banks;
+	uint8_t BusyBanks;
+	/** The packets waiting for the host, oldest first. */
+	struct StubUSBPacket Waiting[STUB_USB_BANKS];
+	/** The packet being written. */
+	struct StubUSBPacket Current;
+	/** 1 if a packet from the host is waiting to be read and cleared. */
+	uint8_t OUTReceived;
+	/** The packet from the host, and how much of it has been read. */
+	struct StubUSBPacket Received;
+	uint8_t ReceivedRead;
+	/** Number of packets sent. Only the last STUB_USB_PACKETS are kept. */
+	uint16_t Sent;
+	struct StubUSBPacket Packets[STUB_USB_PACKETS];
+};
+
+volatile uint8_t USB_DeviceState;
+USB_Request_Header_t USB_ControlRequest;
+bool USB_Device_RemoteWakeupEnabled;
+/** Number of remote wakeups the firmware has sent. */
+unsigned int StubRemoteWakeups;
+/** Every endpoint, indexed by endpoint number. */
+static struct StubEndpoint Endpoints[STUB_USB_ENDPOINTS];
+/** Endpoint number chosen with Endpoint_SelectEndpoint(). */
+static uint8_t SelectedEndpoint;
+/** 1 if a SETUP packet is waiting on the control endpoint. */
+static uint8_t SETUPReceived;
+
+/** Forget every packet, and go back to being configured, with no endpoints
+ *  set up. */
+void StubUSBReset(void)
+{
+	memset(Endpoints, 0, sizeof(Endpoints));
+	SelectedEndpoint = 0;
+	SETUPReceived = 0;
+	USB_Device_RemoteWakeupEnabled = false;
+	StubRemoteWakeups = 0;
+	USB_DeviceState = DEVICE_STATE_Configured;
+}
+
+/** Record a packet as sent to the host.
+ *  \param[in,out] Endpoint   Endpoint it was sent on.
+ *  \param[in]     Packet     The packet.
+ */
+static void StubUSBRecord(struct StubEndpoint *Endpoint, const struct StubUSBPacket *Packet)
+{
+	Endpoint->Packets[Endpoint->Sent % STUB_USB_PACKETS] = *Packet;
+	Endpoint->Sent++;
+}
+
+/** Poll an IN endpoint, collecting the oldest packet waiting in its banks,
+ *  if there is one.
+ *  \param[in]     Address   Endpoint address.
+ */
+void StubUSBPoll(const uint8_t Address)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[Address & (STUB_USB_ENDPOINTS - 1)];
+
+	if (Endpoint->BusyBanks)
+	{
+		StubUSBRecord(Endpoint, &Endpoint->Waiting[0]);
+		Endpoint->BusyBanks--;
+		memmove(&Endpoint->Waiting[0], &Endpoint->Waiting[1], Endpoint->BusyBanks * sizeof(Endpoint->Waiting[0]));
+	}
+}
+
+/** Send a packet from the host to an OUT endpoint, or in the data or status
+ *  stage of a control request. It replaces any packet the firmware hasn't
+ *  cleared yet.
+ *  \param[in]     Address   Endpoint address.
+ *  \param[in]     Data      The packet.
+ *  \param[in]     Length    Its length, which may be 0.
+ */
+void StubUSBOut(const uint8_t Address, const void *Data, const uint8_t Length)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[Address & (STUB_USB_ENDPOINTS - 1)];
+
+	Endpoint->Received.Length = (Length < STUB_USB_PACKET_SIZE) ? Length : STUB_USB_PACKET_SIZE;
+	memcpy(Endpoint->Received.Data, Data, Endpoint->Received.Length);
+	Endpoint->ReceivedRead = 0;
+	Endpoint->OUTReceived = 1;
+}
+
+/** Start a new control request, which the firmware sees with
+ *  Endpoint_IsSETUPReceived(). */
+void StubUSBSetup(void)
+{
+	SETUPReceived = 1;
+}
+
+/** Count the packets the host has collected from an endpoint.
+ *  \param[in]     Address   Endpoint address.
+ *  \return uint16_t Number of packets collected since StubUSBReset().
+ */
+uint16_t StubUSBPacketCount(const uint8_t Address)
+{
+	return Endpoints[Address & (STUB_USB_ENDPOINTS - 1)].Sent;
+}
+
+/** Look at a packet the host has collected from an endpoint.
+ *  \param[in]     Address   Endpoint address.
+ *  \param[in]     Index     0 for the first packet collected, and so on.
+ *                           This must be one of the last STUB_USB_PACKETS.
+ *  \return const struct StubUSBPacket* The packet.
+ */
+const struct StubUSBPacket *StubUSBPacket(const uint8_t Address, const uint16_t Index)
+{
+	return &Endpoints[Address & (STUB_USB_ENDPOINTS - 1)].Packets[Index % STUB_USB_PACKETS];
+}
+
+void USB_Init(void)
+{
+}
+
+void USB_USBTask(void)
+{
+}
+
+void USB_Device_EnableSOFEvents(void)
+{
+}
+
+void USB_Device_SendRemoteWakeup(void)
+{
+	StubRemoteWakeups++;
+}
+
+bool Endpoint_ConfigureEndpoint(const uint8_t Address, const uint8_t Type, const uint16_t Size, const uint8_t Banks)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[Address & (STUB_USB_ENDPOINTS - 1)];
+
+	if (((Address & ~ENDPOINT_DIR_IN) >= STUB_USB_ENDPOINTS) || (Size > STUB_USB_PACKET_SIZE) ||
+	    (Banks < 1) || (Banks > STUB_USB_BANKS))
+	{
+		return false;
+	}
+
+	Endpoint->In = ((Address & ENDPOINT_DIR_IN) != 0);
+	Endpoint->Banks = Banks;
+	Endpoint->BusyBanks = 0;
+	return true;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t Address)
+{
+	SelectedEndpoint = Address & (STUB_USB_ENDPOINTS - 1);
+}
+
+bool Endpoint_IsReadWriteAllowed(void)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[SelectedEndpoint];
+
+	if (!(Endpoint->In))
+	  return Endpoint->OUTReceived;
+	return (Endpoint->BusyBanks < Endpoint->Banks);
+}
+
+bool Endpoint_IsSETUPReceived(void)
+{
+	return (SelectedEndpoint == ENDPOINT_CONTROLEP) && SETUPReceived;
+}
+
+bool Endpoint_IsINReady(void)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[SelectedEndpoint];
+
+	return (SelectedEndpoint == ENDPOINT_CONTROLEP) || (Endpoint->BusyBanks < Endpoint->Banks);
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+	return Endpoints[SelectedEndpoint].OUTReceived;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed)
+{
+	struct StubUSBPacket *Current = &Endpoints[SelectedEndpoint].Current;
+	uint16_t i;
+
+	for (i = 0; (i < Length) && (Current->Length < STUB_USB_PACKET_SIZE); i++)
+		Current->Data[Current->Length++] = ((const uint8_t *)Buffer)[i];
+	return 0;
+}
+
+uint8_t Endpoint_Write_Control_Stream_LE(const void *const Buffer, uint16_t Length)
+{
+	return 0;
+}
+
+uint8_t Endpoint_Read_8(void)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[SelectedEndpoint];
+
+	if (Endpoint->ReceivedRead >= Endpoint->Received.Length)
+	  return 0;
+	return Endpoint->Received.Data[Endpoint->ReceivedRead++];
+}
+
+void Endpoint_Write_8(const uint8_t Data)
+{
+	Endpoint_Write_Stream_LE(&Data, 1, NULL);
+}
+
+void Endpoint_ResetEndpoint(const uint8_t Address)
+{
+	Endpoints[Address & (STUB_USB_ENDPOINTS - 1)].BusyBanks = 0;
+}
+
+uint8_t Endpoint_GetBusyBanks(void)
+{
+	return Endpoints[SelectedEndpoint].BusyBanks;
+}
+
+void Endpoint_ClearIN(void)
+{
+	struct StubEndpoint *Endpoint = &Endpoints[SelectedEndpoint];
+
+	if (SelectedEndpoint == ENDPOINT_CONTROLEP)
+	  StubUSBRecord(Endpoint, &Endpoint->Current);
+	else if (Endpoint->BusyBanks < Endpoint->Banks)
+	  Endpoint->Waiting[Endpoint->BusyBanks++] = Endpoint->Current;
+	memset(&Endpoint->Current, 0, sizeof(Endpoint->Current));
+}
+
+void Endpoint_ClearOUT(void)
+{
+	Endpoints[SelectedEndpoint].OUTReceived = 0;
+}
+
+void Endpoint_ClearSETUP(void)
+{
+	SETUPReceived = 0;
+}
+
+void Endpoint_ClearStatusStage(void)
+{
+}
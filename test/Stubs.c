@@ -0,0 +1,194 @@
+/** \file
+ *
+ *  Host implementations of the registers and the Util.c functions which the
+ *  code under test uses, along with a simulated keyboard switch matrix.
+ *
+ *  Time only passes when something advances it: tests call
+ *  StubAdvanceTime(), and so do the busy-waits (DelayMicroseconds() and
+ *  _delay_us()), so a test can tell how long code would have stalled for.
+ *  Each ReadTimer1() also takes half a microsecond, so that loops which wait
+ *  for Timer1 to reach some value finish. GetMilliseconds() counts the
+ *  milliseconds which have passed, in StubMilliseconds.
+ *
+ *  The port pin functions change the DDRx and PORTx registers like the real
+ *  ones do, then StubUpdatePins() works out what the PINx registers read.
+ *  Outputs read what they are driven to, and inputs read high through their
+ *  pull-ups, unless a pressed switch in StubSwitches connects them to a
+ *  pin which is driven low. PIND is left alone, as the matrix doesn't use it.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#define STUB_DEFINE_REGISTERS
+#include <time.h>
+#include <avr/io.h>
+#include "Test.h"
+#include "Util.h"
+
+/** Number of CHECK()s which have failed. */
+unsigned int TestFailures;
+/** Value returned by GetMilliseconds(). */
+uint16_t StubMilliseconds;
+/** Timer1 counts since StubMilliseconds was last incremented. */
+static uint16_t StubMillisecondCounts;
+/** Switches which are pressed, indexed by row (PC0 = row 0). Each bitmap has
+ *  PF0-PF7 in bits 0-7, PB0-PB5 in bits 8-13, and PE6-PE7 in bits 14-15,
+ *  which are the pins the columns are connected to. */
+uint16_t StubSwitches[8];
+/** Columns whose switches have diodes, laid out like StubSwitches. A switch
+ *  with a diode only lets a row pull its column low. One without lets a
+ *  column pull its row low too, which is what makes ghost keys. */
+uint16_t StubDiodeColumns;
+/** Interrupt handler which the next cli() runs. */
+void (*StubInterrupt)(void);
+/** Interrupt handler which the next sleep_cpu() runs. */
+void (*StubWakeInterrupt)(void);
+/** Number of times sleep_cpu() has been called. */
+unsigned int StubSleepCount;
+
+/** Let time pass.
+ *  \param[in]     Counts    How long, in Timer1 counts.
+ */
+void StubAdvanceTime(uint16_t Counts)
+{
+	TCNT1 += Counts;
+	StubMillisecondCounts += Counts;
+	while (StubMillisecondCounts >= TIMER1_COUNTS_PER_MS)
+	{
+		StubMillisecondCounts -= TIMER1_COUNTS_PER_MS;
+		StubMilliseconds++;
+	}
+}
+
+/** Set the millisecond count, as if a millisecond had only just started.
+ *  \param[in]     Milliseconds   Value for GetMilliseconds() to return.
+ */
+void StubSetMilliseconds(uint16_t Milliseconds)
+{
+	StubMilliseconds = Milliseconds;
+	StubMillisecondCounts = 0;
+}
+
+/** Work out what the column and row pins read, from how they are set up
+ *  and which switches are pressed. This must be called after changing
+ *  StubSwitches or StubDiodeColumns. */
+void StubUpdatePins(void)
+{
+	uint16_t ColumnOutputs;
+	uint16_t ColumnsLow;
+	uint16_t LastColumnsLow;
+	uint8_t RowsLow;
+	uint8_t LastRowsLow;
+	uint8_t Row;
+
+	ColumnOutputs = ((uint16_t)((DDRB & 0x3f) | (DDRE & 0xc0)) << 8) | DDRF;
+	ColumnsLow = ColumnOutputs & ~(((uint16_t)((PORTB & 0x3f) | (PORTE & 0xc0)) << 8) | PORTF);
+	RowsLow = DDRC & ~PORTC;
+	/* Keep following pressed switches until no more pins are pulled low. */
+	do
+	{
+		LastColumnsLow = ColumnsLow;
+		LastRowsLow = RowsLow;
+		for (Row = 0; Row < 8; Row++)
+		{
+			if (RowsLow & (1 << Row))
+				ColumnsLow |= StubSwitches[Row];
+			if (StubSwitches[Row] & ~StubDiodeColumns & ColumnsLow)
+				RowsLow |= 1 << Row;
+		}
+	} while ((ColumnsLow != LastColumnsLow) || (RowsLow != LastRowsLow));
+
+	/* Outputs read what they are driven to. Inputs are pulled up, and only
+	 * read low if something pulls them low. */
+	PINB = (PORTB | ~DDRB) & ~(~DDRB & (ColumnsLow >> 8) & 0x3f);
+	PINC = (PORTC | ~DDRC) & ~(~DDRC & RowsLow);
+	PINE = (PORTE | ~DDRE) & ~(~DDRE & (ColumnsLow >> 8) & 0xc0);
+	PINF = (PORTF | ~DDRF) & ~(~DDRF & ColumnsLow);
+}
+
+void SetPortPinDirection(const uint8_t Port, const uint8_t Num, const uint8_t IsOutput)
+{
+	volatile uint8_t *DDR[6] = {&DDRA, &DDRB, &DDRC, &DDRD, &DDRE, &DDRF};
+	volatile uint8_t *PORT[6] = {&PORTA, &PORTB, &PORTC, &PORTD, &PORTE, &PORTF};
+	uint8_t Mask = 1 << Num;
+
+	if (Port > 5)
+		return;
+	if (IsOutput)
+	{
+		*DDR[Port] |= Mask;
+	}
+	else
+	{
+		*DDR[Port] &= ~Mask;
+		*PORT[Port] |= Mask;
+	}
+	StubUpdatePins();
+}
+
+void WritePortPin(const uint8_t Port, const uint8_t Num, const uint8_t Val)
+{
+	volatile uint8_t *PORT[6] = {&PORTA, &PORTB, &PORTC, &PORTD, &PORTE, &PORTF};
+	uint8_t Mask = 1 << Num;
+
+	if (Port > 5)
+		return;
+	if (Val)
+		*PORT[Port] |= Mask;
+	else
+		*PORT[Port] &= ~Mask;
+	StubUpdatePins();
+}
+
+uint8_t ReadPortPin(const uint8_t Port, const uint8_t Num)
+{
+	volatile uint8_t *PIN[6] = {&PINA, &PINB, &PINC, &PIND, &PINE, &PINF};
+
+	if (Port > 5)
+		return 0;
+	return (*PIN[Port] >> Num) & 1;
+}
+
+void DelayMicroseconds(uint16_t MicroSeconds)
+{
+	StubAdvanceTime(MicroSeconds * TIMER1_COUNTS_PER_US);
+}
+
+uint16_t ReadTimer1(void)
+{
+	StubAdvanceTime(1);
+	return TCNT1;
+}
+
+uint16_t GetMilliseconds(void)
+{
+	return StubMilliseconds;
+}
+
+/** Read the host's clock, for benchmarks. Benchmarks only show how two
+ *  ways of doing something compare on the host, as the AVR is so different.
+ *  \return double Time in seconds, from some arbitrary starting point.
+ */
+double TestHostTime(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return Now.tv_sec + (Now.tv_nsec * 1e-9);
+}
+
+/** Print the outcome of a test program.
+ *  \param[in]     Name   Name of the test program.
+ *  \return int Exit status for the test program: 0 if every check passed.
+ */
+int TestResult(const char *Name)
+{
+	if (TestFailures)
+	{
+		printf("%s: %u check(s) failed\n", Name, TestFailures);
+		return 1;
+	}
+	printf("%s: passed\n", Name);
+	return 0;
+}
@@ -0,0 +1,38 @@
+/** \file
+ *
+ *  Defines things shared by the host tests. Each test program includes the
+ *  source file it tests, so that it can reach that file's static functions
+ *  and variables.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Macros: */
+/** Record a failure, with where it happened, if Condition is false. */
+#define CHECK(Condition) \
+	do { if (!(Condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #Condition); TestFailures++; } } while (0)
+
+/** Run one test function, and print its name. */
+#define RUN_TEST(Function) \
+	do { printf("  %s\n", #Function); Function(); } while (0)
+
+/* Exported Variables: */
+extern unsigned int TestFailures;
+extern uint16_t StubMilliseconds;
+extern uint16_t StubSwitches[8];
+extern uint16_t StubDiodeColumns;
+
+/* Function Prototypes: */
+extern void StubAdvanceTime(uint16_t Counts);
+extern void StubSetMilliseconds(uint16_t Milliseconds);
+extern void StubUpdatePins(void);
+extern double TestHostTime(void);
+extern int TestResult(const char *Name);
+
+#endif // #ifndef _TEST_H_
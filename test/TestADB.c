@@ -0,0 +1,499 @@
+/** \file
+ *
+ *  Host tests for the ADB transactions in ADB.c: sending commands from the
+ *  Timer1 compare C interrupt, timing the low pulses of a response from the
+ *  INT1 interrupt, and decoding the response. Edges are made by setting
+ *  PIND and TCNT1, then calling the interrupt handler.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#include "../ADB.c"
+#include "../Scheduler.c"
+
+/** Low and high times (in microseconds) of a 1 bit and a 0 bit. */
+#define BIT_1_LOW		35
+#define BIT_1_HIGH		65
+#define BIT_0_LOW		65
+#define BIT_0_HIGH		35
+
+/** What the callback of the last finished transaction was given. */
+static uint8_t DoneCount;
+static uint8_t DoneCommand;
+static uint8_t DoneResult;
+static uint8_t DoneData[ADB_MAX_DATA];
+static uint8_t DoneLength;
+static uint8_t DoneServiceRequested;
+/** 1 if RunCells() should play a device asking for service, by holding the
+ *  line low during the cell after the command's stop bit. */
+static uint8_t HoldForService;
+
+/** Make the ADB data line go low, then high again, calling the INT1
+ *  interrupt handler at each edge.
+ *  \param[in]     LowTime    Time to stay low, in microseconds.
+ *  \param[in]     HighTime   Time to stay high afterwards, in microseconds.
+ */
+static void Pulse(const uint8_t LowTime, const uint8_t HighTime)
+{
+	PIND &= ~(1 << ADB_PIN);
+	INT1_vect();
+	TCNT1 += LowTime * TIMER1_COUNTS_PER_US;
+	PIND |= (1 << ADB_PIN);
+	INT1_vect();
+	TCNT1 += HighTime * TIMER1_COUNTS_PER_US;
+}
+
+/** Send one bit, as a device would.
+ *  \param[in]     Bit       0 or 1.
+ */
+static void SendBit(const uint8_t Bit)
+{
+	if (Bit)
+		Pulse(BIT_1_LOW, BIT_1_HIGH);
+	else
+		Pulse(BIT_0_LOW, BIT_0_HIGH);
+}
+
+/** Send a whole response: a start bit, the data most significant bit
+ *  first, and a stop bit.
+ *  \param[in]     Data      Bytes to send.
+ *  \param[in]     Length    Number of bytes in Data.
+ */
+static void SendResponse(const uint8_t *Data, const uint8_t Length)
+{
+	uint8_t i;
+	int8_t Bit;
+
+	SendBit(1);
+	for (i = 0; i < Length; i++)
+	{
+		for (Bit = 7; Bit >= 0; Bit--)
+			SendBit((Data[i] >> Bit) & 1);
+	}
+	SendBit(0);
+}
+
+/** Get ready to receive a response, with the line idle (high).
+ *  \param[in]     Time      Value of Timer1 to start at.
+ */
+static void StartReceive(const uint16_t Time)
+{
+	TCNT1 = Time;
+	PIND |= (1 << ADB_PIN);
+	ADBReceiveErrors = 0;
+	ADBReceiveStart();
+}
+
+/** Empty the transaction queue, and forget any finished transaction. */
+static void ResetADB(void)
+{
+	ADBQueueIn = 0;
+	ADBQueueOut = 0;
+	ADBState = ADB_STATE_IDLE;
+	ADBReceiveErrors = 0;
+	HoldForService = 0;
+	TIMSK1 = 0;
+	EIMSK = 0;
+	/* Driven high, as ADBInit() and the end of each transaction leave it. */
+	DDRD |= (1 << ADB_PIN);
+	PORTD |= (1 << ADB_PIN);
+	PIND |= (1 << ADB_PIN);
+	DoneCount = 0;
+}
+
+/** Callback which records how a transaction finished. */
+static void TransactionDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	DoneCount++;
+	DoneCommand = Command;
+	DoneResult = Result;
+	DoneLength = Length;
+	memcpy(DoneData, Data, Length);
+	DoneServiceRequested = ADBServiceRequested();
+}
+
+/** Step through the cells of the transaction being sent, calling the
+ *  Timer1 compare C interrupt handler each time its deadline is reached.
+ *  The cell after a command's stop bit takes two calls, as the handler
+ *  checks partway through it for a service request.
+ *  \param[out]    Cells     Length (in microseconds) of each cell.
+ *  \param[out]    Levels    Level of the ADB data line during each cell.
+ *  \return uint8_t Number of cells sent.
+ */
+static uint8_t RunCells(uint16_t *Cells, uint8_t *Levels)
+{
+	uint16_t Start;
+	uint8_t Count;
+
+	Count = 0;
+	while ((TIMSK1 & (1 << OCIE1C)) && (Count < ADB_MAX_CELLS))
+	{
+		Start = TCNT1;
+		if (ADBSampleSRQ)
+		{
+			/* The line is released, so the pull-up (or a device) sets it. */
+			if (HoldForService)
+				PIND &= ~(1 << ADB_PIN);
+			Levels[Count] = (PIND >> ADB_PIN) & 1;
+			TCNT1 = OCR1C;
+			TIMER1_COMPC_vect();
+			PIND |= (1 << ADB_PIN);
+		}
+		else
+		{
+			Levels[Count] = (PORTD >> ADB_PIN) & 1;
+			CHECK(DDRD & (1 << ADB_PIN));
+		}
+		TCNT1 = OCR1C;
+		Cells[Count++] = (uint16_t)(TCNT1 - Start) / TIMER1_COUNTS_PER_US;
+		TIMER1_COMPC_vect();
+	}
+	return Count;
+}
+
+/** Decode bytes from bit cells, as a device would.
+ *  \param[in]     Cells     Lengths of the cells, two per bit.
+ *  \param[in]     Bytes     Number of bytes to decode.
+ *  \param[out]    Data      The bytes.
+ */
+static void DecodeCells(const uint16_t *Cells, const uint8_t Bytes, uint8_t *Data)
+{
+	uint8_t i;
+
+	for (i = 0; i < (Bytes * 8); i++)
+	{
+		CHECK((Cells[i * 2] + Cells[i * 2 + 1]) == 100);
+		Data[i / 8] = (Data[i / 8] << 1) | (Cells[i * 2] < ADB_THRESHOLD);
+	}
+}
+
+/** Call ADBTask() until the line has been idle for long enough to finish
+ *  the response. */
+static void FinishResponse(void)
+{
+	uint16_t WakeTime;
+
+	WakeTime = ADBWakeTime();
+	while (ADBState == ADB_STATE_RECEIVE)
+	{
+		CHECK((int16_t)(TCNT1 - WakeTime) < 0);
+		ADBTask();
+	}
+	CHECK((int16_t)(TCNT1 - WakeTime) >= 0);
+}
+
+/** A well formed two byte response decodes to those bytes. */
+static void TestDecodeTwoBytes(void)
+{
+	static const uint8_t Data[2] = {0xa5, 0x3c};
+	uint8_t Length;
+
+	StartReceive(0);
+	SendResponse(Data, 2);
+	CHECK(ADBReceiveCount == 18);
+	CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_OK);
+	CHECK(Length == 2);
+	CHECK(ADBResponse[0] == 0xa5);
+	CHECK(ADBResponse[1] == 0x3c);
+	CHECK(ADBReceiveErrors == 0);
+}
+
+/** The longest response (8 bytes) decodes too. */
+static void TestDecodeEightBytes(void)
+{
+	static const uint8_t Data[ADB_MAX_DATA] = {0x00, 0xff, 0x01, 0x80, 0x12, 0x34, 0x56, 0x78};
+	uint8_t Length;
+	uint8_t i;
+
+	StartReceive(0);
+	SendResponse(Data, ADB_MAX_DATA);
+	CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_OK);
+	CHECK(Length == ADB_MAX_DATA);
+	for (i = 0; i < ADB_MAX_DATA; i++)
+		CHECK(ADBResponse[i] == Data[i]);
+}
+
+/** Pulses are timed correctly while Timer1 wraps around, including one
+ *  which starts before the wrap and ends after it. */
+static void TestDecodeAcrossTimerWrap(void)
+{
+	static const uint8_t Data[2] = {0xa5, 0x3c};
+	uint16_t Start;
+	uint8_t Length;
+
+	for (Start = 0xff00; Start != 0x0100; Start += 0x20)
+	{
+		StartReceive(Start);
+		SendResponse(Data, 2);
+		CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_OK);
+		CHECK(Length == 2);
+		CHECK(ADBResponse[0] == 0xa5);
+		CHECK(ADBResponse[1] == 0x3c);
+	}
+}
+
+/** Bits on either side of the threshold decode the right way, and a pulse
+ *  too long to time is a 0 bit. */
+static void TestThreshold(void)
+{
+	StartReceive(0);
+	Pulse(ADB_THRESHOLD - 1, 50);
+	Pulse(ADB_THRESHOLD, 50);
+	Pulse(ADB_THRESHOLD + 10, 50);
+	Pulse(250, 50);
+	PIND &= ~(1 << ADB_PIN);
+	INT1_vect();
+	TCNT1 += 400 * TIMER1_COUNTS_PER_US;
+	PIND |= (1 << ADB_PIN);
+	INT1_vect();
+	CHECK(ADBReceiveCount == 5);
+	CHECK(ADBLowDuration[4] == 255);
+	CHECK(ADBDecodeBits(0, 5) == 0x10);
+}
+
+/** No pulses at all means that no device responded. */
+static void TestDecodeTimeout(void)
+{
+	uint8_t Length;
+
+	StartReceive(0);
+	CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_TIMEOUT);
+	CHECK(Length == 0);
+	CHECK(ADBReceiveErrors == 0);
+}
+
+/** A response which isn't a whole number of bytes is garbled. */
+static void TestDecodeBadLength(void)
+{
+	static const uint8_t Data[2] = {0xa5, 0x3c};
+	uint8_t Length;
+
+	StartReceive(0);
+	SendResponse(Data, 2);
+	SendBit(1);
+	CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_ERROR);
+	CHECK(Length == 0);
+	CHECK(ADBReceiveErrors == 1);
+}
+
+/** If an edge was missed, the pulse timings can't be trusted. */
+static void TestDecodeMissedEdge(void)
+{
+	static const uint8_t Data[2] = {0xa5, 0x3c};
+	uint8_t Length;
+
+	StartReceive(0);
+	SendResponse(Data, 2);
+	/* A rising edge without a falling edge before it. */
+	INT1_vect();
+	CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_ERROR);
+	CHECK(ADBReceiveErrors == 1);
+}
+
+/** A Talk goes out as attention, sync, the command byte and a stop bit,
+ *  with the line alternating between low and high. Once it is sent, the
+ *  INT1 receiver is started, and the scheduler is told that ADBTask() has
+ *  work to do. The response is passed to the callback. */
+static void TestTalk(void)
+{
+	static const uint8_t Data[2] = {0x12, 0x34};
+	uint16_t Cells[ADB_MAX_CELLS];
+	uint8_t Levels[ADB_MAX_CELLS];
+	uint8_t Command[1];
+	uint8_t Count;
+	uint8_t i;
+
+	ResetADB();
+	TCNT1 = 0xfc00; /* so that Timer1 wraps around during the command */
+	CHECK(ADBTalk(3, 0, TransactionDone));
+	CHECK(ADBBusy());
+	ADBTask();
+	ADBTask();
+	RunNowRequested = 0;
+	Count = RunCells(Cells, Levels);
+	CHECK(Count == 20);
+	for (i = 0; i < Count; i++)
+		CHECK(Levels[i] == (i & 1));
+	CHECK(Cells[0] == 800);
+	CHECK(Cells[1] == 70);
+	DecodeCells(&Cells[2], 1, Command);
+	CHECK(Command[0] == 0x3c);
+	CHECK(Cells[18] == BIT_0_LOW);
+	CHECK(ADBState == ADB_STATE_RECEIVE);
+	CHECK(EIMSK & (1 << INT1));
+	CHECK(RunNowRequested);
+
+	TCNT1 += 200 * TIMER1_COUNTS_PER_US;
+	SendResponse(Data, 2);
+	FinishResponse();
+	CHECK(!(EIMSK & (1 << INT1)));
+	CHECK(!ADBBusy());
+	CHECK(DoneCount == 1);
+	CHECK(DoneCommand == 0x3c);
+	CHECK(DoneResult == ADB_RESULT_OK);
+	CHECK(DoneLength == 2);
+	CHECK((DoneData[0] == 0x12) && (DoneData[1] == 0x34));
+	CHECK(!DoneServiceRequested);
+}
+
+/** If no device responds to a Talk, it times out once the line has been
+ *  idle for the response delay plus ADB_TIMEOUT. */
+static void TestTalkTimeout(void)
+{
+	uint16_t Cells[ADB_MAX_CELLS];
+	uint8_t Levels[ADB_MAX_CELLS];
+	uint16_t Start;
+
+	ResetADB();
+	TCNT1 = 0xff00;
+	ADBTalk(3, 0, TransactionDone);
+	ADBTask();
+	RunCells(Cells, Levels);
+	Start = TCNT1;
+	FinishResponse();
+	CHECK((uint16_t)(TCNT1 - Start) >= (ADB_RESPONSE_DELAY + ADB_TIMEOUT) * TIMER1_COUNTS_PER_US);
+	CHECK((uint16_t)(TCNT1 - Start) <= (ADB_RESPONSE_DELAY + ADB_TIMEOUT + 1) * TIMER1_COUNTS_PER_US);
+	CHECK(DoneCount == 1);
+	CHECK(DoneResult == ADB_RESULT_TIMEOUT);
+	CHECK(DoneLength == 0);
+	CHECK(ADBReceiveErrors == 0);
+}
+
+/** A device which holds the line low after the stop bit is asking for
+ *  service. The cell is stretched until it has finished, and the callback
+ *  is told. */
+static void TestServiceRequest(void)
+{
+	uint16_t Cells[ADB_MAX_CELLS];
+	uint8_t Levels[ADB_MAX_CELLS];
+
+	ResetADB();
+	ADBTalk(3, 0, TransactionDone);
+	ADBTask();
+	HoldForService = 1;
+	CHECK(RunCells(Cells, Levels) == 20);
+	CHECK(Levels[19] == 0);
+	CHECK(Cells[19] == BIT_0_HIGH + ADB_SRQ_TIME);
+	CHECK(ADBState == ADB_STATE_RECEIVE);
+	FinishResponse();
+	CHECK(DoneCount == 1);
+	CHECK(DoneResult == ADB_RESULT_TIMEOUT);
+	CHECK(DoneServiceRequested);
+
+	/* The next transaction starts without one. */
+	ADBTalk(3, 0, TransactionDone);
+	ADBTask();
+	HoldForService = 0;
+	RunCells(Cells, Levels);
+	CHECK(Cells[19] == BIT_0_HIGH);
+	FinishResponse();
+	CHECK(DoneCount == 2);
+	CHECK(!DoneServiceRequested);
+}
+
+/** If a service request is still holding the line low when receiving
+ *  starts, the end of it must not be taken as the start bit. */
+static void TestSkipServiceRequest(void)
+{
+	static const uint8_t Data[2] = {0x12, 0x34};
+	uint8_t Length;
+
+	TCNT1 = 0;
+	PIND &= ~(1 << ADB_PIN);
+	ADBReceiveErrors = 0;
+	ADBReceiveStart();
+	TCNT1 += 100 * TIMER1_COUNTS_PER_US;
+	PIND |= (1 << ADB_PIN);
+	INT1_vect();
+	TCNT1 += 200 * TIMER1_COUNTS_PER_US;
+	SendResponse(Data, 2);
+	CHECK(ADBDecodeResponse(&Length) == ADB_RESULT_OK);
+	CHECK(Length == 2);
+	CHECK(ADBResponse[0] == 0x12);
+	CHECK(ADBResponse[1] == 0x34);
+}
+
+/** A Listen sends its data after the command, with the stop to start time
+ *  in between, and doesn't wait for a response. */
+static void TestListen(void)
+{
+	static const uint8_t Data[2] = {0x63, 0x04};
+	uint16_t Cells[ADB_MAX_CELLS];
+	uint8_t Levels[ADB_MAX_CELLS];
+	uint8_t Sent[2];
+	uint8_t Count;
+
+	ResetADB();
+	CHECK(ADBListen(3, 3, Data, 2, TransactionDone));
+	ADBTask();
+	Count = RunCells(Cells, Levels);
+	CHECK(Count == 56);
+	DecodeCells(&Cells[2], 1, Sent);
+	CHECK(Sent[0] == 0x3b);
+	CHECK(Cells[18] == BIT_0_LOW);
+	CHECK(Cells[19] == ADB_LISTEN_DELAY);
+	CHECK(Cells[20] == BIT_1_LOW);
+	DecodeCells(&Cells[22], 2, Sent);
+	CHECK((Sent[0] == 0x63) && (Sent[1] == 0x04));
+	CHECK(Cells[54] == BIT_0_LOW);
+	CHECK(ADBState == ADB_STATE_DONE);
+	CHECK(!(EIMSK & (1 << INT1)));
+	ADBTask();
+	CHECK(DoneCount == 1);
+	CHECK(DoneCommand == 0x3b);
+	CHECK(DoneResult == ADB_RESULT_OK);
+	CHECK(!ADBBusy());
+}
+
+/** Transactions are carried out in the order they were queued, and no more
+ *  than ADB_QUEUE_SIZE can be waiting. A reset holds the line low. */
+static void TestQueue(void)
+{
+	uint16_t Cells[ADB_MAX_CELLS];
+	uint8_t Levels[ADB_MAX_CELLS];
+	uint8_t i;
+
+	ResetADB();
+	CHECK(ADBSendReset(TransactionDone));
+	CHECK(ADBFlush(2, TransactionDone));
+	CHECK(ADBFlush(3, TransactionDone));
+	CHECK(ADBFlush(4, TransactionDone));
+	CHECK(!ADBFlush(5, TransactionDone));
+
+	ADBTask();
+	CHECK(RunCells(Cells, Levels) == 2);
+	CHECK((Levels[0] == 0) && (Cells[0] == ADB_RESET_TIME));
+	ADBTask();
+	CHECK(DoneCount == 1);
+	CHECK(DoneCommand == ADB_COMMAND_RESET);
+	for (i = 2; i <= 4; i++)
+	{
+		ADBTask();
+		RunCells(Cells, Levels);
+		ADBTask();
+		CHECK(DoneCommand == ((i << 4) | ADB_COMMAND_FLUSH));
+	}
+	CHECK(DoneCount == 4);
+	CHECK(!ADBBusy());
+}
+
+int main(void)
+{
+	printf("TestADB\n");
+	RUN_TEST(TestDecodeTwoBytes);
+	RUN_TEST(TestDecodeEightBytes);
+	RUN_TEST(TestDecodeAcrossTimerWrap);
+	RUN_TEST(TestThreshold);
+	RUN_TEST(TestDecodeTimeout);
+	RUN_TEST(TestDecodeBadLength);
+	RUN_TEST(TestDecodeMissedEdge);
+	RUN_TEST(TestTalk);
+	RUN_TEST(TestTalkTimeout);
+	RUN_TEST(TestServiceRequest);
+	RUN_TEST(TestSkipServiceRequest);
+	RUN_TEST(TestListen);
+	RUN_TEST(TestQueue);
+	return TestResult("TestADB");
+}
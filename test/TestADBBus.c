@@ -0,0 +1,490 @@
+/** \file
+ *
+ *  Host tests for the ADB bus manager in ADBBus.c. The ADB transactions it
+ *  queues are carried out by a fake ADB.c, which plays a bus of devices:
+ *  each one answers at its current address, moves when told to, and asks
+ *  for service while it has data which another device was polled for.
+ *  When several devices answer at once, the first one wins the collision,
+ *  and the others notice and refuse the next move, like real devices do.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#include "../ADBBus.c"
+
+/** Number of devices the fake bus can have. */
+#define FAKE_DEVICES			4
+/** Number of transactions the fake ADB.c can queue. */
+#define FAKE_QUEUE_SIZE			4
+
+/** Command bits, as in ADB.c. */
+#define ADB_COMMAND_FLUSH		0x01
+#define ADB_COMMAND_LISTEN		0x08
+#define ADB_COMMAND_TALK		0x0c
+#define ADB_COMMAND_RESET		0x03
+
+/** A device on the fake bus. */
+struct FakeDevice
+{
+	uint8_t Present; /* 1 if the device is plugged in */
+	uint8_t DefaultAddress; /* address the device goes back to on reset */
+	uint8_t Address; /* address the device responds to */
+	uint8_t Movable; /* 1 if the device can be moved to another address */
+	uint8_t Collided; /* 1 if the device lost a collision in its last response */
+	uint8_t HasData; /* 1 if the device has register 0 data to send */
+	uint8_t Data[2]; /* register 0 data */
+};
+
+/** A transaction queued on the fake bus. */
+struct FakeTransaction
+{
+	uint8_t Command;
+	uint8_t Data[2];
+	ADBCallback Callback;
+};
+
+/** The devices on the fake bus. */
+static struct FakeDevice Devices[FAKE_DEVICES];
+/** Transactions waiting to be carried out by ADBTask(). */
+static struct FakeTransaction Queue[FAKE_QUEUE_SIZE];
+static uint8_t QueueCount;
+/** Value for ADBServiceRequested() to return. */
+static uint8_t ServiceRequest;
+/** Number of transactions the fake bus has carried out. */
+static unsigned int Transactions;
+
+/** What the mouse handler was last passed, and how often it was called. */
+static uint8_t HandlerCalls;
+static uint8_t HandlerCommand;
+static uint8_t HandlerData[2];
+/** Addresses which MouseSetup() was called with, in order. */
+static uint8_t SetupAddresses[FAKE_DEVICES];
+static uint8_t SetupCalls;
+
+void ADBInit(void)
+{
+}
+
+/** Queue a transaction on the fake bus.
+ *  \return uint8_t 1 if it was queued, 0 if the queue is full.
+ */
+static uint8_t FakeQueue(const uint8_t Command, const uint8_t *Data, const ADBCallback Callback)
+{
+	if (QueueCount >= FAKE_QUEUE_SIZE)
+		return 0;
+	Queue[QueueCount].Command = Command;
+	if (Data)
+		memcpy(Queue[QueueCount].Data, Data, 2);
+	Queue[QueueCount].Callback = Callback;
+	QueueCount++;
+	return 1;
+}
+
+uint8_t ADBTalk(const uint8_t Address, const uint8_t Register, const ADBCallback Callback)
+{
+	return FakeQueue((Address << 4) | ADB_COMMAND_TALK | Register, NULL, Callback);
+}
+
+uint8_t ADBListen(const uint8_t Address, const uint8_t Register, const uint8_t *Data, const uint8_t Length, const ADBCallback Callback)
+{
+	CHECK(Length == 2);
+	return FakeQueue((Address << 4) | ADB_COMMAND_LISTEN | Register, Data, Callback);
+}
+
+uint8_t ADBFlush(const uint8_t Address, const ADBCallback Callback)
+{
+	return FakeQueue((Address << 4) | ADB_COMMAND_FLUSH, NULL, Callback);
+}
+
+uint8_t ADBSendReset(const ADBCallback Callback)
+{
+	return FakeQueue(ADB_COMMAND_RESET, NULL, Callback);
+}
+
+/** Carry out a Talk on the fake bus. Every device at the address answers,
+ *  and all but the first of them see a collision.
+ *  \param[in]     Command   Command byte.
+ *  \param[out]    Data      Response.
+ *  \param[out]    Length    Number of bytes in the response.
+ *  \return uint8_t How the Talk finished (see enum ADBResults).
+ */
+static uint8_t FakeTalk(const uint8_t Command, uint8_t *Data, uint8_t *Length)
+{
+	uint8_t Address;
+	uint8_t Responded;
+	uint8_t i;
+
+	Address = Command >> 4;
+	Responded = 0;
+	*Length = 0;
+	for (i = 0; i < FAKE_DEVICES; i++)
+	{
+		if (!Devices[i].Present || (Devices[i].Address != Address))
+			continue;
+		if ((Command & 0x03) == 0)
+		{
+			if (!Devices[i].HasData)
+				continue;
+			Devices[i].HasData = 0;
+			memcpy(Data, Devices[i].Data, 2);
+		}
+		else
+		{
+			Data[0] = 0x60 | Devices[i].Address;
+			Data[1] = Devices[i].DefaultAddress;
+		}
+		Devices[i].Collided = Responded;
+		Responded = 1;
+		*Length = 2;
+	}
+	if (!Responded)
+		return ADB_RESULT_TIMEOUT;
+	return ADB_RESULT_OK;
+}
+
+/** Carry out the next queued transaction, and call its callback. */
+void ADBTask(void)
+{
+	struct FakeTransaction Transaction;
+	uint8_t Data[2];
+	uint8_t Length;
+	uint8_t Result;
+	uint8_t i;
+
+	if (QueueCount == 0)
+		return;
+	Transaction = Queue[0];
+	QueueCount--;
+	memmove(&Queue[0], &Queue[1], QueueCount * sizeof(Queue[0]));
+	Transactions++;
+
+	Result = ADB_RESULT_OK;
+	Length = 0;
+	if (Transaction.Command == ADB_COMMAND_RESET)
+	{
+		for (i = 0; i < FAKE_DEVICES; i++)
+		{
+			Devices[i].Address = Devices[i].DefaultAddress;
+			Devices[i].Collided = 0;
+		}
+	}
+	else if ((Transaction.Command & 0x0c) == ADB_COMMAND_TALK)
+	{
+		Result = FakeTalk(Transaction.Command, Data, &Length);
+	}
+	else if ((Transaction.Command & 0x0f) == (ADB_COMMAND_LISTEN | 3))
+	{
+		CHECK(Transaction.Data[1] == ADB_R3_MOVE_HANDLER);
+		CHECK(Transaction.Data[0] & ADB_R3_SRQ_ENABLE);
+		for (i = 0; i < FAKE_DEVICES; i++)
+		{
+			if (Devices[i].Present && (Devices[i].Address == (Transaction.Command >> 4)) &&
+			    Devices[i].Movable && !Devices[i].Collided)
+				Devices[i].Address = Transaction.Data[0] & 0x0f;
+			Devices[i].Collided = 0;
+		}
+	}
+
+	/* Any other device with data asks for service. */
+	ServiceRequest = 0;
+	for (i = 0; i < FAKE_DEVICES; i++)
+	{
+		if (Devices[i].Present && Devices[i].HasData)
+			ServiceRequest = 1;
+	}
+	if (Transaction.Callback)
+		Transaction.Callback(Transaction.Command, Result, Data, Length);
+}
+
+uint8_t ADBServiceRequested(void)
+{
+	return ServiceRequest;
+}
+
+uint8_t ADBBusy(void)
+{
+	return QueueCount != 0;
+}
+
+/** Handler registered for mice, which records what it was passed. */
+static void MouseHandler(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	CHECK(Result == ADB_RESULT_OK);
+	CHECK(Length == 2);
+	HandlerCalls++;
+	HandlerCommand = Command;
+	memcpy(HandlerData, Data, 2);
+}
+
+/** Called once the transaction queued by MouseSetup() has finished, which
+ *  finishes setting the mouse up. */
+static void MouseSetupFlushDone(const uint8_t Command, const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	(void)Command;
+	(void)Result;
+	(void)Data;
+	(void)Length;
+	CHECK(!ADBBusReady);
+	ADBBusSetupDone();
+}
+
+/** Setup function registered for mice, which records the address it was
+ *  called with, and takes one transaction to finish. */
+static void MouseSetup(const uint8_t Address)
+{
+	if (SetupCalls < FAKE_DEVICES)
+		SetupAddresses[SetupCalls] = Address;
+	SetupCalls++;
+	ADBFlush(Address, MouseSetupFlushDone);
+}
+
+/** Unplug every device, and empty the queue. */
+static void ResetBus(void)
+{
+	memset(Devices, 0, sizeof(Devices));
+	memset(ADBBusHandlers, 0, sizeof(ADBBusHandlers));
+	QueueCount = 0;
+	Transactions = 0;
+	HandlerCalls = 0;
+	SetupCalls = 0;
+	StubSetMilliseconds(0);
+}
+
+/** Plug a device in.
+ *  \param[in]     Index           Index into Devices.
+ *  \param[in]     DefaultAddress  Address the device starts at.
+ *  \param[in]     Movable         1 if the device can be moved.
+ */
+static void AddFakeDevice(const uint8_t Index, const uint8_t DefaultAddress, const uint8_t Movable)
+{
+	Devices[Index].Present = 1;
+	Devices[Index].DefaultAddress = DefaultAddress;
+	Devices[Index].Address = DefaultAddress;
+	Devices[Index].Movable = Movable;
+}
+
+/** Let time pass, running the tasks the main loop would.
+ *  \param[in]     Milliseconds   How long.
+ */
+static void RunBus(const uint16_t Milliseconds)
+{
+	uint16_t i;
+
+	for (i = 0; i < Milliseconds; i++)
+	{
+		ADBBusTask();
+		while (ADBBusy())
+			ADBTask();
+		StubSetMilliseconds(GetMilliseconds() + 1);
+	}
+}
+
+/** Find which device on the fake bus is at an address.
+ *  \param[in]     Address   Address to look for.
+ *  \return int Index into Devices, or -1 if no device is there.
+ */
+static int DeviceAt(const uint8_t Address)
+{
+	int i;
+
+	for (i = 0; i < FAKE_DEVICES; i++)
+	{
+		if (Devices[i].Present && (Devices[i].Address == Address))
+			return i;
+	}
+	return -1;
+}
+
+/** Poll the bus once, and carry out the poll.
+ *  \return uint8_t What ADBBusPoll() returned.
+ */
+static uint8_t PollOnce(void)
+{
+	uint8_t Queued;
+
+	Queued = ADBBusPoll();
+	while (ADBBusy())
+		ADBTask();
+	return Queued;
+}
+
+/** Nothing is searched for until the devices have recovered from the bus
+ *  reset, and nothing is polled until the search has finished. */
+static void TestResetRecovery(void)
+{
+	ResetBus();
+	AddFakeDevice(0, 3, 1);
+	ADBBusInit();
+	CHECK(!ADBBusPoll());
+	RunBus(ADB_BUS_RESET_RECOVERY_MS);
+	CHECK(Transactions == 1);
+	CHECK(!ADBBusReady);
+	RunBus(1);
+	CHECK(ADBBusReady);
+	CHECK(ADBBusDeviceCount == 1);
+}
+
+/** Two mice and a keyboard, which all start at their default addresses,
+ *  are each moved to an address of their own, even though the mice answer
+ *  at once. */
+static void TestResolve(void)
+{
+	uint8_t i;
+	int Device;
+	uint16_t Moved;
+
+	ResetBus();
+	AddFakeDevice(0, 3, 1);
+	AddFakeDevice(1, 3, 1);
+	AddFakeDevice(2, 2, 1);
+	ADBBusInit();
+	RunBus(ADB_BUS_RESET_RECOVERY_MS + 1);
+	CHECK(ADBBusReady);
+	CHECK(ADBBusDeviceCount == 3);
+	Moved = 0;
+	for (i = 0; i < ADBBusDeviceCount; i++)
+	{
+		CHECK(ADBBusDevices[i].Address >= ADB_BUS_FIRST_FREE);
+		Device = DeviceAt(ADBBusDevices[i].Address);
+		CHECK(Device >= 0);
+		if (Device >= 0)
+		{
+			CHECK(Devices[Device].DefaultAddress == ADBBusDevices[i].DefaultAddress);
+			Moved |= 1 << Device;
+		}
+	}
+	CHECK(Moved == 0x07);
+	CHECK(DeviceAt(3) < 0);
+	CHECK(DeviceAt(2) < 0);
+}
+
+/** Once the devices have been moved, the setup function of each device
+ *  which has one is called in turn, at its new address, and polling only
+ *  starts once they have all finished. */
+static void TestSetup(void)
+{
+	uint8_t i;
+
+	ResetBus();
+	AddFakeDevice(0, 3, 1);
+	AddFakeDevice(1, 2, 1);
+	AddFakeDevice(2, 3, 1);
+	ADBBusRegister(3, MouseSetup, MouseHandler);
+	ADBBusInit();
+	RunBus(ADB_BUS_RESET_RECOVERY_MS + 1);
+	CHECK(ADBBusReady);
+	CHECK(SetupCalls == 2);
+	for (i = 0; (i < SetupCalls) && (i < FAKE_DEVICES); i++)
+	{
+		CHECK(SetupAddresses[i] >= ADB_BUS_FIRST_FREE);
+		CHECK(DeviceAt(SetupAddresses[i]) >= 0);
+		if (DeviceAt(SetupAddresses[i]) >= 0)
+			CHECK(Devices[DeviceAt(SetupAddresses[i])].DefaultAddress == 3);
+	}
+	CHECK(SetupAddresses[0] != SetupAddresses[1]);
+}
+
+/** A device which can't be moved stays at its default address, and is
+ *  still polled there. Another device of the same type is moved. */
+static void TestUnmovable(void)
+{
+	ResetBus();
+	AddFakeDevice(0, 3, 1);
+	AddFakeDevice(1, 3, 0);
+	ADBBusRegister(3, NULL, MouseHandler);
+	ADBBusInit();
+	RunBus(ADB_BUS_RESET_RECOVERY_MS + 1);
+	CHECK(ADBBusDeviceCount == 2);
+	CHECK(Devices[0].Address == ADB_BUS_FIRST_FREE);
+	CHECK(Devices[1].Address == 3);
+
+	Devices[1].HasData = 1;
+	Devices[1].Data[0] = 0x81;
+	Devices[1].Data[1] = 0x82;
+	/* The first poll goes to the moved mouse, which asks for service. */
+	CHECK(PollOnce());
+	CHECK(HandlerCalls == 0);
+	CHECK(PollOnce());
+	CHECK(HandlerCalls == 1);
+	CHECK(HandlerCommand == ((3 << 4) | ADB_COMMAND_TALK));
+}
+
+/** Polls stay with the device which last had data, and only move on when
+ *  another device asks for service. The handler sees the address the
+ *  device was moved to. */
+static void TestPollFollowsServiceRequests(void)
+{
+	uint8_t First;
+	uint8_t ServiceRequests;
+
+	ResetBus();
+	AddFakeDevice(0, 3, 1);
+	AddFakeDevice(1, 3, 1);
+	ADBBusRegister(3, NULL, MouseHandler);
+	ADBBusInit();
+	RunBus(ADB_BUS_RESET_RECOVERY_MS + 1);
+	CHECK(ADBBusDeviceCount == 2);
+	First = ADBBusDevices[0].Address;
+
+	/* Nothing to report, so the poll times out, and stays put. */
+	CHECK(PollOnce());
+	CHECK(HandlerCalls == 0);
+	CHECK(ADBBusDevices[PollDevice].Address == First);
+
+	/* The other mouse moves. The poll of the first one sees its service
+	 * request, and the next poll goes to it. */
+	Devices[DeviceAt(ADBBusDevices[1].Address)].HasData = 1;
+	Devices[DeviceAt(ADBBusDevices[1].Address)].Data[0] = 0x05;
+	ServiceRequests = ADBBusServiceRequests;
+	CHECK(PollOnce());
+	CHECK(HandlerCalls == 0);
+	CHECK(ADBBusServiceRequests == (uint8_t)(ServiceRequests + 1));
+	CHECK(PollOnce());
+	CHECK(HandlerCalls == 1);
+	CHECK(HandlerCommand == ((ADBBusDevices[1].Address << 4) | ADB_COMMAND_TALK));
+	CHECK(HandlerData[0] == 0x05);
+
+	/* Polls keep going to it while nothing else asks for service. */
+	CHECK(PollOnce());
+	CHECK(ADBBusDevices[PollDevice].Address == ADBBusDevices[1].Address);
+	CHECK(ADBBusDevices[ActiveDevice].Address == ADBBusDevices[1].Address);
+}
+
+/** While no devices have been found, the bus is searched again every
+ *  ADB_BUS_RESCAN_MS, so a device which is plugged in later is found. */
+static void TestRescan(void)
+{
+	ResetBus();
+	ADBBusRegister(3, NULL, MouseHandler);
+	ADBBusInit();
+	RunBus(ADB_BUS_RESET_RECOVERY_MS + 1);
+	CHECK(ADBBusReady);
+	CHECK(ADBBusDeviceCount == 0);
+	CHECK(!ADBBusPoll());
+
+	AddFakeDevice(0, 3, 1);
+	RunBus(ADB_BUS_RESCAN_MS - 1);
+	CHECK(ADBBusDeviceCount == 0);
+	RunBus(2);
+	CHECK(ADBBusDeviceCount == 1);
+	CHECK(Devices[0].Address == ADB_BUS_FIRST_FREE);
+
+	/* Once something has been found, the searching stops. */
+	Transactions = 0;
+	RunBus(ADB_BUS_RESCAN_MS * 2);
+	CHECK(Transactions == 0);
+}
+
+int main(void)
+{
+	printf("TestADBBus\n");
+	RUN_TEST(TestResetRecovery);
+	RUN_TEST(TestResolve);
+	RUN_TEST(TestSetup);
+	RUN_TEST(TestUnmovable);
+	RUN_TEST(TestPollFollowsServiceRequests);
+	RUN_TEST(TestRescan);
+	return TestResult("TestADBBus");
+}
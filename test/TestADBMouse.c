@@ -0,0 +1,407 @@
+/** \file
+ *
+ *  Host tests for ADBMouse.c: protocol handler selection, decoding of
+ *  classic and extended register 0 data (including sign extension), and
+ *  accumulation of movement with acceleration. The ADB bus manager and transaction functions are replaced by fakes which
+ *  record what was asked for, so that tests can play the device's part.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#include "../ADBMouse.c"
+
+/** Address the mice in these tests have been moved to by the bus manager. */
+#define MOUSE_ADDRESS		9
+/** Address of a second mouse, for tests with two mice. */
+#define MOUSE_ADDRESS_2		10
+/** Number of reports decoded for each profile by the benchmark. */
+#define BENCHMARK_REPORTS	1000000
+
+/** Callback of the last transaction queued by ADBMouse.c. */
+static ADBCallback LastCallback;
+/** Register 3 data written by the last Listen. */
+static uint8_t LastListenData[2];
+/** Number of times ADBBusSetupDone() has been called. */
+static uint8_t SetupDoneCount;
+
+void ADBBusRegister(const uint8_t DefaultAddress, const ADBSetupFunction Setup, const ADBCallback Handler)
+{
+	(void)DefaultAddress;
+	(void)Setup;
+	(void)Handler;
+}
+
+void ADBBusSetupDone(void)
+{
+	SetupDoneCount++;
+}
+
+uint8_t ADBTalk(const uint8_t Address, const uint8_t Register, const ADBCallback Callback)
+{
+	CHECK(Address == SetupAddress);
+	(void)Register;
+	LastCallback = Callback;
+	return 1;
+}
+
+uint8_t ADBListen(const uint8_t Address, const uint8_t Register, const uint8_t *Data, const uint8_t Length, const ADBCallback Callback)
+{
+	CHECK(Address == SetupAddress);
+	CHECK(Register == 3);
+	CHECK(Length == 2);
+	memcpy(LastListenData, Data, 2);
+	LastCallback = Callback;
+	return 1;
+}
+
+/** Finish the last queued transaction, as the mouse would.
+ *  \param[in]     Result    How the transaction finished.
+ *  \param[in]     Data      Talk response, or NULL.
+ *  \param[in]     Length    Number of bytes in Data.
+ */
+static void Respond(const uint8_t Result, const uint8_t *Data, const uint8_t Length)
+{
+	ADBCallback Callback;
+
+	Callback = LastCallback;
+	LastCallback = NULL;
+	CHECK(Callback != NULL);
+	if (Callback)
+		Callback(0, Result, Data, Length);
+}
+
+/** Set up a mouse which accepts the given register 3 handlers, playing the
+ *  mouse's part in MouseSetup().
+ *  \param[in]     Address      Address of the mouse.
+ *  \param[in]     Accepts      Bitmap of accepted handler IDs, bit 4 = extended.
+ *  \param[in]     Resolution   For the extended handler, resolution in register 1.
+ */
+static void SetUpMouseAt(const uint8_t Address, const uint8_t Accepts, const uint16_t Resolution)
+{
+	uint8_t Register3[2];
+	uint8_t Register1[8];
+	uint8_t Handler;
+
+	SetupDoneCount = 0;
+	MouseSetup(Address);
+	Handler = ADB_MOUSE_HANDLER_CLASSIC;
+	while (SetupDoneCount == 0)
+	{
+		/* Listen to register 3, asking for a handler. The address and
+		 * service request enable must be written back unchanged. */
+		CHECK(LastListenData[0] == (ADB_R3_SRQ_ENABLE | Address));
+		if (Accepts & (1 << LastListenData[1]))
+			Handler = LastListenData[1];
+		Respond(ADB_RESULT_OK, NULL, 0);
+		/* Talk to register 3, to check the handler. */
+		Register3[0] = ADB_R3_SRQ_ENABLE | Address;
+		Register3[1] = Handler;
+		Respond(ADB_RESULT_OK, Register3, 2);
+		if ((SetupDoneCount == 0) && (Handler == ADB_MOUSE_HANDLER_EXTENDED))
+		{
+			/* Talk to register 1. */
+			memset(Register1, 0, sizeof(Register1));
+			Register1[4] = Resolution >> 8;
+			Register1[5] = (uint8_t)Resolution;
+			Respond(ADB_RESULT_OK, Register1, 8);
+		}
+	}
+	CHECK(SetupDoneCount == 1);
+	CHECK(LastCallback == NULL);
+}
+
+/** Set up a mouse at MOUSE_ADDRESS, see SetUpMouseAt().
+ *  \param[in]     Accepts      Bitmap of accepted handler IDs, bit 4 = extended.
+ *  \param[in]     Resolution   For the extended handler, resolution in register 1.
+ */
+static void SetUpMouse(const uint8_t Accepts, const uint16_t Resolution)
+{
+	SetUpMouseAt(MOUSE_ADDRESS, Accepts, Resolution);
+}
+
+/** Clear the accumulated movement and remainders, and pick a profile.
+ *  \param[in]     Profile   Acceleration profile to use.
+ */
+static void ResetMovement(const uint8_t Profile)
+{
+	AccumulatedX = 0;
+	AccumulatedY = 0;
+	memset(RemainderX, 0, sizeof(RemainderX));
+	memset(RemainderY, 0, sizeof(RemainderY));
+	ADBMouseAccelProfile = Profile;
+}
+
+/** Deliver one classic protocol register 0 report from a mouse, with no
+ *  buttons down.
+ *  \param[in]     Address   Address of the mouse.
+ *  \param[in]     X         X movement, -64 to 63.
+ *  \param[in]     Y         Y movement, -64 to 63.
+ */
+static void ClassicReportFrom(const uint8_t Address, const int8_t X, const int8_t Y)
+{
+	uint8_t Data[2];
+
+	Data[0] = 0x80 | (Y & 0x7f);
+	Data[1] = 0x80 | (X & 0x7f);
+	ADBMouseReport(Address << 4, ADB_RESULT_OK, Data, 2);
+}
+
+/** Deliver one classic protocol register 0 report from the mouse at
+ *  MOUSE_ADDRESS, see ClassicReportFrom(). */
+static void ClassicReport(const int8_t X, const int8_t Y)
+{
+	ClassicReportFrom(MOUSE_ADDRESS, X, Y);
+}
+
+/** Mice are asked for the extended handler, then the 200 cpi classic
+ *  handler, and are otherwise left at the 100 cpi classic handler. */
+static void TestHandlerFallback(void)
+{
+	SetUpMouse(1 << ADB_MOUSE_HANDLER_EXTENDED, 400);
+	CHECK(MouseHandlers[MOUSE_ADDRESS] == ADB_MOUSE_HANDLER_EXTENDED);
+	CHECK(MouseResolutions[MOUSE_ADDRESS] == 400);
+
+	SetUpMouse(1 << ADB_MOUSE_HANDLER_CLASSIC_200, 0);
+	CHECK(MouseHandlers[MOUSE_ADDRESS] == ADB_MOUSE_HANDLER_CLASSIC_200);
+	CHECK(MouseResolutions[MOUSE_ADDRESS] == 200);
+
+	SetUpMouse(0, 0);
+	CHECK(MouseHandlers[MOUSE_ADDRESS] == ADB_MOUSE_HANDLER_CLASSIC);
+	CHECK(MouseResolutions[MOUSE_ADDRESS] == 100);
+
+	/* A resolution of 0 in register 1 isn't believed. */
+	SetUpMouse(1 << ADB_MOUSE_HANDLER_EXTENDED, 0);
+	CHECK(MouseResolutions[MOUSE_ADDRESS] == 100);
+}
+
+/** Classic reports have 7 bit two's complement movement, and buttons which
+ *  read 0 when pressed. */
+static void TestClassicSignExtension(void)
+{
+	static const uint8_t Data[2] = {0x40, 0xbf}; /* button 1 down, Y = -64, X = 63 */
+
+	SetUpMouse(0, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_OFF);
+	ADBMouseReport(MOUSE_ADDRESS << 4, ADB_RESULT_OK, Data, 2);
+	CHECK(AccumulatedX == 63);
+	CHECK(AccumulatedY == -64);
+	CHECK(Button1State == 1);
+	CHECK(Button2State == 0);
+	CHECK(Button3State == 0);
+}
+
+/** Extended reports add 3 more bits of movement per extra byte, and the
+ *  sign bit is the most significant bit received. A classic mouse's
+ *  report is decoded as 7 bits, even if it is longer. */
+static void TestExtendedSignExtension(void)
+{
+	/* X = 100 (0x064), Y = -100 (0x39c in 10 bits), button 3 down. */
+	static const uint8_t Data[3] = {0x9c, 0xe4, 0x78};
+	/* X = -1, Y = 1 in 16 bits, spread over 3 extra bytes. */
+	static const uint8_t Data16[5] = {0x81, 0xff, 0x8f, 0x8f, 0x8f};
+
+	SetUpMouse(1 << ADB_MOUSE_HANDLER_EXTENDED, 100);
+	ResetMovement(ADB_MOUSE_ACCEL_OFF);
+	ADBMouseReport(MOUSE_ADDRESS << 4, ADB_RESULT_OK, Data, 3);
+	CHECK(AccumulatedX == 100);
+	CHECK(AccumulatedY == -100);
+	CHECK(Button1State == 0);
+	CHECK(Button2State == 0);
+	CHECK(Button3State == 1);
+
+	ResetMovement(ADB_MOUSE_ACCEL_OFF);
+	ADBMouseReport(MOUSE_ADDRESS << 4, ADB_RESULT_OK, Data16, 5);
+	CHECK(AccumulatedX == -1);
+	CHECK(AccumulatedY == 1);
+
+	SetUpMouse(0, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_OFF);
+	ADBMouseReport(MOUSE_ADDRESS << 4, ADB_RESULT_OK, Data, 3);
+	CHECK(AccumulatedX == -28);
+	CHECK(AccumulatedY == 28);
+	CHECK(Button3State == 0);
+}
+
+/** Movement which hasn't been reported yet is kept, but it is limited
+ *  rather than allowed to overflow. */
+static void TestAccumulatorLimit(void)
+{
+	SetUpMouse(0, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_OFF);
+	ClassicReport(40, -40);
+	ClassicReport(40, -40);
+	CHECK(AccumulatedX == 80);
+	CHECK(AccumulatedY == -80);
+	/* More than fits in an 8-bit report is kept for later reports. */
+	ClassicReport(63, -64);
+	CHECK(AccumulatedX == 143);
+	CHECK(AccumulatedY == -144);
+
+	AccumulatedX = ACCUMULATED_MAX - 10;
+	AccumulatedY = ACCUMULATED_MIN + 10;
+	ClassicReport(63, -64);
+	CHECK(AccumulatedX == ACCUMULATED_MAX);
+	CHECK(AccumulatedY == ACCUMULATED_MIN);
+}
+
+/** Movement goes through unscaled unless a profile is chosen. */
+static void TestDefaultProfile(void)
+{
+	CHECK(ADBMouseAccelProfile == ADB_MOUSE_ACCEL_OFF);
+
+	/* A profile which doesn't exist is taken as off. */
+	SetUpMouse(0, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_PROFILE_COUNT);
+	ClassicReport(12, -12);
+	CHECK(AccumulatedX == 12);
+	CHECK(AccumulatedY == -12);
+	CHECK(ADBMouseAccelProfile == ADB_MOUSE_ACCEL_OFF);
+}
+
+/** A gain below 1.0 must not lose slow movement: the fraction left over
+ *  from each report carries over to the next one, in both directions. */
+static void TestRemainderCarryOver(void)
+{
+	uint8_t i;
+
+	SetUpMouse(0, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_HIGH); /* 0.75x at the slowest speed */
+	for (i = 1; i <= 8; i++)
+	{
+		ClassicReport(1, -1);
+		CHECK(AccumulatedX == ((i * 3) / 4));
+		CHECK(AccumulatedY == -(int16_t)(((i * 3) + 3) / 4));
+	}
+	CHECK(AccumulatedX == 6);
+	CHECK(AccumulatedY == -6);
+}
+
+/** Each mouse keeps its own remainder, so two mice moving at once add up
+ *  to the same as each of them moving alone. */
+static void TestRemaindersPerMouse(void)
+{
+	int16_t AloneX;
+	uint8_t i;
+
+	SetUpMouseAt(MOUSE_ADDRESS, 0, 0);
+	SetUpMouseAt(MOUSE_ADDRESS_2, 0, 0);
+
+	/* One mouse creeping at 0.75x, the other moving 5 counts at 1.5x,
+	 * which each leave half a count over. */
+	ResetMovement(ADB_MOUSE_ACCEL_HIGH);
+	ClassicReportFrom(MOUSE_ADDRESS, 1, 0);
+	ClassicReportFrom(MOUSE_ADDRESS, 1, 0);
+	AloneX = AccumulatedX;
+	ResetMovement(ADB_MOUSE_ACCEL_HIGH);
+	ClassicReportFrom(MOUSE_ADDRESS_2, 5, 0);
+	AloneX += AccumulatedX;
+	CHECK(AloneX == 1 + 7);
+
+	ResetMovement(ADB_MOUSE_ACCEL_HIGH);
+	for (i = 0; i < 2; i++)
+	{
+		ClassicReportFrom(MOUSE_ADDRESS, 1, 0);
+		if (i == 0)
+			ClassicReportFrom(MOUSE_ADDRESS_2, 5, 0);
+	}
+	CHECK(AccumulatedX == AloneX);
+
+	/* Setting a mouse up again starts it with no remainder. */
+	ClassicReportFrom(MOUSE_ADDRESS, 1, 0);
+	CHECK(RemainderX[MOUSE_ADDRESS] != 0);
+	SetUpMouseAt(MOUSE_ADDRESS, 0, 0);
+	CHECK(RemainderX[MOUSE_ADDRESS] == 0);
+	CHECK(RemainderX[MOUSE_ADDRESS_2] == 128);
+}
+
+/** The acceleration curve is looked up by hand speed, not counts, so the
+ *  same movement of a higher resolution mouse gets the same gain. */
+static void TestSpeedNormalisedByResolution(void)
+{
+	/* 8 counts at 100 cpi is 0.08 inch, which MEDIUM speeds up 1.75x. */
+	SetUpMouse(0, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_MEDIUM);
+	ClassicReport(8, 0);
+	CHECK(AccumulatedX == ((8 * 448) >> 8));
+
+	/* 8 counts at 400 cpi is 0.02 inch, which MEDIUM leaves alone. */
+	SetUpMouse(1 << ADB_MOUSE_HANDLER_EXTENDED, 400);
+	ResetMovement(ADB_MOUSE_ACCEL_MEDIUM);
+	ClassicReport(8, 0);
+	CHECK(AccumulatedX == 8);
+
+	/* 16 counts at 200 cpi is the same hand speed as 8 at 100 cpi. */
+	SetUpMouse(1 << ADB_MOUSE_HANDLER_CLASSIC_200, 0);
+	ResetMovement(ADB_MOUSE_ACCEL_MEDIUM);
+	ClassicReport(16, 0);
+	CHECK(AccumulatedX == ((16 * 448) >> 8));
+}
+
+/** Print each profile's gain against hand speed, and time decoding and
+ *  accelerating reports with each profile. Movement which is passed on
+ *  unscaled must add up to exactly what was reported. */
+static void TestAccelerationBenchmark(void)
+{
+	static const char *Names[ADB_MOUSE_ACCEL_PROFILE_COUNT] = {"off", "low", "medium", "high"};
+	uint8_t Data[2];
+	double StartTime;
+	double Time;
+	int32_t Total;
+	uint32_t i;
+	uint8_t Profile;
+	uint8_t Speed;
+
+	printf("    gain at counts per poll (100 cpi):");
+	for (Speed = 0; Speed < ACCELERATION_STEPS; Speed++)
+		printf(" %2u  ", Speed);
+	printf("\n");
+	for (Profile = 0; Profile < ADB_MOUSE_ACCEL_PROFILE_COUNT; Profile++)
+	{
+		printf("    %-34s", Names[Profile]);
+		for (Speed = 0; Speed < ACCELERATION_STEPS; Speed++)
+			printf(" %4.2f", pgm_read_word(&AccelerationGains[Profile][Speed]) / 256.0);
+		printf("\n");
+	}
+
+	SetUpMouse(0, 0);
+	for (Profile = 0; Profile < ADB_MOUSE_ACCEL_PROFILE_COUNT; Profile++)
+	{
+		ResetMovement(Profile);
+		Total = 0;
+		StartTime = TestHostTime();
+		for (i = 0; i < BENCHMARK_REPORTS; i++)
+		{
+			/* Speeds from -16 to 15 counts, both ways, in turn. */
+			Data[0] = 0x80 | ((uint8_t)(i * 7) & 0x1f) | (((i * 7) & 0x10) ? 0x60 : 0);
+			Data[1] = 0x80 | ((uint8_t)(i * 5) & 0x1f) | (((i * 5) & 0x10) ? 0x60 : 0);
+			ADBMouseReport(MOUSE_ADDRESS << 4, ADB_RESULT_OK, Data, 2);
+			Total += (int8_t)(Data[1] << 1) >> 1;
+			/* Take the movement away, as reports to the host would. */
+			if (Profile == ADB_MOUSE_ACCEL_OFF)
+				Total -= AccumulatedX;
+			AccumulatedX = 0;
+			AccumulatedY = 0;
+		}
+		Time = TestHostTime() - StartTime;
+		printf("    %-6s %.1f ns per report\n", Names[Profile], Time * 1e9 / BENCHMARK_REPORTS);
+		if (Profile == ADB_MOUSE_ACCEL_OFF)
+			CHECK(Total == 0);
+	}
+}
+
+int main(void)
+{
+	printf("TestADBMouse\n");
+	RUN_TEST(TestHandlerFallback);
+	RUN_TEST(TestClassicSignExtension);
+	RUN_TEST(TestExtendedSignExtension);
+	RUN_TEST(TestAccumulatorLimit);
+	RUN_TEST(TestDefaultProfile);
+	RUN_TEST(TestRemainderCarryOver);
+	RUN_TEST(TestRemaindersPerMouse);
+	RUN_TEST(TestSpeedNormalisedByResolution);
+	RUN_TEST(TestAccelerationBenchmark);
+	return TestResult("TestADBMouse");
+}
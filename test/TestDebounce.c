@@ -0,0 +1,251 @@
+/** \file
+ *
+ *  Replays switch bounce traces through KeyboardSwitchMatrix.c, and reports
+ *  the latency and chatter of the debouncer. Each trace is a list of the
+ *  times at which one switch's contacts closed or opened, shaped like a scope
+ *  capture of a switch being typed on. It is played into the simulated
+ *  matrix while the scanner runs as it does in the firmware, and the key
+ *  presses and releases which show up in KeyPressed are compared with
+ *  what the typist did.
+ *
+ *  This is built once for each DEBOUNCE_MODE, see the Makefile.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#include "../KeyboardSwitchMatrix.c"
+
+/** Where the switch used by the traces is: the U key. */
+#define TRACE_ROW			1
+#define TRACE_COLUMN		0
+#define TRACE_SCAN_CODE		HID_KEYBOARD_SC_U
+
+/** Most edges, presses or reported changes a trace can have. */
+#define MAX_EDGES			24
+#define MAX_PRESSES			4
+
+/** Time (in microseconds) to keep scanning after the last edge. */
+#define TRACE_TAIL_US		20000
+/** Longest time (in microseconds) between a switch changing and the next
+ *  sample of its row. */
+#define SCAN_PERIOD_US		2000
+
+/** A recorded switch, and what the typist did with it. */
+struct BounceTrace
+{
+	const char *Name;
+	/** Times (in microseconds) at which the contacts changed. They start
+	 *  open, so the first edge closes them, the next opens them, and so on.
+	 *  The list ends with 0. */
+	uint32_t Edges[MAX_EDGES];
+	/** Number of times the typist pressed the key. */
+	uint8_t Presses;
+	/** Times of the first edge of each press, and of each release. */
+	uint32_t PressTime[MAX_PRESSES];
+	uint32_t ReleaseTime[MAX_PRESSES];
+};
+
+/** The traces. Times are in microseconds. */
+static const struct BounceTrace Traces[] = {
+	{"clean", {1000, 40000, 0},
+		1, {1000}, {40000}},
+	{"press bounce 1 ms", {1000, 1150, 1300, 1600, 1700, 2000, 2050, 40000, 40100, 40400, 0},
+		1, {1000}, {40000}},
+	{"release bounce 4 ms", {1000, 40000, 40300, 41000, 41500, 42200, 43000, 44000, 0},
+		1, {1000}, {40000}},
+	{"bounce 3 ms both ways", {1000, 1400, 1900, 2600, 3000, 3200, 3900, 50000, 50200, 51000, 51800, 52300, 52600, 53000, 0},
+		1, {1000}, {50000}},
+	{"double tap", {1000, 1200, 1500, 31000, 31300, 31800, 61000, 61100, 61400, 91000, 91500, 92000, 0},
+		2, {1000, 61000}, {31000, 91000}},
+	{"noise while released", {20000, 21200, 40000, 41300, 0},
+		0, {0}, {0}}
+};
+
+/** What came out of KeyPressed while a trace was replayed. */
+struct TraceResult
+{
+	uint8_t Presses;
+	uint8_t Releases;
+	uint32_t PressTime[MAX_EDGES];
+	uint32_t ReleaseTime[MAX_EDGES];
+};
+
+/** Put the matrix back in its start-up state, with no keys down. */
+static void ResetMatrix(void)
+{
+	memset(StubSwitches, 0, sizeof(StubSwitches));
+	StubDiodeColumns = 0;
+	memset(RawRowPressed, 0, sizeof(RawRowPressed));
+	memset(DebouncePending, 0, sizeof(DebouncePending));
+	SharedPressed = 0;
+	SharedPending = 0;
+	GhostRows = 0;
+	GhostColumns = 0;
+	memset(KeyPressed, 0, sizeof(KeyPressed));
+	KeyEventQueueIn = 0;
+	KeyEventQueueOut = 0;
+	KeyEventQueueOverflow = 0;
+	CurrentRow = 0;
+	ScanState = SCAN_STATE_DRIVE_ROW;
+	MatrixActive = 0;
+	IdleCheckFoundKey = 0;
+	StubSetMilliseconds(0);
+	KeyboardInit();
+	StubUpdatePins();
+}
+
+/** Play a trace into the simulated matrix while running the scanner, and
+ *  note when KeyPressed changes. Each change must also be queued as a key
+ *  event.
+ *  \param[in]     Trace    The trace.
+ *  \param[out]    Result   What came out of KeyPressed.
+ */
+static void ReplayTrace(const struct BounceTrace *Trace, struct TraceResult *Result)
+{
+	struct KeyEvent Event;
+	uint32_t Counts;
+	uint32_t Now;
+	uint32_t EndTime;
+	uint16_t LastCount;
+	uint16_t Switch;
+	uint8_t Edge;
+	uint8_t Pressed;
+
+	ResetMatrix();
+	memset(Result, 0, sizeof(*Result));
+	Switch = (uint16_t)1 << (ColumnPins[TRACE_COLUMN].num + ((ColumnPins[TRACE_COLUMN].port == 5) ? 0 : 8));
+	Counts = 0;
+	Now = 0;
+	LastCount = TCNT1;
+	Edge = 0;
+	Pressed = 0;
+	while (Trace->Edges[Edge] != 0)
+		Edge++;
+	EndTime = Trace->Edges[Edge - 1] + TRACE_TAIL_US;
+	Edge = 0;
+	while (Now < EndTime)
+	{
+		while ((Trace->Edges[Edge] != 0) && (Trace->Edges[Edge] <= Now))
+		{
+			StubSwitches[TRACE_ROW] ^= Switch;
+			StubUpdatePins();
+			Edge++;
+		}
+		KeyboardScanMatrix();
+		if (KeyPressed[TRACE_SCAN_CODE] != Pressed)
+		{
+			Pressed = KeyPressed[TRACE_SCAN_CODE];
+			if (Pressed && (Result->Presses < MAX_EDGES))
+				Result->PressTime[Result->Presses++] = Now;
+			else if (!Pressed && (Result->Releases < MAX_EDGES))
+				Result->ReleaseTime[Result->Releases++] = Now;
+			CHECK(KeyboardPeekEvent(&Event));
+			CHECK(Event.ScanCode == TRACE_SCAN_CODE);
+			CHECK(Event.Pressed == Pressed);
+			KeyboardRemoveEvent();
+		}
+		CHECK(!KeyboardPeekEvent(&Event));
+		StubAdvanceTime(TIMER1_COUNTS_PER_US);
+		Counts += (uint16_t)(TCNT1 - LastCount);
+		LastCount = TCNT1;
+		Now = Counts / TIMER1_COUNTS_PER_US;
+	}
+}
+
+/** Find when the contacts stopped bouncing after an edge.
+ *  \param[in]     Trace    The trace.
+ *  \param[in]     Start    Time of the first edge.
+ *  \param[in]     End      Time of the next press or release, or 0 if there
+ *                          isn't one.
+ *  \return uint32_t Time of the last edge from Start up to End.
+ */
+static uint32_t SettleTime(const struct BounceTrace *Trace, const uint32_t Start, const uint32_t End)
+{
+	uint32_t Settled;
+	uint8_t i;
+
+	Settled = Start;
+	for (i = 0; Trace->Edges[i] != 0; i++)
+	{
+		if ((Trace->Edges[i] >= Start) && ((End == 0) || (Trace->Edges[i] < End)))
+			Settled = Trace->Edges[i];
+	}
+	return Settled;
+}
+
+/** Replay every trace. Each press and release of the key must be reported
+ *  exactly once, within the debounce time of the contacts settling, plus
+ *  the time until the row is next sampled. */
+static void TestBounceTraces(void)
+{
+	const struct BounceTrace *Trace;
+	struct TraceResult Result;
+	uint32_t Latency;
+	uint32_t WorstPress;
+	uint32_t WorstRelease;
+	uint32_t Settled;
+	uint32_t Next;
+	uint8_t i;
+	uint8_t t;
+
+	printf("    %-22s %8s %8s %18s %18s\n", "trace", "presses", "releases", "press latency", "release latency");
+	for (t = 0; t < sizeof(Traces) / sizeof(Traces[0]); t++)
+	{
+		Trace = &Traces[t];
+		ReplayTrace(Trace, &Result);
+		WorstPress = 0;
+		WorstRelease = 0;
+		if ((Result.Presses == Trace->Presses) && (Result.Releases == Trace->Presses))
+		{
+			for (i = 0; i < Trace->Presses; i++)
+			{
+				Latency = Result.PressTime[i] - Trace->PressTime[i];
+				if (Latency > WorstPress)
+					WorstPress = Latency;
+				/* Eager presses don't wait for the bounce to end. */
+				Settled = (DEBOUNCE_MODE == DEBOUNCE_EAGER_PRESS) ? Trace->PressTime[i] :
+					SettleTime(Trace, Trace->PressTime[i], Trace->ReleaseTime[i]);
+				CHECK(Result.PressTime[i] >= Trace->PressTime[i]);
+				CHECK(Result.PressTime[i] <= Settled + SCAN_PERIOD_US +
+					((DEBOUNCE_MODE == DEBOUNCE_EAGER_PRESS) ? 0 : (DEBOUNCE_PRESS_MS + 1) * 1000));
+
+				Latency = Result.ReleaseTime[i] - Trace->ReleaseTime[i];
+				if (Latency > WorstRelease)
+					WorstRelease = Latency;
+				Next = ((i + 1) < Trace->Presses) ? Trace->PressTime[i + 1] : 0;
+				Settled = SettleTime(Trace, Trace->ReleaseTime[i], Next);
+				CHECK(Result.ReleaseTime[i] >= Trace->ReleaseTime[i] + (DEBOUNCE_RELEASE_MS - 1) * 1000);
+				CHECK(Result.ReleaseTime[i] <= Settled + SCAN_PERIOD_US + (DEBOUNCE_RELEASE_MS + 1) * 1000);
+			}
+		}
+		printf("    %-22s %8u %8u %15u us %15u us\n", Trace->Name, Result.Presses, Result.Releases,
+			(unsigned int)WorstPress, (unsigned int)WorstRelease);
+
+#if (DEBOUNCE_MODE == DEBOUNCE_EAGER_PRESS)
+		/* Noise which lasts long enough to be sampled looks just like a
+		 * press to the eager debouncer, so it can only be checked for
+		 * switch bounce. */
+		if (Trace->Presses == 0)
+		{
+			CHECK(Result.Presses == Result.Releases);
+			continue;
+		}
+#endif
+		/* Anything else is chatter. */
+		CHECK(Result.Presses == Trace->Presses);
+		CHECK(Result.Releases == Trace->Presses);
+	}
+}
+
+int main(void)
+{
+#if (DEBOUNCE_MODE == DEBOUNCE_EAGER_PRESS)
+	printf("TestDebounce (DEBOUNCE_EAGER_PRESS)\n");
+#else
+	printf("TestDebounce (DEBOUNCE_DEFERRED)\n");
+#endif
+	RUN_TEST(TestBounceTraces);
+	return TestResult("TestDebounce");
+}
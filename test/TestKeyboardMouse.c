@@ -0,0 +1,1245 @@
+/** \file
+ *
+ *  Tests for the keyboard and mouse report builders in KeyboardMouse.c,
+ *  which run against the fake USB device in StubUSB.c. The keyboard switch
+ *  matrix scanner and the scheduler are included too, so that key events
+ *  can be queued straight into the scanner. Reports are decoded with
+ *  LUFA's HID report parser, the way a host would.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#define main KeyboardMouseMain
+#include "../KeyboardMouse.c"
+#undef main
+#include "../KeyboardSwitchMatrix.c"
+#include "../Descriptors.c"
+#include "../Scheduler.c"
+
+/** Number of times each way of building a report is timed. */
+#define BENCHMARK_REPORTS	1000000
+/** Number of frames to watch the report timing for. */
+#define TIMING_FRAMES		20
+/** How late a pass can start because the task is only called so often. */
+#define TIMING_SLACK_US		5
+/** Number of random sets of keys to decode. */
+#define RANDOM_REPORTS		10000
+/** Most keys held in each random set. */
+#define RANDOM_KEYS			12
+/** Number of random bursts of key events replayed to the host. */
+#define RANDOM_BURSTS		200
+/** Number of mouse polls to watch in each run of the jitter simulation. */
+#define JITTER_POLLS		50
+/** Longest time (in microseconds) which other tasks hold up the mouse task
+ *  for, in the jitter simulation. */
+#define JITTER_MAX_US		40
+/** Number of movements in the synthetic mouse trace. */
+#define TRACE_STEPS			24
+/** Largest movement (in counts, either way) in one step of the trace. */
+#define TRACE_MAX_MOVE		1000
+
+/** The boot keyboard report layout, which is fixed by the HID
+ *  specification rather than by the device's report descriptor. */
+static const USB_Descriptor_HIDReport_Datatype_t BootKeyboardReport[] =
+{
+	HID_DESCRIPTOR_KEYBOARD(MAX_KEYS_PRESSED)
+};
+
+/** The boot mouse report layout, which is also fixed by the HID
+ *  specification. */
+static const USB_Descriptor_HIDReport_Datatype_t BootMouseReport[] =
+{
+	HID_DESCRIPTOR_MOUSE(-127, 127, -127, 127, 3, false)
+};
+
+/** State of the generator used for test patterns, see Random(). */
+static uint32_t RandomState = 1;
+/** Timer1 count at the last USB start of frame, see RunFor(). */
+static uint16_t FrameTimer;
+/** Number of times the CPU has woken from sleep, see SuspendWake(). */
+static uint8_t Wakes;
+
+/* The ADB bus and mouse, which these tests leave alone, unless
+ * FakeMouseDuration is set. Then there is one mouse on the bus, and each
+ * poll of it takes that long, see TestMousePollTiming(). */
+uint8_t Button1State;
+uint8_t Button2State;
+uint8_t Button3State;
+int16_t AccumulatedX;
+int16_t AccumulatedY;
+uint16_t ADBBusPollDuration;
+/** How long each poll of the fake mouse takes, in Timer1 counts, or 0 if
+ *  there is no mouse. */
+static uint16_t FakeMouseDuration;
+/** 1 while a poll of the fake mouse is in progress. */
+static uint8_t FakeMouseBusy;
+/** Values of Timer1 when the poll in progress started and will finish. */
+static uint16_t FakeMouseStart;
+static uint16_t FakeMouseDone;
+/** Number of polls of the fake mouse which have finished. */
+static uint16_t FakeMousePolls;
+
+void ADBMouseInit(void)
+{
+}
+
+void ADBBusInit(void)
+{
+}
+
+void ADBBusTask(void)
+{
+}
+
+uint8_t ADBBusPoll(void)
+{
+	if (!FakeMouseDuration || FakeMouseBusy)
+		return 0;
+	FakeMouseBusy = 1;
+	FakeMouseStart = TCNT1;
+	FakeMouseDone = TCNT1 + FakeMouseDuration;
+	return 1;
+}
+
+void ADBTask(void)
+{
+	if (FakeMouseBusy && ((int16_t)(TCNT1 - FakeMouseDone) >= 0))
+	{
+		FakeMouseBusy = 0;
+		FakeMousePolls++;
+		ADBBusPollDuration = TCNT1 - FakeMouseStart;
+	}
+}
+
+uint8_t ADBBusy(void)
+{
+	return FakeMouseBusy;
+}
+
+uint16_t ADBWakeTime(void)
+{
+	return FakeMouseDone;
+}
+
+/** Put the report builder back in its start-up state, with no keys down
+ *  and nothing queued. */
+static void ResetKeyboard(void)
+{
+	ActiveKeyCount = 0;
+	ActiveModifiers = 0;
+	memset(ReportKeyChanged, 0, sizeof(ReportKeyChanged));
+	memset(&KeyboardReportData, 0, sizeof(KeyboardReportData));
+	memset(KeyPressed, 0, sizeof(KeyPressed));
+	KeyEventQueueIn = 0;
+	KeyEventQueueOut = 0;
+	KeyEventQueueOverflow = 0;
+	memset(StubSwitches, 0, sizeof(StubSwitches));
+	memset(RawRowPressed, 0, sizeof(RawRowPressed));
+	memset(DebouncePending, 0, sizeof(DebouncePending));
+	SharedPressed = 0;
+	SharedPending = 0;
+	CurrentRow = 0;
+	ScanState = SCAN_STATE_DRIVE_ROW;
+	MatrixActive = 0;
+	KeyboardInit();
+	StubUSBReset();
+	EVENT_USB_Device_Reset();
+	EVENT_USB_Device_ConfigurationChanged();
+	ScanDuration = 0;
+	ScanFrame = FrameCount;
+	FrameTimer = TCNT1;
+}
+
+/** Run the keyboard task as the main loop would, while the host starts a
+ *  frame every millisecond of Timer1 time and polls the keyboard IN
+ *  endpoint at the start of each frame. Each call to the task takes a
+ *  microsecond, on top of the time the scanner spends reading Timer1.
+ *  \param[in]     Microseconds   How long for.
+ */
+static void RunFor(uint16_t Microseconds)
+{
+	uint32_t Counts = 0;
+	uint16_t LastCount = TCNT1;
+
+	while (Counts < (uint32_t)Microseconds * TIMER1_COUNTS_PER_US)
+	{
+		if ((uint16_t)(TCNT1 - FrameTimer) >= 1000 * TIMER1_COUNTS_PER_US)
+		{
+			FrameTimer += 1000 * TIMER1_COUNTS_PER_US;
+			EVENT_USB_Device_StartOfFrame();
+			StubUSBPoll(KEYBOARD_IN_EPADDR);
+		}
+		Keyboard_HID_Task();
+		StubAdvanceTime(TIMER1_COUNTS_PER_US);
+		Counts += (uint16_t)(TCNT1 - LastCount);
+		LastCount = TCNT1;
+	}
+}
+
+/** Run for a number of frames, pressing or releasing the A key at the
+ *  start of each, so that every frame has a new report to send. The key
+ *  is released again by the end if Frames is even.
+ *  \param[in]     Frames   How many frames.
+ */
+static void RunFrames(const uint16_t Frames)
+{
+	uint16_t i;
+
+	for (i = 0; i < Frames; i++)
+	{
+		KeyboardQueueEvent(HID_KEYBOARD_SC_A, !(i & 1), 0);
+		RunFor(1000);
+	}
+}
+
+/** Make up a pseudo-random number. The sequence is the same on every run,
+ *  so that failures can be reproduced.
+ *  \return uint16_t The number.
+ */
+static uint16_t Random(void)
+{
+	RandomState = RandomState * 1103515245 + 12345;
+	return RandomState >> 16;
+}
+
+/** Send a class request to the keyboard interface, the way LUFA does, with
+ *  the control endpoint selected.
+ *  \param[in]     RequestType   Direction, type and recipient of the request.
+ *  \param[in]     Request       The request.
+ *  \param[in]     Value         The request's wValue.
+ */
+static void ControlRequest(const uint8_t RequestType, const uint8_t Request, const uint16_t Value)
+{
+	USB_ControlRequest.bmRequestType = RequestType;
+	USB_ControlRequest.bRequest = Request;
+	USB_ControlRequest.wValue = Value;
+	USB_ControlRequest.wIndex = INTERFACE_ID_Keyboard;
+	USB_ControlRequest.wLength = 0;
+	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+	EVENT_USB_Device_ControlRequest();
+}
+
+/** Send SET_PROTOCOL to the mouse interface.
+ *  \param[in]     Protocol      0 for the boot protocol, 1 for the report protocol.
+ */
+static void MouseSetProtocol(const uint8_t Protocol)
+{
+	USB_ControlRequest.bmRequestType = REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE;
+	USB_ControlRequest.bRequest = HID_REQ_SetProtocol;
+	USB_ControlRequest.wValue = Protocol;
+	USB_ControlRequest.wIndex = INTERFACE_ID_Mouse;
+	USB_ControlRequest.wLength = 0;
+	Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+	EVENT_USB_Device_ControlRequest();
+}
+
+/** Keep only the IN items, which are the ones the firmware sends. */
+bool CALLBACK_HIDParser_FilterHIDReportItem(HID_ReportItem_t* const CurrentItem)
+{
+	return (CurrentItem->ItemType == HID_REPORT_ITEM_In);
+}
+
+/** Decode a keyboard report with the HID report parser, into the keys
+ *  it says are down.
+ *  \param[in]     Info     The parsed report descriptor.
+ *  \param[in]     Report   The report.
+ *  \param[out]    Keys     Set to 1 for each scan code which is down,
+ *                          including the modifiers.
+ */
+static void DecodeReport(HID_ReportInfo_t *Info, const uint8_t *Report, uint8_t *Keys)
+{
+	HID_ReportItem_t *Item;
+	uint8_t i;
+
+	memset(Keys, 0, 256);
+	for (i = 0; i < Info->TotalReportItems; i++)
+	{
+		Item = &Info->ReportItems[i];
+		if (Item->Attributes.Usage.Page != 0x07)
+			continue;
+		CHECK(USB_GetHIDReportItemInfo(Report, Item));
+		if (Item->ItemFlags & HID_IOF_VARIABLE)
+		{
+			/* One bit for one key. */
+			if (Item->Value)
+				Keys[Item->Attributes.Usage.Usage] = 1;
+		}
+		else if (Item->Value)
+		{
+			/* One slot of a list of keys. */
+			Keys[Item->Value] = 1;
+		}
+	}
+}
+
+/** Decode a mouse report with the HID report parser.
+ *  \param[in]     Info     The parsed report descriptor.
+ *  \param[in]     Report   The report.
+ *  \param[out]    X        X movement.
+ *  \param[out]    Y        Y movement.
+ *  \param[out]    Buttons  Bitmap of the buttons which are down, button 1 in bit 0.
+ */
+static void DecodeMouseReport(HID_ReportInfo_t *Info, const uint8_t *Report, int16_t *X, int16_t *Y, uint8_t *Buttons)
+{
+	HID_ReportItem_t *Item;
+	int16_t Value;
+	uint8_t i;
+
+	*X = 0;
+	*Y = 0;
+	*Buttons = 0;
+	for (i = 0; i < Info->TotalReportItems; i++)
+	{
+		Item = &Info->ReportItems[i];
+		CHECK(USB_GetHIDReportItemInfo(Report, Item));
+		if (Item->Attributes.Usage.Page == 0x09)
+		{
+			if (Item->Value)
+				*Buttons |= 1 << (Item->Attributes.Usage.Usage - 1);
+			continue;
+		}
+		if (Item->Attributes.Usage.Page != 0x01)
+			continue;
+		/* Sign extend from however many bits the item has. */
+		Value = HID_ALIGN_DATA(Item, int16_t) >> (16 - Item->Attributes.BitSize);
+		if (Item->Attributes.Usage.Usage == 0x30)
+			*X = Value;
+		else if (Item->Attributes.Usage.Usage == 0x31)
+			*Y = Value;
+	}
+}
+
+/** Reference report build: the loop over every scan code in KeyPressed
+ *  which Keyboard_HID_Task() used before keys were tracked as they were
+ *  pressed.
+ *  \param[out]    Report   Where to build the report.
+ */
+static void RefBuildReport(USB_KeyboardReport_Data_t *Report)
+{
+	uint8_t UsedKeyCodes = 0;
+	uint16_t ScanCode;
+	uint8_t i;
+
+	memset(Report, 0, sizeof(*Report));
+	for (ScanCode = 1; ScanCode < 256; ScanCode++)
+	{
+		if (KeyPressed[ScanCode])
+		{
+			if (ScanCode == HID_KEYBOARD_SC_LEFT_CONTROL)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_LEFTCTRL;
+			else if (ScanCode == HID_KEYBOARD_SC_LEFT_SHIFT)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_LEFTSHIFT;
+			else if (ScanCode == HID_KEYBOARD_SC_LEFT_ALT)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_LEFTALT;
+			else if (ScanCode == HID_KEYBOARD_SC_LEFT_GUI)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_LEFTGUI;
+			else if (ScanCode == HID_KEYBOARD_SC_RIGHT_CONTROL)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_RIGHTCTRL;
+			else if (ScanCode == HID_KEYBOARD_SC_RIGHT_SHIFT)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_RIGHTSHIFT;
+			else if (ScanCode == HID_KEYBOARD_SC_RIGHT_ALT)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_RIGHTALT;
+			else if (ScanCode == HID_KEYBOARD_SC_RIGHT_GUI)
+				Report->Modifier |= HID_KEYBOARD_MODIFIER_RIGHTGUI;
+			else
+			{
+				if (UsedKeyCodes < MAX_KEYS_PRESSED)
+				{
+					Report->KeyCode[UsedKeyCodes++] = ScanCode;
+				}
+				else
+				{
+					for (i = 0; i < 6; i++)
+						Report->KeyCode[i] = HID_KEYBOARD_SC_ERROR_ROLLOVER;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/** Press or release a key, in both KeyPressed and the report builder.
+ *  \param[in]     ScanCode   Scan code of the key.
+ *  \param[in]     Pressed    1 to press it, 0 to release it.
+ */
+static void SetKey(const uint8_t ScanCode, const uint8_t Pressed)
+{
+	KeyPressed[ScanCode] = Pressed;
+	Keyboard_SetKeyState(ScanCode, Pressed);
+}
+
+/** Check the keys in the last report built.
+ *  \param[in]     Modifier   Expected modifier bits.
+ *  \param[in]     Keys       Expected keys, in order, ending with 0.
+ *  \return uint8_t 1 if the report matches, 0 if it doesn't.
+ */
+static uint8_t ReportIs(const uint8_t Modifier, const uint8_t *Keys)
+{
+	uint8_t i;
+
+	if (KeyboardReportData.Modifier != Modifier)
+		return 0;
+	for (i = 0; i < MAX_KEYS_PRESSED; i++)
+	{
+		if (KeyboardReportData.KeyCode[i] != Keys[i])
+			return 0;
+		if (Keys[i] == 0)
+			break;
+	}
+	return 1;
+}
+
+/** Each modifier key sets its own bit of the Modifier byte, and no key
+ *  code. The same keys give the same report as the reference. */
+static void TestModifiers(void)
+{
+	USB_KeyboardReport_Data_t Report;
+	uint8_t ScanCode;
+
+	for (ScanCode = HID_KEYBOARD_SC_LEFT_CONTROL; ScanCode <= HID_KEYBOARD_SC_RIGHT_GUI; ScanCode++)
+	{
+		ResetKeyboard();
+		KeyboardUsingReportProtocol = false;
+		SetKey(ScanCode, 1);
+		SetKey(HID_KEYBOARD_SC_A, 1);
+		Keyboard_BuildReport();
+		RefBuildReport(&Report);
+		CHECK(memcmp(&KeyboardReportData, &Report, sizeof(Report)) == 0);
+		CHECK(KeyboardReportData.Modifier == (1 << (ScanCode - HID_KEYBOARD_SC_LEFT_CONTROL)));
+		SetKey(ScanCode, 0);
+		Keyboard_BuildReport();
+		CHECK(KeyboardReportData.Modifier == 0);
+		CHECK(KeyboardReportData.KeyCode[0] == HID_KEYBOARD_SC_A);
+	}
+}
+
+/** With more than six keys held, the six pressed first are reported, in
+ *  the order they were pressed. Releasing one lets the next held key in. */
+static void TestRolloverKeepsOldestKeys(void)
+{
+	static const uint8_t Pressed[] = {HID_KEYBOARD_SC_Z, HID_KEYBOARD_SC_Q, HID_KEYBOARD_SC_M,
+		HID_KEYBOARD_SC_A, HID_KEYBOARD_SC_K, HID_KEYBOARD_SC_B, HID_KEYBOARD_SC_C, HID_KEYBOARD_SC_D};
+	static const uint8_t FirstSix[] = {HID_KEYBOARD_SC_Z, HID_KEYBOARD_SC_Q, HID_KEYBOARD_SC_M,
+		HID_KEYBOARD_SC_A, HID_KEYBOARD_SC_K, HID_KEYBOARD_SC_B};
+	static const uint8_t AfterRelease[] = {HID_KEYBOARD_SC_Z, HID_KEYBOARD_SC_M,
+		HID_KEYBOARD_SC_A, HID_KEYBOARD_SC_K, HID_KEYBOARD_SC_B, HID_KEYBOARD_SC_C};
+	static const uint8_t ShiftOnly[] = {0};
+	uint8_t i;
+
+	ResetKeyboard();
+	KeyboardUsingReportProtocol = false;
+	SetKey(HID_KEYBOARD_SC_LEFT_SHIFT, 1);
+	for (i = 0; i < sizeof(Pressed); i++)
+		SetKey(Pressed[i], 1);
+	Keyboard_BuildReport();
+	CHECK(ReportIs(HID_KEYBOARD_MODIFIER_LEFTSHIFT, FirstSix));
+
+	SetKey(HID_KEYBOARD_SC_Q, 0);
+	Keyboard_BuildReport();
+	CHECK(ReportIs(HID_KEYBOARD_MODIFIER_LEFTSHIFT, AfterRelease));
+
+	for (i = 0; i < sizeof(Pressed); i++)
+		SetKey(Pressed[i], 0);
+	Keyboard_BuildReport();
+	CHECK(ReportIs(HID_KEYBOARD_MODIFIER_LEFTSHIFT, ShiftOnly));
+	CHECK(ActiveKeyCount == 0);
+}
+
+/** Queued key events reach the reports sent to the host. A key which is
+ *  pressed and released between two polls gets a report for each. */
+static void TestEventsReachHost(void)
+{
+	const struct StubUSBPacket *Packet;
+
+	ResetKeyboard();
+	KeyboardQueueEvent(HID_KEYBOARD_SC_A, 1, 0);
+	KeyboardQueueEvent(HID_KEYBOARD_SC_A, 0, 0);
+	RunFor(3500);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 2);
+	Packet = StubUSBPacket(KEYBOARD_IN_EPADDR, 0);
+	CHECK(Packet->Length == sizeof(USB_KeyboardNKROReport_Data_t));
+	CHECK(IS_KEY_BIT_SET(&Packet->Data[2], HID_KEYBOARD_SC_A));
+	Packet = StubUSBPacket(KEYBOARD_IN_EPADDR, 1);
+	CHECK(!IS_KEY_BIT_SET(&Packet->Data[2], HID_KEYBOARD_SC_A));
+}
+
+/** Check whether a key is down in a report the host collected.
+ *  \param[in]     Packet     The report, in the report protocol format.
+ *  \param[in]     ScanCode   The key.
+ *  \return uint8_t 1 if the key is down, 0 if it isn't.
+ */
+static uint8_t PacketHasKey(const struct StubUSBPacket *Packet, const uint8_t ScanCode)
+{
+	if (IS_MODIFIER_KEY(ScanCode))
+		return (Packet->Data[0] >> (ScanCode - HID_KEYBOARD_SC_LEFT_CONTROL)) & 1;
+	return IS_KEY_BIT_SET(&Packet->Data[2], ScanCode) ? 1 : 0;
+}
+
+/** Replay random bursts of presses, releases and re-presses, all queued
+ *  within one polling interval. Every transition must reach the host, in
+ *  its own report, and in the order it happened. */
+static void TestTransitionsReachHostInOrder(void)
+{
+	static const uint8_t Keys[] = {HID_KEYBOARD_SC_A, HID_KEYBOARD_SC_B, HID_KEYBOARD_SC_LEFT_SHIFT};
+	uint8_t EventKey[KEY_EVENT_QUEUE_SIZE];
+	uint16_t Visible[KEY_EVENT_QUEUE_SIZE];
+	uint8_t Held[sizeof(Keys)];
+	uint8_t Shown[sizeof(Keys)];
+	int8_t LastEvent[sizeof(Keys)];
+	uint16_t Burst;
+	uint16_t p;
+	uint8_t Events;
+	uint8_t e;
+	uint8_t k;
+
+	for (Burst = 0; Burst < RANDOM_BURSTS; Burst++)
+	{
+		ResetKeyboard();
+		RunFor(2500);
+		CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 1);
+
+		memset(Held, 0, sizeof(Held));
+		Events = 1 + Random() % KEY_EVENT_QUEUE_SIZE;
+		for (e = 0; e < Events; e++)
+		{
+			k = Random() % sizeof(Keys);
+			Held[k] = !Held[k];
+			EventKey[e] = k;
+			Visible[e] = 0;
+			KeyboardQueueEvent(Keys[k], Held[k], 0);
+		}
+		RunFor((Events + 3) * 1000);
+
+		/* Match each change the host sees with the key's next event. */
+		memset(Shown, 0, sizeof(Shown));
+		memset(LastEvent, -1, sizeof(LastEvent));
+		for (p = 1; p < StubUSBPacketCount(KEYBOARD_IN_EPADDR); p++)
+		{
+			for (k = 0; k < sizeof(Keys); k++)
+			{
+				if (PacketHasKey(StubUSBPacket(KEYBOARD_IN_EPADDR, p), Keys[k]) == Shown[k])
+					continue;
+				Shown[k] = !Shown[k];
+				for (e = LastEvent[k] + 1; (e < Events) && (EventKey[e] != k); e++)
+					;
+				CHECK(e < Events);
+				if (e < Events)
+				{
+					Visible[e] = p;
+					LastEvent[k] = e;
+				}
+			}
+		}
+		CHECK(memcmp(Shown, Held, sizeof(Held)) == 0);
+		for (e = 0; e < Events; e++)
+		{
+			CHECK(Visible[e] != 0);
+			if (e > 0)
+				CHECK(Visible[e] >= Visible[e - 1]);
+		}
+	}
+}
+
+/** Hold the U key down in the simulated matrix, so that the scanner makes
+ *  full passes rather than idle checks. */
+static void HoldKeyU(void)
+{
+	StubSwitches[1] |= (uint16_t)1 << (ColumnPins[0].num + ((ColumnPins[0].port == 5) ? 0 : 8));
+	StubUpdatePins();
+}
+
+/** Each frame's report comes from a pass which finished just before
+ *  KEYBOARD_REPORT_READY_US, so it is at most KEYBOARD_SCAN_MARGIN_US older
+ *  than it needs to be when the host collects it. The first pass after the
+ *  device is configured can't be timed yet, so its report is left out. */
+static void TestReportTiming(void)
+{
+	uint16_t Reports;
+
+	ResetKeyboard();
+	HoldKeyU();
+	RunFor(4000);
+	Reports = StubUSBPacketCount(KEYBOARD_IN_EPADDR);
+	KeyboardReportAgeMax = 0;
+	RunFrames(TIMING_FRAMES);
+	Reports = StubUSBPacketCount(KEYBOARD_IN_EPADDR) - Reports;
+	printf("    %u reports in %u frames, oldest %u us when collected\n",
+		Reports, TIMING_FRAMES, KeyboardReportAgeMax);
+	CHECK(Reports == TIMING_FRAMES);
+	CHECK(KeyboardReportAgeMax >= 1000 - KEYBOARD_REPORT_READY_US);
+	CHECK(KeyboardReportAgeMax <= 1000 - KEYBOARD_REPORT_READY_US + KEYBOARD_SCAN_MARGIN_US + TIMING_SLACK_US);
+	CHECK(KeyboardScanOverruns == 0);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+}
+
+/** When a pass takes longer than KEYBOARD_SCAN_BUDGET, it is counted, and
+ *  the scanner stops waiting for the frame and starts each pass as soon as
+ *  the last one ends. */
+static void TestScanOverrunFallsBack(void)
+{
+	uint16_t Passes;
+	uint16_t i;
+
+	ResetKeyboard();
+	HoldKeyU();
+	RowSettleTime = KEYBOARD_SCAN_BUDGET / MATRIX_ROWS;
+	RunFrames(TIMING_FRAMES);
+	printf("    %u overruns, %u reports in %u frames\n",
+		KeyboardScanOverruns, StubUSBPacketCount(KEYBOARD_IN_EPADDR), TIMING_FRAMES);
+	CHECK(KeyboardScanOverruns > 0);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) >= TIMING_FRAMES / 2);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+
+	/* A new pass starts on the very next call after one ends. */
+	Passes = 0;
+	for (i = 0; i < 5000; i++)
+	{
+		RunFor(1);
+		if (!ScanInProgress)
+		{
+			Passes++;
+			RunFor(1);
+			CHECK(ScanInProgress);
+		}
+	}
+	CHECK(Passes > 0);
+}
+
+/** Both report layouts parse, and are the size of the reports which are
+ *  sent in them. */
+static void TestReportDescriptors(void)
+{
+	HID_ReportInfo_t Info;
+
+	CHECK(USB_ProcessHIDReport(KeyboardReport, sizeof(KeyboardReport), &Info) == HID_PARSE_Successful);
+	CHECK(Info.ReportIDSizes[0].ReportSizeBits[HID_REPORT_ITEM_In] == sizeof(USB_KeyboardNKROReport_Data_t) * 8);
+	CHECK(sizeof(USB_KeyboardNKROReport_Data_t) <= KEYBOARD_IN_EPSIZE);
+	CHECK(USB_ProcessHIDReport(BootKeyboardReport, sizeof(BootKeyboardReport), &Info) == HID_PARSE_Successful);
+	CHECK(Info.ReportIDSizes[0].ReportSizeBits[HID_REPORT_ITEM_In] == sizeof(USB_KeyboardReport_Data_t) * 8);
+	CHECK(USB_ProcessHIDReport(MouseReport, sizeof(MouseReport), &Info) == HID_PARSE_Successful);
+#if MOUSE_REPORT_16BIT
+	CHECK(Info.ReportIDSizes[0].ReportSizeBits[HID_REPORT_ITEM_In] == sizeof(USB_MouseReport16_Data_t) * 8);
+#else
+	CHECK(Info.ReportIDSizes[0].ReportSizeBits[HID_REPORT_ITEM_In] == sizeof(USB_MouseReport_Data_t) * 8);
+#endif
+	CHECK(USB_ProcessHIDReport(BootMouseReport, sizeof(BootMouseReport), &Info) == HID_PARSE_Successful);
+	CHECK(Info.ReportIDSizes[0].ReportSizeBits[HID_REPORT_ITEM_In] == sizeof(USB_MouseReport_Data_t) * 8);
+}
+
+/** Random sets of held keys, decoded by the HID report parser from the
+ *  N-key rollover report, must come out as exactly the keys held. From the
+ *  boot report they must come out as the modifiers and the first six keys
+ *  pressed. */
+static void TestReportsDecode(void)
+{
+	static HID_ReportInfo_t NKROInfo;
+	static HID_ReportInfo_t BootInfo;
+	uint8_t Expected[256];
+	uint8_t Decoded[256];
+	uint8_t BootExpected[256];
+	uint8_t BootDecoded[256];
+	uint8_t ScanCode;
+	uint8_t Keys;
+	uint8_t NonModifiers;
+	uint16_t i;
+	uint8_t j;
+
+	CHECK(USB_ProcessHIDReport(KeyboardReport, sizeof(KeyboardReport), &NKROInfo) == HID_PARSE_Successful);
+	CHECK(USB_ProcessHIDReport(BootKeyboardReport, sizeof(BootKeyboardReport), &BootInfo) == HID_PARSE_Successful);
+	for (i = 0; i < RANDOM_REPORTS; i++)
+	{
+		ResetKeyboard();
+		memset(Expected, 0, sizeof(Expected));
+		memset(BootExpected, 0, sizeof(BootExpected));
+		Keys = Random() % (RANDOM_KEYS + 1);
+		NonModifiers = 0;
+		for (j = 0; j < Keys; j++)
+		{
+			/* Any key from A to the last one in the bitmap, or a modifier. */
+			if (Random() % 4)
+				ScanCode = HID_KEYBOARD_SC_A + (Random() % ((KEYBOARD_NKRO_BITMAP_SIZE * 8) - HID_KEYBOARD_SC_A));
+			else
+				ScanCode = HID_KEYBOARD_SC_LEFT_CONTROL + (Random() % 8);
+			if (Expected[ScanCode])
+				continue;
+			SetKey(ScanCode, 1);
+			Expected[ScanCode] = 1;
+			if (IS_MODIFIER_KEY(ScanCode) || (NonModifiers++ < MAX_KEYS_PRESSED))
+				BootExpected[ScanCode] = 1;
+		}
+
+		KeyboardUsingReportProtocol = true;
+		Keyboard_BuildReport();
+		DecodeReport(&NKROInfo, (const uint8_t *)&KeyboardNKROReportData, Decoded);
+		CHECK(memcmp(Decoded, Expected, sizeof(Expected)) == 0);
+
+		KeyboardUsingReportProtocol = false;
+		Keyboard_BuildReport();
+		DecodeReport(&BootInfo, (const uint8_t *)&KeyboardReportData, BootDecoded);
+		CHECK(memcmp(BootDecoded, BootExpected, sizeof(BootExpected)) == 0);
+		if (TestFailures)
+			break;
+	}
+}
+
+/** SET_PROTOCOL switches the keyboard between the two reports, and
+ *  GET_PROTOCOL reports which one is in use. */
+static void TestSetProtocol(void)
+{
+	const struct StubUSBPacket *Packet;
+
+	ResetKeyboard();
+	SetKey(HID_KEYBOARD_SC_A, 1);
+	ControlRequest(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_SetProtocol, 0);
+	CHECK(!KeyboardUsingReportProtocol);
+
+	ControlRequest(REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_GetProtocol, 0);
+	CHECK(StubUSBPacketCount(ENDPOINT_CONTROLEP) == 1);
+	Packet = StubUSBPacket(ENDPOINT_CONTROLEP, 0);
+	CHECK((Packet->Length == 1) && (Packet->Data[0] == 0));
+
+	RunFor(2500);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 1);
+	Packet = StubUSBPacket(KEYBOARD_IN_EPADDR, 0);
+	CHECK(Packet->Length == sizeof(USB_KeyboardReport_Data_t));
+	CHECK(Packet->Data[2] == HID_KEYBOARD_SC_A);
+
+	/* Going back to the report protocol gives the N-key rollover report.
+	 * Boot reports still waiting to be collected, in the queue or in the
+	 * endpoint banks, are thrown away. */
+	KeyboardQueueEvent(HID_KEYBOARD_SC_B, 1, 0);
+	KeyboardQueueEvent(HID_KEYBOARD_SC_B, 0, 0);
+	KeyboardQueueEvent(HID_KEYBOARD_SC_B, 1, 0);
+	Keyboard_QueueReports();
+	Keyboard_HID_Task();
+	Keyboard_HID_Task();
+	Endpoint_SelectEndpoint(KEYBOARD_IN_EPADDR);
+	CHECK(Endpoint_GetBusyBanks() == HID_IN_EPBANKS);
+	ControlRequest(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_SetProtocol, 1);
+	CHECK(KeyboardUsingReportProtocol);
+	Endpoint_SelectEndpoint(KEYBOARD_IN_EPADDR);
+	CHECK(Endpoint_GetBusyBanks() == 0);
+	RunFor(1500);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 2);
+	Packet = StubUSBPacket(KEYBOARD_IN_EPADDR, 1);
+	CHECK(Packet->Length == sizeof(USB_KeyboardNKROReport_Data_t));
+	CHECK(IS_KEY_BIT_SET(&Packet->Data[2], HID_KEYBOARD_SC_A));
+}
+
+/** SetReport and the status stages are finished off by Control_Task()
+ *  without holding up the keyboard while the host is slow, and a new SETUP
+ *  packet or a bus reset abandons them. */
+static void TestControlStages(void)
+{
+	static const uint8_t LEDReport = HID_KEYBOARD_LED_CAPSLOCK;
+	uint8_t i;
+
+	ResetKeyboard();
+	ControlRequest(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_SetReport, HID_REPORT_ITEM_Out << 8);
+	CHECK(ControlState == CONTROL_STATE_SETREPORT_DATA);
+	KeyboardQueueEvent(HID_KEYBOARD_SC_A, 1, 0);
+	for (i = 0; i < 10; i++)
+	{
+		Control_Task();
+		RunFor(500);
+	}
+	CHECK(ControlState == CONTROL_STATE_SETREPORT_DATA);
+	CHECK(StubUSBPacketCount(ENDPOINT_CONTROLEP) == 0);
+	CHECK(IS_KEY_BIT_SET(&StubUSBPacket(KEYBOARD_IN_EPADDR, StubUSBPacketCount(KEYBOARD_IN_EPADDR) - 1)->Data[2],
+		HID_KEYBOARD_SC_A));
+
+	/* The LED report arrives, and a zero length status packet is sent. */
+	StubUSBOut(ENDPOINT_CONTROLEP, &LEDReport, sizeof(LEDReport));
+	Control_Task();
+	CHECK(ControlState == CONTROL_STATE_STATUS_IN);
+	Control_Task();
+	CHECK(ControlState == CONTROL_STATE_IDLE);
+	CHECK(StubUSBPacketCount(ENDPOINT_CONTROLEP) == 1);
+	CHECK(StubUSBPacket(ENDPOINT_CONTROLEP, 0)->Length == 0);
+
+	/* GET_PROTOCOL waits for the host's zero length status packet. */
+	ControlRequest(REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_GetProtocol, 0);
+	Control_Task();
+	CHECK(ControlState == CONTROL_STATE_STATUS_OUT);
+	StubUSBOut(ENDPOINT_CONTROLEP, &LEDReport, 0);
+	Control_Task();
+	CHECK(ControlState == CONTROL_STATE_IDLE);
+
+	ControlRequest(REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_GetProtocol, 0);
+	StubUSBSetup();
+	Control_Task();
+	CHECK(ControlState == CONTROL_STATE_IDLE);
+	Endpoint_ClearSETUP();
+
+	ControlRequest(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_SetReport, HID_REPORT_ITEM_Out << 8);
+	EVENT_USB_Device_Reset();
+	CHECK(ControlState == CONTROL_STATE_IDLE);
+}
+
+/** Write a pattern with Endpoint_Write_Report(), and check what the host
+ *  collects.
+ *  \param[in]     Pattern   The pattern, at least Size bytes long.
+ *  \param[in]     Size      Number of bytes to write.
+ *  \return uint8_t 1 if every byte arrived, in order, and no more.
+ */
+static uint8_t WriteReportArrives(const uint8_t *Pattern, const uint8_t Size)
+{
+	const struct StubUSBPacket *Packet;
+
+	Endpoint_SelectEndpoint(MOUSE_IN_EPADDR);
+	Endpoint_Write_Report(Pattern, Size);
+	Endpoint_ClearIN();
+	StubUSBPoll(MOUSE_IN_EPADDR);
+	Packet = StubUSBPacket(MOUSE_IN_EPADDR, StubUSBPacketCount(MOUSE_IN_EPADDR) - 1);
+	return (Packet->Length == Size) && (memcmp(Packet->Data, Pattern, Size) == 0);
+}
+
+/** Endpoint_Write_Report() writes each byte once, in order, for every
+ *  size a report can have. */
+static void TestWriteReport(void)
+{
+	uint8_t Pattern[32];
+	uint8_t i;
+
+	ResetKeyboard();
+	for (i = 0; i < sizeof(Pattern); i++)
+		Pattern[i] = 0xA0 + i;
+	CHECK(WriteReportArrives(Pattern, 1));
+	CHECK(WriteReportArrives(Pattern, sizeof(USB_MouseReport_Data_t)));
+	CHECK(WriteReportArrives(Pattern, sizeof(USB_KeyboardReport_Data_t)));
+	CHECK(WriteReportArrives(Pattern, sizeof(USB_KeyboardNKROReport_Data_t)));
+	CHECK(WriteReportArrives(Pattern, 32));
+}
+
+/** Wake the CPU from sleep while the bus is suspended, as the watchdog
+ *  would. A key which wasn't held when the bus was suspended is pressed on
+ *  the second wake, and the host resumes the bus on the fourth. */
+static void SuspendWake(void)
+{
+	Wakes++;
+	if (Wakes == 2)
+	{
+		StubSwitches[1] |= (uint16_t)1 << (ColumnPins[3].num + ((ColumnPins[3].port == 5) ? 0 : 8));
+		StubUpdatePins();
+	}
+	if (Wakes == 4)
+		USB_DeviceState = DEVICE_STATE_Configured;
+	else
+		StubWakeInterrupt = SuspendWake;
+}
+
+/** While the bus is suspended the CPU sleeps, and a key pressed during the
+ *  suspend, but not one held since before it, wakes the host once, if the
+ *  host has allowed it. */
+static void TestSuspendWakesHost(void)
+{
+	uint8_t Enabled;
+
+	ResetKeyboard();
+	StubSleepCount = 0;
+	Suspend_Task();
+	CHECK(StubSleepCount == 0);
+
+	for (Enabled = 0; Enabled <= 1; Enabled++)
+	{
+		ResetKeyboard();
+		HoldKeyU();
+		RunFor(20000);
+		CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+
+		USB_Device_RemoteWakeupEnabled = Enabled;
+		USB_DeviceState = DEVICE_STATE_Suspended;
+		EVENT_USB_Device_Suspend();
+		Wakes = 0;
+		StubSleepCount = 0;
+		StubWakeInterrupt = SuspendWake;
+		Suspend_Task();
+		CHECK(Wakes == 4);
+		CHECK(StubSleepCount == 4);
+		CHECK(StubRemoteWakeups == Enabled);
+
+		/* Scanning starts again, and finds the new key. */
+		EVENT_USB_Device_WakeUp();
+		RunFor(20000);
+		CHECK(KeyPressed[HID_KEYBOARD_SC_L]);
+	}
+}
+
+/** A keyboard report is only sent when it changes, or when the idle
+ *  period runs out, apart from the first one after configuration. */
+static void TestReportsOnChange(void)
+{
+	uint8_t i;
+
+	ResetKeyboard();
+	RunFor(5000);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 1);
+
+	KeyboardQueueEvent(HID_KEYBOARD_SC_A, 1, 0);
+	RunFor(5000);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 2);
+	CHECK(IS_KEY_BIT_SET(&StubUSBPacket(KEYBOARD_IN_EPADDR, 1)->Data[2], HID_KEYBOARD_SC_A));
+
+	/* The default idle period is 500 ms. */
+	for (i = 0; i < 48; i++)
+		RunFor(10000);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 2);
+	RunFor(20000);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == 3);
+	CHECK(memcmp(StubUSBPacket(KEYBOARD_IN_EPADDR, 1), StubUSBPacket(KEYBOARD_IN_EPADDR, 2),
+		sizeof(struct StubUSBPacket)) == 0);
+}
+
+/** SET_IDLE sets how often an unchanged report is repeated, in units of
+ *  4 ms, and 0 stops it being repeated at all. GET_IDLE reads it back. */
+static void TestSetIdle(void)
+{
+	const struct StubUSBPacket *Packet;
+	uint16_t Reports;
+
+	ResetKeyboard();
+	ControlRequest(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_SetIdle, 1 << 8);
+	ControlRequest(REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_GetIdle, 0);
+	CHECK(StubUSBPacketCount(ENDPOINT_CONTROLEP) == 1);
+	Packet = StubUSBPacket(ENDPOINT_CONTROLEP, 0);
+	CHECK((Packet->Length == 1) && (Packet->Data[0] == 1));
+
+	RunFor(5000);
+	Reports = StubUSBPacketCount(KEYBOARD_IN_EPADDR);
+	RunFor(40000);
+	Reports = StubUSBPacketCount(KEYBOARD_IN_EPADDR) - Reports;
+	CHECK((Reports >= 9) && (Reports <= 11));
+
+	ControlRequest(REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE, HID_REQ_SetIdle, 0);
+	RunFor(5000);
+	Reports = StubUSBPacketCount(KEYBOARD_IN_EPADDR);
+	RunFor(40000);
+	CHECK(StubUSBPacketCount(KEYBOARD_IN_EPADDR) == Reports);
+}
+
+/** The mouse only sends a report when it has moved or a button has
+ *  changed, since its idle period starts out infinite. */
+static void TestMouseReportsOnChange(void)
+{
+	static HID_ReportInfo_t Info;
+	const struct StubUSBPacket *Packet;
+	int16_t X, Y;
+	uint8_t Buttons;
+
+	CHECK(USB_ProcessHIDReport(MouseReport, sizeof(MouseReport), &Info) == HID_PARSE_Successful);
+	ResetKeyboard();
+	Button1State = 0;
+	Button2State = 0;
+	AccumulatedX = 0;
+	AccumulatedY = 0;
+	Mouse_HID_Task();
+	StubUSBPoll(MOUSE_IN_EPADDR);
+	CHECK(StubUSBPacketCount(MOUSE_IN_EPADDR) == 0);
+
+	AccumulatedX = 5;
+	AccumulatedY = -3;
+	Mouse_HID_Task();
+	StubUSBPoll(MOUSE_IN_EPADDR);
+	CHECK(StubUSBPacketCount(MOUSE_IN_EPADDR) == 1);
+	Packet = StubUSBPacket(MOUSE_IN_EPADDR, 0);
+	DecodeMouseReport(&Info, Packet->Data, &X, &Y, &Buttons);
+	CHECK((Buttons == 0) && (X == 5) && (Y == -3));
+	CHECK((AccumulatedX == 0) && (AccumulatedY == 0));
+
+	Mouse_HID_Task();
+	StubUSBPoll(MOUSE_IN_EPADDR);
+	CHECK(StubUSBPacketCount(MOUSE_IN_EPADDR) == 1);
+
+	Button1State = 1;
+	Mouse_HID_Task();
+	StubUSBPoll(MOUSE_IN_EPADDR);
+	CHECK(StubUSBPacketCount(MOUSE_IN_EPADDR) == 2);
+	DecodeMouseReport(&Info, StubUSBPacket(MOUSE_IN_EPADDR, 1)->Data, &X, &Y, &Buttons);
+	CHECK(Buttons == 1);
+	Button1State = 0;
+}
+
+/** Play a synthetic trace of mouse movement through Mouse_HID_Task(), with
+ *  the host collecting every report, and decode what the host receives.
+ *  Nothing may be lost: the movement in the reports must add up to the
+ *  movement in the trace, however large each step is.
+ *  \param[in]     Info      The parsed report descriptor for the protocol in use.
+ *  \param[in]     Size      Size of the reports in the protocol in use.
+ *  \param[in]     MaxMove   Largest movement which fits in one report.
+ *  \return uint16_t Number of reports the host received.
+ */
+static uint16_t PlayMouseTrace(HID_ReportInfo_t *Info, const uint8_t Size, const int16_t MaxMove)
+{
+	const struct StubUSBPacket *Packet;
+	int32_t TotalX, TotalY;
+	int32_t SentX, SentY;
+	int16_t X, Y;
+	uint8_t Buttons;
+	uint16_t Count;
+	uint16_t Reports;
+	uint16_t i;
+	uint8_t Step;
+
+	AccumulatedX = 0;
+	AccumulatedY = 0;
+	TotalX = 0;
+	TotalY = 0;
+	Count = 0;
+	for (Step = 0; Step < TRACE_STEPS; Step++)
+	{
+		/* Mostly small movements, with a flick every so often. */
+		if (Step % 4)
+			X = (int16_t)(Random() % 21) - 10;
+		else
+			X = (int16_t)(Random() % ((TRACE_MAX_MOVE * 2) + 1)) - TRACE_MAX_MOVE;
+		Y = (int16_t)(Random() % ((TRACE_MAX_MOVE * 2) + 1)) - TRACE_MAX_MOVE;
+		if (Step == 1)
+		{
+			/* The largest movement there can be in one step. */
+			X = TRACE_MAX_MOVE;
+			Y = -TRACE_MAX_MOVE;
+		}
+		AccumulatedX += X;
+		AccumulatedY += Y;
+		TotalX += X;
+		TotalY += Y;
+
+		Mouse_HID_Task();
+		StubUSBPoll(MOUSE_IN_EPADDR);
+		Count++;
+	}
+	/* Let whatever didn't fit go out. */
+	for (i = 0; (i < 100) && (AccumulatedX || AccumulatedY); i++)
+	{
+		Mouse_HID_Task();
+		StubUSBPoll(MOUSE_IN_EPADDR);
+	}
+	CHECK((AccumulatedX == 0) && (AccumulatedY == 0));
+
+	SentX = 0;
+	SentY = 0;
+	Reports = StubUSBPacketCount(MOUSE_IN_EPADDR);
+	for (i = 0; i < Reports; i++)
+	{
+		Packet = StubUSBPacket(MOUSE_IN_EPADDR, i);
+		CHECK(Packet->Length == Size);
+		DecodeMouseReport(Info, Packet->Data, &X, &Y, &Buttons);
+		CHECK((X >= -MaxMove) && (X <= MaxMove));
+		CHECK((Y >= -MaxMove) && (Y <= MaxMove));
+		CHECK(Buttons == 0);
+		SentX += X;
+		SentY += Y;
+	}
+	CHECK(SentX == TotalX);
+	CHECK(SentY == TotalY);
+	CHECK(Reports >= Count);
+	return Reports;
+}
+
+/** Movement which doesn't fit in one report is carried over to later ones,
+ *  in both the 8-bit boot report and the 16-bit report protocol report. */
+static void TestMouseTrace(void)
+{
+	static HID_ReportInfo_t Info;
+	uint16_t Reports;
+
+	Button1State = 0;
+	Button2State = 0;
+	Button3State = 0;
+
+	ResetKeyboard();
+	MouseSetProtocol(0);
+	CHECK(USB_ProcessHIDReport(BootMouseReport, sizeof(BootMouseReport), &Info) == HID_PARSE_Successful);
+	Reports = PlayMouseTrace(&Info, sizeof(USB_MouseReport_Data_t), 127);
+	/* The flicks can't fit in one report each. */
+	CHECK(Reports > TRACE_STEPS);
+
+	ResetKeyboard();
+	MouseSetProtocol(1);
+	CHECK(USB_ProcessHIDReport(MouseReport, sizeof(MouseReport), &Info) == HID_PARSE_Successful);
+#if MOUSE_REPORT_16BIT
+	/* Every step fits in one report. */
+	Reports = PlayMouseTrace(&Info, sizeof(USB_MouseReport16_Data_t), 32767);
+	CHECK(Reports == TRACE_STEPS);
+#else
+	Reports = PlayMouseTrace(&Info, sizeof(USB_MouseReport_Data_t), 127);
+	CHECK(Reports > TRACE_STEPS);
+#endif
+}
+
+/** If events were lost, the held keys are rebuilt from KeyPressed. */
+static void TestOverflowResyncs(void)
+{
+	struct KeyEvent Event;
+
+	ResetKeyboard();
+	KeyboardUsingReportProtocol = false;
+	SetKey(HID_KEYBOARD_SC_B, 1);
+	KeyPressed[HID_KEYBOARD_SC_B] = 0;
+	KeyPressed[HID_KEYBOARD_SC_C] = 1;
+	KeyPressed[HID_KEYBOARD_SC_RIGHT_ALT] = 1;
+	KeyboardQueueEvent(HID_KEYBOARD_SC_D, 1, 0);
+	KeyEventQueueOverflow = 1;
+	Keyboard_ApplyKeyEvents();
+	Keyboard_BuildReport();
+	CHECK(!KeyEventQueueOverflow);
+	CHECK(!KeyboardPeekEvent(&Event));
+	CHECK(KeyboardReportData.Modifier == HID_KEYBOARD_MODIFIER_RIGHTALT);
+	CHECK(KeyboardReportData.KeyCode[0] == HID_KEYBOARD_SC_C);
+	CHECK(KeyboardReportData.KeyCode[1] == 0);
+}
+
+/** Let time pass while other main loop tasks run, with the start of frame
+ *  interrupt still arriving on time.
+ *  \param[in]     Microseconds   How long for.
+ */
+static void RunOtherTasks(const uint16_t Microseconds)
+{
+	uint16_t i;
+
+	for (i = 0; i < Microseconds; i++)
+	{
+		if ((uint16_t)(TCNT1 - FrameTimer) >= 1000 * TIMER1_COUNTS_PER_US)
+		{
+			FrameTimer += 1000 * TIMER1_COUNTS_PER_US;
+			EVENT_USB_Device_StartOfFrame();
+		}
+		StubAdvanceTime(TIMER1_COUNTS_PER_US);
+	}
+}
+
+/** Simulate the mouse task being held up by other tasks for a random time
+ *  on each pass, with polls of various lengths. Each poll must finish every
+ *  MOUSE_POLL_INTERVAL_FRAMES frames, just before MOUSE_SAMPLE_READY_US into
+ *  the frame, however late the task got to start it. The first two polls
+ *  are left out, as the first is planned from a guess at how long polls
+ *  take, and may be planned from a stale frame start. */
+static void TestMousePollTiming(void)
+{
+	static const uint16_t Durations[] = {4200, 3000, 4800};
+	uint16_t MinPhase;
+	uint16_t MaxPhase;
+	uint16_t Polls;
+	int16_t Phase;
+	uint8_t LastFrame;
+	uint8_t Frame;
+	uint8_t d;
+
+	LastFrame = 0;
+	for (d = 0; d < sizeof(Durations) / sizeof(Durations[0]); d++)
+	{
+		ResetKeyboard();
+		FakeMouseDuration = Durations[d] * TIMER1_COUNTS_PER_US;
+		FakeMouseBusy = 0;
+		FakeMousePolls = 0;
+		ADBBusPollDuration = 4200 * TIMER1_COUNTS_PER_US;
+		Polls = 0;
+		MinPhase = 0xffff;
+		MaxPhase = 0;
+		while (FakeMousePolls < (JITTER_POLLS + 2))
+		{
+			Mouse_HID_Task();
+			if (FakeMousePolls != Polls)
+			{
+				/* Work out which frame the sample was taken in, and how far
+				 * into it. */
+				Polls = FakeMousePolls;
+				Frame = FrameCount;
+				Phase = (int16_t)(FakeMouseDone - FrameTimer) / TIMER1_COUNTS_PER_US;
+				if (Phase < 0)
+				{
+					Phase += 1000;
+					Frame--;
+				}
+				if (Polls > 2)
+				{
+					CHECK(Phase >= (MOUSE_SAMPLE_READY_US - MOUSE_POLL_MARGIN_US - JITTER_MAX_US));
+					CHECK(Phase <= MOUSE_SAMPLE_READY_US);
+					CHECK((uint8_t)(Frame - LastFrame) == MOUSE_POLL_INTERVAL_FRAMES);
+					if ((uint16_t)Phase < MinPhase)
+						MinPhase = Phase;
+					if ((uint16_t)Phase > MaxPhase)
+						MaxPhase = Phase;
+				}
+				else if (Polls == 2)
+				{
+					/* The lateness of the first two polls doesn't count
+					 * either, as the first is planned from a frame start
+					 * which may be long gone. */
+					MousePollLatenessMax = 0;
+				}
+				LastFrame = Frame;
+			}
+			RunOtherTasks(1 + (Random() % JITTER_MAX_US));
+		}
+		CHECK(MousePollSlips == 0);
+		CHECK(MousePollLatenessMax <= (JITTER_MAX_US + 1));
+		printf("    %4u us polls: sampled %3u-%3u us into the frame, worst lateness %2u us\n",
+			Durations[d], MinPhase, MaxPhase, MousePollLatenessMax);
+	}
+	FakeMouseDuration = 0;
+	FakeMouseBusy = 0;
+}
+
+/** Time building reports from the list of held keys, and from the loop
+ *  over every scan code, with no keys and with a few keys held. */
+static void TestReportBuildBenchmark(void)
+{
+	static const uint8_t Held[] = {HID_KEYBOARD_SC_LEFT_SHIFT, HID_KEYBOARD_SC_H, HID_KEYBOARD_SC_J, HID_KEYBOARD_SC_K};
+	USB_KeyboardReport_Data_t Report;
+	double StartTime;
+	double ListTime;
+	double RefTime;
+	uint32_t i;
+	uint8_t Keys;
+
+	for (Keys = 0; Keys <= sizeof(Held); Keys += sizeof(Held))
+	{
+		ResetKeyboard();
+		KeyboardUsingReportProtocol = false;
+		for (i = 0; i < Keys; i++)
+			SetKey(Held[i], 1);
+
+		StartTime = TestHostTime();
+		for (i = 0; i < BENCHMARK_REPORTS; i++)
+			Keyboard_BuildReport();
+		ListTime = TestHostTime() - StartTime;
+
+		StartTime = TestHostTime();
+		for (i = 0; i < BENCHMARK_REPORTS; i++)
+			RefBuildReport(&Report);
+		RefTime = TestHostTime() - StartTime;
+
+		CHECK(memcmp(&KeyboardReportData, &Report, sizeof(Report)) == 0);
+		printf("    %u keys held: held key list %.1f ns, every scan code %.1f ns per report\n",
+			Keys, ListTime * 1e9 / BENCHMARK_REPORTS, RefTime * 1e9 / BENCHMARK_REPORTS);
+		CHECK(ListTime < RefTime);
+	}
+}
+
+int main(void)
+{
+	printf("TestKeyboardMouse\n");
+	RUN_TEST(TestModifiers);
+	RUN_TEST(TestRolloverKeepsOldestKeys);
+	RUN_TEST(TestEventsReachHost);
+	RUN_TEST(TestTransitionsReachHostInOrder);
+	RUN_TEST(TestReportTiming);
+	RUN_TEST(TestScanOverrunFallsBack);
+	RUN_TEST(TestOverflowResyncs);
+	RUN_TEST(TestReportDescriptors);
+	RUN_TEST(TestReportsDecode);
+	RUN_TEST(TestSetProtocol);
+	RUN_TEST(TestReportsOnChange);
+	RUN_TEST(TestSetIdle);
+	RUN_TEST(TestControlStages);
+	RUN_TEST(TestWriteReport);
+	RUN_TEST(TestSuspendWakesHost);
+	RUN_TEST(TestMouseReportsOnChange);
+	RUN_TEST(TestMouseTrace);
+	RUN_TEST(TestMousePollTiming);
+	RUN_TEST(TestReportBuildBenchmark);
+	return TestResult("TestKeyboardMouse");
+}
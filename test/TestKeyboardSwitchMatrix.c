@@ -0,0 +1,1140 @@
+/** \file
+ *
+ *  Host tests for KeyboardSwitchMatrix.c. The switches are simulated by
+ *  Stubs.c, so the scanner drives and samples the pins like it does in the
+ *  keyboard, and time only passes between calls to KeyboardScanMatrix(), as
+ *  if the main loop were doing other work.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#include "../KeyboardSwitchMatrix.c"
+
+/** Rows and columns in the matrix where the keys used by these tests are. */
+#define ROW_U_L				1 /* U and L */
+#define ROW_B_J				3 /* B and J */
+#define COLUMN_U_B			0 /* U in row 1, B in row 3 */
+#define COLUMN_L_J			3 /* L in row 1, J in row 3 */
+#define COLUMN_LEFT_SHIFT	12 /* every row */
+
+/** Longest time one call to KeyboardScanMatrix() may take, in Timer1
+ *  counts. Anything longer means it waited for the pins to settle. */
+#define LONGEST_CALL		(5 * TIMER1_COUNTS_PER_US)
+/** Number of rows each way of sampling the columns samples, when timing
+ *  them. */
+#define BENCHMARK_SAMPLES	1000000
+
+/** Number of random matrices that the ghost check is tried on. */
+#define RANDOM_MATRICES		100000
+/** Number of random row samples that the scanner is tried on. */
+#define RANDOM_SAMPLES		100000
+/** Largest number of keys held down at once by TestGhostCombinations(). */
+#define COMBINATION_KEYS	4
+/** Number of times each ghost check is run, when timing them. */
+#define BENCHMARK_CHECKS	100000
+
+/** A physical key. The keys in ghost-free columns are connected to every
+ *  row, so there is one of them per column, rather than one per switch. */
+struct PhysicalKey
+{
+	uint8_t Row;
+	uint8_t Column;
+	uint8_t ScanCode;
+};
+
+/** Everything which sampling a row changes, in the scanner and in the
+ *  reference, so that TestGhostCombinations() can go back to an earlier
+ *  set of held keys. */
+struct MatrixState
+{
+	uint16_t RawRowPressed[MATRIX_ROWS];
+	uint16_t DebouncePending[MATRIX_ROWS];
+	uint8_t DebounceStartTime[MATRIX_ROWS][16];
+	uint16_t SharedPressed;
+	uint16_t SharedPending;
+	uint8_t SharedStartTime[16];
+	uint8_t GhostRows;
+	uint16_t GhostColumns;
+	uint8_t KeyPressed[256];
+	uint8_t KeyEventQueueIn;
+	uint8_t KeyEventQueueOut;
+	uint8_t KeyEventQueueOverflow;
+	uint8_t RefRawSwitchPressed[MATRIX_ROWS][MATRIX_COLUMNS];
+	uint8_t RefTotalInRow[MATRIX_ROWS];
+	uint8_t RefTotalInColumn[MATRIX_COLUMNS];
+	uint8_t RefRowHasGhost[MATRIX_ROWS];
+	uint8_t RefColumnHasGhost[MATRIX_COLUMNS];
+	uint8_t RefKeyPressed[256];
+};
+
+/** Every physical key in the matrix, filled in by FindPhysicalKeys(). */
+static struct PhysicalKey PhysicalKeys[MATRIX_ROWS * MATRIX_COLUMNS];
+/** Number of entries in PhysicalKeys. */
+static uint8_t TotalPhysicalKeys;
+/** Saved states for TestGhostCombinations(), one per number of keys held. */
+static struct MatrixState SavedStates[COMBINATION_KEYS + 1];
+/** Keys held by TestGhostCombinations(), as indices into PhysicalKeys. */
+static uint8_t HeldKeys[COMBINATION_KEYS];
+/** What TestGhostCombinations() found. */
+static uint32_t Combinations[COMBINATION_KEYS + 1];
+static uint32_t GhostedCombinations;
+static uint32_t GhostMismatches;
+static uint32_t KeyMismatches;
+static uint32_t GhostKeysReported;
+
+/** State of the generator used for test patterns, see Random(). */
+static uint32_t RandomState = 1;
+
+/* The raw matrix state and ghost check from before the raw matrix was
+ * stored as bitmaps, kept as a reference to check the bitmaps against.
+ * These are indexed by row and column, like KeyboardMatrix. */
+static uint8_t RefRawSwitchPressed[MATRIX_ROWS][MATRIX_COLUMNS];
+static uint8_t RefTotalInRow[MATRIX_ROWS];
+static uint8_t RefTotalInColumn[MATRIX_COLUMNS];
+static uint8_t RefRowHasGhost[MATRIX_ROWS];
+static uint8_t RefColumnHasGhost[MATRIX_COLUMNS];
+static uint8_t RefKeyPressed[256];
+
+/** Find which bit of StubSwitches a column is in.
+ *  \param[in]     Column   Column in the matrix.
+ *  \return uint16_t Mask for the column.
+ */
+static uint16_t SwitchBit(const uint8_t Column)
+{
+	return (uint16_t)1 << (ColumnPins[Column].num + ((ColumnPins[Column].port == 5) ? 0 : 8));
+}
+
+/** Make up a pseudo-random number. The sequence is the same on every run,
+ *  so that failures can be reproduced.
+ *  \return uint16_t The number.
+ */
+static uint16_t Random(void)
+{
+	RandomState = RandomState * 1103515245 + 12345;
+	return RandomState >> 16;
+}
+
+/** Sample the columns of the row which is driven low the way
+ *  KeyboardSampleRow() used to, with a ReadPortPin() call for each column.
+ *  \return uint16_t Which columns read low, bit 0 = first column.
+ */
+static uint16_t SampleColumnsByPin(void)
+{
+	uint16_t Sample;
+	uint8_t i;
+
+	Sample = 0;
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+	{
+		if (ReadPortPin(ColumnPins[i].port, ColumnPins[i].num) == 0)
+			Sample |= 1 << i;
+	}
+	return Sample;
+}
+
+/** Sample the columns of the row which is driven low with
+ *  READ_COLUMN_PINS(), and sort the result into column order.
+ *  \return uint16_t Which columns read low, bit 0 = first column.
+ */
+static uint16_t SampleColumnsByPort(void)
+{
+	uint16_t Pins;
+	uint16_t Sample;
+	uint8_t i;
+
+	Pins = READ_COLUMN_PINS();
+	Sample = 0;
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+	{
+		if ((Pins & ColumnMask[i]) == 0)
+			Sample |= 1 << i;
+	}
+	return Sample;
+}
+
+/** Reference ghost check: CheckForGhosts() as it was before the raw matrix
+ *  was stored as bitmaps. */
+static void RefCheckForGhosts(void)
+{
+	uint8_t Row, Column;
+	uint8_t i, j;
+
+	memset(RefRowHasGhost, 0, sizeof(RefRowHasGhost));
+	memset(RefColumnHasGhost, 0, sizeof(RefColumnHasGhost));
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+		{
+			if (IS_GHOST_FREE_COLUMN(Column))
+				continue;
+			if (RefRawSwitchPressed[Row][Column] && (RefTotalInRow[Row] >= 2) && (RefTotalInColumn[Column] >= 2))
+			{
+				for (i = 0; i < MATRIX_ROWS; i++)
+				{
+					if (RefRawSwitchPressed[i][Column])
+						RefRowHasGhost[i] = 1;
+				}
+				for (j = 0; j < MATRIX_COLUMNS; j++)
+				{
+					if (IS_GHOST_FREE_COLUMN(j))
+						continue;
+					if (RefRawSwitchPressed[Row][j])
+						RefColumnHasGhost[j] = 1;
+				}
+			}
+		}
+	}
+}
+
+/** Reference row sample: update the reference state from a sample of one
+ *  row the way KeyboardScanMatrix() used to, except that the whole row is
+ *  updated before checking for ghosts, and keys in ghost-free columns are
+ *  never held back by a ghost, like KeyboardSampleRow() does.
+ *  \param[in]     Row       Row which was sampled.
+ *  \param[in]     Columns   Which columns read low, bit 0 = first column.
+ */
+static void RefSampleRow(const uint8_t Row, const uint16_t Columns)
+{
+	uint8_t SwitchPressed;
+	uint8_t SwitchChanged;
+	uint8_t Column;
+	uint8_t ScanCode;
+
+	SwitchChanged = 0;
+	for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+	{
+		SwitchPressed = ((Columns >> Column) & 1);
+		if (SwitchPressed != RefRawSwitchPressed[Row][Column])
+		{
+			RefTotalInRow[Row] += SwitchPressed ? 1 : -1;
+			RefTotalInColumn[Column] += SwitchPressed ? 1 : -1;
+			RefRawSwitchPressed[Row][Column] = SwitchPressed;
+			SwitchChanged = 1;
+		}
+	}
+	if (SwitchChanged)
+		RefCheckForGhosts();
+	for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+	{
+		SwitchPressed = ((Columns >> Column) & 1);
+		ScanCode = KeyboardMatrix[Row][Column];
+		if (!SwitchPressed || IS_GHOST_FREE_COLUMN(Column) ||
+			(!RefRowHasGhost[Row] && !RefColumnHasGhost[Column]))
+		{
+			RefKeyPressed[ScanCode] = SwitchPressed;
+		}
+	}
+}
+
+/** Check that GhostRows and GhostColumns agree with the reference.
+ *  \return uint8_t 1 if they do, 0 if they don't.
+ */
+static uint8_t GhostsMatchReference(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < MATRIX_ROWS; i++)
+	{
+		if (((GhostRows >> i) & 1) != RefRowHasGhost[i])
+			return 0;
+	}
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+	{
+		if (((GhostColumns & ColumnMask[i]) != 0) != RefColumnHasGhost[i])
+			return 0;
+	}
+	return 1;
+}
+
+/** Sample one row with KeyboardSampleRow(), with the column pins set up to
+ *  read as if the switches in the given columns were down.
+ *  \param[in]     Row       Row to sample.
+ *  \param[in]     Columns   Bitmap of columns, bit 0 = first column.
+ */
+static void SampleRow(const uint8_t Row, const uint16_t Columns)
+{
+	uint16_t Low;
+	uint8_t i;
+
+	Low = 0;
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+	{
+		if (Columns & (1 << i))
+			Low |= ColumnMask[i];
+	}
+	PINB = ~(Low >> 8) | 0xc0;
+	PINE = ~(Low >> 8) | 0x3f;
+	PINF = ~Low;
+	CurrentRow = Row;
+	KeyboardSampleRow();
+}
+
+/** Count the queued events for one key, and empty the queue.
+ *  \param[in]     ScanCode   Scan code of the key.
+ *  \param[in]     Pressed    1 to count presses, 0 to count releases.
+ *  \return uint8_t Number of matching events.
+ */
+static uint8_t TakeEvents(const uint8_t ScanCode, const uint8_t Pressed)
+{
+	struct KeyEvent Event;
+	uint8_t Count;
+
+	Count = 0;
+	while (KeyboardPeekEvent(&Event))
+	{
+		if ((Event.ScanCode == ScanCode) && (Event.Pressed == Pressed))
+			Count++;
+		KeyboardRemoveEvent();
+	}
+	return Count;
+}
+
+/** Save everything which sampling a row changes.
+ *  \param[out]    State   Where to save it.
+ */
+static void SaveState(struct MatrixState *State)
+{
+	memcpy(State->RawRowPressed, RawRowPressed, sizeof(RawRowPressed));
+	memcpy(State->DebouncePending, DebouncePending, sizeof(DebouncePending));
+	memcpy(State->DebounceStartTime, DebounceStartTime, sizeof(DebounceStartTime));
+	State->SharedPressed = SharedPressed;
+	State->SharedPending = SharedPending;
+	memcpy(State->SharedStartTime, SharedStartTime, sizeof(SharedStartTime));
+	State->GhostRows = GhostRows;
+	State->GhostColumns = GhostColumns;
+	memcpy(State->KeyPressed, KeyPressed, sizeof(KeyPressed));
+	State->KeyEventQueueIn = KeyEventQueueIn;
+	State->KeyEventQueueOut = KeyEventQueueOut;
+	State->KeyEventQueueOverflow = KeyEventQueueOverflow;
+	memcpy(State->RefRawSwitchPressed, RefRawSwitchPressed, sizeof(RefRawSwitchPressed));
+	memcpy(State->RefTotalInRow, RefTotalInRow, sizeof(RefTotalInRow));
+	memcpy(State->RefTotalInColumn, RefTotalInColumn, sizeof(RefTotalInColumn));
+	memcpy(State->RefRowHasGhost, RefRowHasGhost, sizeof(RefRowHasGhost));
+	memcpy(State->RefColumnHasGhost, RefColumnHasGhost, sizeof(RefColumnHasGhost));
+	memcpy(State->RefKeyPressed, RefKeyPressed, sizeof(RefKeyPressed));
+}
+
+/** Go back to a state saved by SaveState().
+ *  \param[in]     State   The saved state.
+ */
+static void RestoreState(const struct MatrixState *State)
+{
+	memcpy(RawRowPressed, State->RawRowPressed, sizeof(RawRowPressed));
+	memcpy(DebouncePending, State->DebouncePending, sizeof(DebouncePending));
+	memcpy(DebounceStartTime, State->DebounceStartTime, sizeof(DebounceStartTime));
+	SharedPressed = State->SharedPressed;
+	SharedPending = State->SharedPending;
+	memcpy(SharedStartTime, State->SharedStartTime, sizeof(SharedStartTime));
+	GhostRows = State->GhostRows;
+	GhostColumns = State->GhostColumns;
+	memcpy(KeyPressed, State->KeyPressed, sizeof(KeyPressed));
+	KeyEventQueueIn = State->KeyEventQueueIn;
+	KeyEventQueueOut = State->KeyEventQueueOut;
+	KeyEventQueueOverflow = State->KeyEventQueueOverflow;
+	memcpy(RefRawSwitchPressed, State->RefRawSwitchPressed, sizeof(RefRawSwitchPressed));
+	memcpy(RefTotalInRow, State->RefTotalInRow, sizeof(RefTotalInRow));
+	memcpy(RefTotalInColumn, State->RefTotalInColumn, sizeof(RefTotalInColumn));
+	memcpy(RefRowHasGhost, State->RefRowHasGhost, sizeof(RefRowHasGhost));
+	memcpy(RefColumnHasGhost, State->RefColumnHasGhost, sizeof(RefColumnHasGhost));
+	memcpy(RefKeyPressed, State->RefKeyPressed, sizeof(RefKeyPressed));
+}
+
+/** Fill in PhysicalKeys from KeyboardMatrix. */
+static void FindPhysicalKeys(void)
+{
+	uint8_t Row;
+	uint8_t Column;
+
+	TotalPhysicalKeys = 0;
+	for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+	{
+		for (Row = 0; Row < MATRIX_ROWS; Row++)
+		{
+			if (KeyboardMatrix[Row][Column] == 0x00)
+				continue;
+			PhysicalKeys[TotalPhysicalKeys].Row = Row;
+			PhysicalKeys[TotalPhysicalKeys].Column = Column;
+			PhysicalKeys[TotalPhysicalKeys].ScanCode = KeyboardMatrix[Row][Column];
+			TotalPhysicalKeys++;
+			if (IS_GHOST_FREE_COLUMN(Column))
+				break;
+		}
+	}
+}
+
+/** Hold down or let go of a physical key in the simulated matrix.
+ *  \param[in]     Key       The key.
+ *  \param[in]     Pressed   1 to hold it down, 0 to let go of it.
+ */
+static void SetPhysicalKey(const struct PhysicalKey *Key, const uint8_t Pressed)
+{
+	uint8_t Row;
+
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		if ((Row == Key->Row) || IS_GHOST_FREE_COLUMN(Key->Column))
+		{
+			if (Pressed)
+				StubSwitches[Row] |= SwitchBit(Key->Column);
+			else
+				StubSwitches[Row] &= ~SwitchBit(Key->Column);
+		}
+	}
+}
+
+/** Drive each row low in turn, and sample it with both KeyboardSampleRow()
+ *  and the reference. The columns read whatever the simulated switches
+ *  connect them to, ghost keys included. GhostMismatches is incremented
+ *  for each row after which the ghosts differ.
+ */
+static void SampleMatrixAndReference(void)
+{
+	uint8_t Row;
+
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		DDRC = 1 << Row;
+		PORTC = ~(1 << Row);
+		StubUpdatePins();
+		CurrentRow = Row;
+		KeyboardSampleRow();
+		RefSampleRow(Row, SampleColumnsByPort());
+		if (!GhostsMatchReference())
+			GhostMismatches++;
+	}
+	DDRC = 0;
+	PORTC = 0xff;
+	StubUpdatePins();
+}
+
+/** Hold down one more key, after those in HeldKeys[0] to HeldKeys[Held - 1],
+ *  scan the matrix, and compare the scanner with the reference. Then do the
+ *  same again with every later key in PhysicalKeys, and recurse until
+ *  COMBINATION_KEYS keys are held.
+ *  \param[in]     Held    Number of keys already held.
+ */
+static void TryCombinations(const uint8_t Held)
+{
+	uint8_t First;
+	uint8_t Key;
+	uint8_t i;
+	uint8_t j;
+	uint8_t InCombination;
+
+	First = (Held == 0) ? 0 : (HeldKeys[Held - 1] + 1);
+	SaveState(&SavedStates[Held]);
+	for (Key = First; Key < TotalPhysicalKeys; Key++)
+	{
+		HeldKeys[Held] = Key;
+		SetPhysicalKey(&PhysicalKeys[Key], 1);
+		SampleMatrixAndReference();
+		if (Held >= 1)
+		{
+			Combinations[Held + 1]++;
+			if (GhostRows)
+				GhostedCombinations++;
+			if (memcmp(KeyPressed, RefKeyPressed, sizeof(KeyPressed)) != 0)
+				KeyMismatches++;
+			/* Only keys which are really held may be reported. */
+			for (i = 0; i < TotalPhysicalKeys; i++)
+			{
+				if (!KeyPressed[PhysicalKeys[i].ScanCode])
+					continue;
+				InCombination = 0;
+				for (j = 0; j <= Held; j++)
+				{
+					if (HeldKeys[j] == i)
+						InCombination = 1;
+				}
+				if (!InCombination)
+					GhostKeysReported++;
+			}
+		}
+		if ((Held + 1) < COMBINATION_KEYS)
+			TryCombinations(Held + 1);
+		/* Let go of the key, and go back to the state from before it was
+		 * held, rather than scanning its release. */
+		SetPhysicalKey(&PhysicalKeys[Key], 0);
+		RestoreState(&SavedStates[Held]);
+	}
+}
+
+/** Press or release one switch.
+ *  \param[in]     Row       Row of the switch.
+ *  \param[in]     Column    Column of the switch.
+ *  \param[in]     Pressed   1 to press it, 0 to release it.
+ */
+static void SetSwitch(const uint8_t Row, const uint8_t Column, const uint8_t Pressed)
+{
+	if (Pressed)
+		StubSwitches[Row] |= SwitchBit(Column);
+	else
+		StubSwitches[Row] &= ~SwitchBit(Column);
+	StubUpdatePins();
+}
+
+/** Put the matrix back in its start-up state, with no keys down. */
+static void ResetMatrix(void)
+{
+	uint8_t i;
+
+	memset(StubSwitches, 0, sizeof(StubSwitches));
+	StubDiodeColumns = 0;
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+	{
+		if (IS_GHOST_FREE_COLUMN(i))
+			StubDiodeColumns |= SwitchBit(i);
+	}
+	memset(RawRowPressed, 0, sizeof(RawRowPressed));
+	memset(DebouncePending, 0, sizeof(DebouncePending));
+	SharedPressed = 0;
+	SharedPending = 0;
+	GhostRows = 0;
+	GhostColumns = 0;
+	memset(KeyPressed, 0, sizeof(KeyPressed));
+	KeyEventQueueIn = 0;
+	KeyEventQueueOut = 0;
+	KeyEventQueueOverflow = 0;
+	memset(RefRawSwitchPressed, 0, sizeof(RefRawSwitchPressed));
+	memset(RefTotalInRow, 0, sizeof(RefTotalInRow));
+	memset(RefTotalInColumn, 0, sizeof(RefTotalInColumn));
+	memset(RefRowHasGhost, 0, sizeof(RefRowHasGhost));
+	memset(RefColumnHasGhost, 0, sizeof(RefColumnHasGhost));
+	memset(RefKeyPressed, 0, sizeof(RefKeyPressed));
+	CurrentRow = 0;
+	ScanState = SCAN_STATE_DRIVE_ROW;
+	MatrixActive = 0;
+	IdleCheckFoundKey = 0;
+	StubSetMilliseconds(0);
+	KeyboardInit();
+}
+
+/** Call KeyboardScanMatrix() for a while, letting a microsecond pass
+ *  between calls.
+ *  \param[in]     Milliseconds   How long for.
+ *  \return uint16_t How many times KeyboardScanMatrix() returned 1.
+ */
+static uint16_t ScanFor(const uint16_t Milliseconds)
+{
+	uint16_t StartTime;
+	uint16_t Passes;
+
+	StartTime = StubMilliseconds;
+	Passes = 0;
+	while ((uint16_t)(StubMilliseconds - StartTime) < Milliseconds)
+	{
+		Passes += KeyboardScanMatrix();
+		StubAdvanceTime(TIMER1_COUNTS_PER_US);
+	}
+	return Passes;
+}
+
+/** Call KeyboardScanMatrix() until it returns 1, letting a microsecond pass
+ *  between calls.
+ *  \param[out]    LongestCall   Longest time spent in one call, in Timer1
+ *                               counts.
+ *  \return uint16_t How long it took, in Timer1 counts.
+ */
+static uint16_t ScanPass(uint16_t *LongestCall)
+{
+	uint16_t StartTime;
+	uint16_t CallStartTime;
+	uint16_t Calls;
+	uint8_t Done;
+
+	StartTime = TCNT1;
+	*LongestCall = 0;
+	for (Calls = 0; Calls < 10000; Calls++)
+	{
+		CallStartTime = TCNT1;
+		Done = KeyboardScanMatrix();
+		if ((uint16_t)(TCNT1 - CallStartTime) > *LongestCall)
+			*LongestCall = TCNT1 - CallStartTime;
+		if (Done)
+			break;
+		StubAdvanceTime(TIMER1_COUNTS_PER_US);
+	}
+	CHECK(Calls < 10000);
+	return TCNT1 - StartTime;
+}
+
+/** Scan the matrix over and over, until the debounce times have passed.
+ *  \param[out]    LongestCall   Longest time spent in one call to
+ *                               KeyboardScanMatrix(), in Timer1 counts.
+ */
+static void ScanUntilDebounced(uint16_t *LongestCall)
+{
+	uint16_t Longest;
+	uint16_t StartTime;
+
+	*LongestCall = 0;
+	StartTime = StubMilliseconds;
+	while ((uint16_t)(StubMilliseconds - StartTime) <= (DEBOUNCE_PRESS_MS + DEBOUNCE_RELEASE_MS))
+	{
+		ScanPass(&Longest);
+		if (Longest > *LongestCall)
+			*LongestCall = Longest;
+	}
+}
+
+/** KeyboardScanMatrix() must never wait for the row and column pins to
+ *  settle, but it must still leave them time to settle, and find the keys
+ *  which are down. */
+static void TestScanNeverStalls(void)
+{
+	uint16_t Longest;
+	uint16_t PassTime;
+
+	ResetMatrix();
+	SetSwitch(ROW_U_L, COLUMN_U_B, 1);
+	SetSwitch(ROW_B_J, COLUMN_L_J, 1);
+	ScanUntilDebounced(&Longest);
+	CHECK(Longest <= LONGEST_CALL);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_J]);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_B]);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_L]);
+
+	SetSwitch(ROW_U_L, COLUMN_U_B, 0);
+	PassTime = ScanPass(&Longest);
+	ScanUntilDebounced(&Longest);
+	CHECK(Longest <= LONGEST_CALL);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_J]);
+	printf("    a pass took %u us, the longest call took %u us\n",
+		PassTime / TIMER1_COUNTS_PER_US, Longest / TIMER1_COUNTS_PER_US);
+	CHECK(PassTime >= MATRIX_ROWS * (RowSettleTime + (ROW_RELEASE_TIME * TIMER1_COUNTS_PER_US)));
+	/* The whole matrix is scanned within a 1 ms report period. */
+	CHECK(PassTime < 1000 * TIMER1_COUNTS_PER_US);
+	/* Every row is back in the pulled-up state between rows. */
+	CHECK((DDRC == 0) && (PORTC == 0xff));
+}
+
+/** The simulated columns rise as soon as they are let go of, so
+ *  KeyboardCalibrate() must measure them all as fast, and choose the
+ *  shortest settle time. */
+static void TestCalibration(void)
+{
+	uint8_t i;
+
+	ResetMatrix();
+	for (i = 0; i < MATRIX_COLUMNS; i++)
+		CHECK(ColumnRiseTime[i] <= 2);
+	CHECK(RowSettleTime == ROW_SETTLE_TIME_MIN * TIMER1_COUNTS_PER_US);
+}
+
+/** While no key is down, each check drives every row low at once, so it
+ *  takes about as long as scanning one row. Each check covers the whole
+ *  matrix, so it counts as a pass. Once a key goes down, the next check
+ *  finds it and a full pass follows. */
+static void TestIdleCheck(void)
+{
+	uint16_t CheckTime;
+	uint16_t Longest;
+
+	ResetMatrix();
+	ScanFor(2);
+	CHECK(!MatrixActive);
+
+	/* The first pass may start part way through a check. */
+	ScanPass(&Longest);
+	CheckTime = ScanPass(&Longest);
+	printf("    an idle check took %u us\n", CheckTime / TIMER1_COUNTS_PER_US);
+	CHECK(CheckTime <= RowSettleTime + ((ROW_RELEASE_TIME + 4) * TIMER1_COUNTS_PER_US));
+	CHECK(!MatrixActive);
+
+	SetSwitch(ROW_U_L, COLUMN_U_B, 1);
+	ScanPass(&Longest);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(MatrixActive);
+
+	/* Once it is released and debounced, the checks start again. */
+	SetSwitch(ROW_U_L, COLUMN_U_B, 0);
+	ScanFor(DEBOUNCE_RELEASE_MS + 2);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(!MatrixActive);
+	CHECK(ScanFor(2) >= 2000 / ((CheckTime / TIMER1_COUNTS_PER_US) + 1));
+}
+
+/** Reading the three column ports at once must give the same columns as
+ *  reading each column pin, for any switches which are down. */
+static void TestColumnSamplingMatches(void)
+{
+	uint16_t Pattern;
+	uint16_t Expected;
+	uint16_t i;
+	uint8_t Column;
+
+	ResetMatrix();
+	SetPortPinDirection(RowPins[ROW_U_L].port, RowPins[ROW_U_L].num, 1);
+	WritePortPin(RowPins[ROW_U_L].port, RowPins[ROW_U_L].num, 0);
+	for (i = 0; i < 1000; i++)
+	{
+		Pattern = Random();
+		StubSwitches[ROW_U_L] = Pattern;
+		StubUpdatePins();
+		Expected = 0;
+		for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+		{
+			if (Pattern & SwitchBit(Column))
+				Expected |= 1 << Column;
+		}
+		CHECK(SampleColumnsByPin() == Expected);
+		CHECK(SampleColumnsByPort() == Expected);
+	}
+	SetPortPinDirection(RowPins[ROW_U_L].port, RowPins[ROW_U_L].num, 0);
+	ResetMatrix();
+}
+
+/** Time sampling a row with a ReadPortPin() call for each column against
+ *  reading the three ports with READ_COLUMN_PINS(). */
+static void TestColumnSamplingBenchmark(void)
+{
+	volatile uint16_t Sink;
+	double StartTime;
+	double ByPin;
+	double ByPort;
+	uint32_t i;
+
+	ResetMatrix();
+	StubSwitches[ROW_U_L] = Random();
+	SetPortPinDirection(RowPins[ROW_U_L].port, RowPins[ROW_U_L].num, 1);
+	WritePortPin(RowPins[ROW_U_L].port, RowPins[ROW_U_L].num, 0);
+
+	StartTime = TestHostTime();
+	for (i = 0; i < BENCHMARK_SAMPLES; i++)
+		Sink = SampleColumnsByPin();
+	ByPin = TestHostTime() - StartTime;
+	StartTime = TestHostTime();
+	for (i = 0; i < BENCHMARK_SAMPLES; i++)
+		Sink = READ_COLUMN_PINS();
+	ByPort = TestHostTime() - StartTime;
+	(void)Sink;
+	printf("    ReadPortPin() per column: %.1f ns per row, READ_COLUMN_PINS(): %.1f ns per row\n",
+		ByPin * 1e9 / BENCHMARK_SAMPLES, ByPort * 1e9 / BENCHMARK_SAMPLES);
+	CHECK(ByPort < ByPin);
+	ResetMatrix();
+}
+
+/** The bitmap ghost check must flag the same rows and columns as the
+ *  array-based one did, for random sets of pressed switches. */
+static void TestGhostBitmapsMatchArrays(void)
+{
+	uint32_t Matrix;
+	uint32_t Ghosted;
+	uint8_t Presses;
+	uint8_t Row;
+	uint8_t Column;
+
+	Ghosted = 0;
+	for (Matrix = 0; Matrix < RANDOM_MATRICES; Matrix++)
+	{
+		ResetMatrix();
+		for (Presses = Random() % 12; Presses > 0; Presses--)
+		{
+			Row = Random() % MATRIX_ROWS;
+			Column = Random() % MATRIX_COLUMNS;
+			if (RefRawSwitchPressed[Row][Column])
+				continue;
+			RefRawSwitchPressed[Row][Column] = 1;
+			RefTotalInRow[Row]++;
+			RefTotalInColumn[Column]++;
+			RawRowPressed[Row] |= ColumnMask[Column];
+		}
+		CheckForGhosts();
+		RefCheckForGhosts();
+		CHECK(GhostsMatchReference());
+		if (TestFailures)
+			break;
+		if (GhostRows)
+			Ghosted++;
+	}
+	printf("    %u of %u matrices had ghosts\n", (unsigned int)Ghosted, RANDOM_MATRICES);
+	ResetMatrix();
+}
+
+/** Sampling rows must update the raw matrix, the ghosts and KeyPressed like
+ *  the array-based scanner did, for a random walk of switch presses and
+ *  releases. The reference doesn't debounce, so each row is sampled again
+ *  once the debounce times have passed, and only then compared. */
+static void TestSampleRowMatchesArrays(void)
+{
+	uint16_t Columns[MATRIX_ROWS];
+	uint32_t Sample;
+	uint16_t Row;
+	uint8_t i;
+
+	ResetMatrix();
+	memset(Columns, 0, sizeof(Columns));
+	for (Sample = 0; Sample < RANDOM_SAMPLES; Sample++)
+	{
+		/* Change a few switches in a random row, pressing more than are
+		 * released so that ghosts turn up, and sometimes let go of them all. */
+		Row = Random() % MATRIX_ROWS;
+		if ((Random() % 64) == 0)
+			memset(Columns, 0, sizeof(Columns));
+		Columns[Row] ^= Random() & Random() & Random();
+		SampleRow(Row, Columns[Row]);
+		StubSetMilliseconds(StubMilliseconds + DEBOUNCE_PRESS_MS + DEBOUNCE_RELEASE_MS);
+		SampleRow(Row, Columns[Row]);
+		RefSampleRow(Row, Columns[Row]);
+		for (i = 0; i < MATRIX_COLUMNS; i++)
+			CHECK(((RawRowPressed[Row] & ColumnMask[i]) != 0) == RefRawSwitchPressed[Row][i]);
+		CHECK(GhostsMatchReference());
+		CHECK(memcmp(KeyPressed, RefKeyPressed, sizeof(KeyPressed)) == 0);
+		if (TestFailures)
+			break;
+	}
+	ResetMatrix();
+}
+
+/** Three keys at the corners of a rectangle make the fourth corner look
+ *  pressed too. Those rows and columns must be marked as ghosts. */
+static void TestGhostRectangle(void)
+{
+	ResetMatrix();
+	RawRowPressed[ROW_U_L] = ColumnMask[COLUMN_U_B] | ColumnMask[COLUMN_L_J];
+	RawRowPressed[ROW_B_J] = ColumnMask[COLUMN_L_J];
+	CheckForGhosts();
+	CHECK(GhostRows == ((1 << ROW_U_L) | (1 << ROW_B_J)));
+	CHECK(GhostColumns == (ColumnMask[COLUMN_U_B] | ColumnMask[COLUMN_L_J]));
+
+	/* Two keys in a row, or in a column, can't cause a ghost. */
+	RawRowPressed[ROW_B_J] = 0;
+	CheckForGhosts();
+	CHECK(GhostRows == 0);
+	CHECK(GhostColumns == 0);
+}
+
+/** The ghost key at the fourth corner of a rectangle must not be reported,
+ *  but the three real keys which were already down stay down. */
+static void TestGhostNotReported(void)
+{
+	ResetMatrix();
+	SampleRow(ROW_U_L, (1 << COLUMN_U_B) | (1 << COLUMN_L_J));
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_L]);
+	/* J is pressed, and B appears along with it. */
+	SampleRow(ROW_B_J, (1 << COLUMN_U_B) | (1 << COLUMN_L_J));
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_B]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_L]);
+}
+
+/** Modifiers have diodes and appear in every row, so holding one along with
+ *  keys in other rows must not count as a ghost. */
+static void TestGhostFreeColumn(void)
+{
+	uint8_t Row;
+
+	ResetMatrix();
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		if (Row == ROW_U_L)
+			SampleRow(Row, (1 << COLUMN_LEFT_SHIFT) | (1 << COLUMN_U_B));
+		else if (Row == ROW_B_J)
+			SampleRow(Row, (1 << COLUMN_LEFT_SHIFT) | (1 << COLUMN_L_J));
+		else
+			SampleRow(Row, 1 << COLUMN_LEFT_SHIFT);
+	}
+	CHECK(GhostRows == 0);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_LEFT_SHIFT]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_J]);
+}
+
+/** For every combination of 2, 3 or 4 physical keys, pressed one at a time
+ *  with a scan of the matrix after each, the scanner must flag the same
+ *  ghosts as the reference after every row, and report the same keys. It
+ *  must never report a key which isn't held down. */
+static void TestGhostCombinations(void)
+{
+	uint8_t i;
+
+	ResetMatrix();
+	FindPhysicalKeys();
+	memset(Combinations, 0, sizeof(Combinations));
+	GhostedCombinations = 0;
+	GhostMismatches = 0;
+	KeyMismatches = 0;
+	GhostKeysReported = 0;
+	TryCombinations(0);
+	for (i = 2; i <= COMBINATION_KEYS; i++)
+		printf("    %u keys: %u combinations\n", i, (unsigned int)Combinations[i]);
+	printf("    %u of them had ghosts\n", (unsigned int)GhostedCombinations);
+	CHECK(TotalPhysicalKeys == 62);
+	CHECK(Combinations[2] == 1891);
+	CHECK(Combinations[3] == 37820);
+	CHECK(Combinations[4] == 557845);
+	CHECK(GhostMismatches == 0);
+	CHECK(KeyMismatches == 0);
+	CHECK(GhostKeysReported == 0);
+	ResetMatrix();
+}
+
+/** Time the ghost check against the reference, with every switch pressed,
+ *  which is the worst case for both. A row sample used to run the check
+ *  for each of its switches which changed, so up to MATRIX_COLUMNS times,
+ *  but now runs it at most once. */
+static void TestGhostWorstCaseBenchmark(void)
+{
+	double StartTime;
+	double Bitmap;
+	double Arrays;
+	uint32_t i;
+	uint8_t Row;
+	uint8_t Column;
+
+	ResetMatrix();
+	for (Row = 0; Row < MATRIX_ROWS; Row++)
+	{
+		RawRowPressed[Row] = 0xffff;
+		for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+			RefRawSwitchPressed[Row][Column] = 1;
+		RefTotalInRow[Row] = MATRIX_COLUMNS;
+	}
+	for (Column = 0; Column < MATRIX_COLUMNS; Column++)
+		RefTotalInColumn[Column] = MATRIX_ROWS;
+
+	StartTime = TestHostTime();
+	for (i = 0; i < BENCHMARK_CHECKS; i++)
+		CheckForGhosts();
+	Bitmap = (TestHostTime() - StartTime) / BENCHMARK_CHECKS;
+	StartTime = TestHostTime();
+	for (i = 0; i < BENCHMARK_CHECKS; i++)
+		RefCheckForGhosts();
+	Arrays = (TestHostTime() - StartTime) / BENCHMARK_CHECKS;
+	CHECK(GhostsMatchReference());
+	printf("    worst case per check: bitmaps %.1f ns, arrays %.1f ns\n", Bitmap * 1e9, Arrays * 1e9);
+	printf("    worst case per row: bitmaps %.1f ns, arrays %.1f ns\n", Bitmap * 1e9, Arrays * 1e9 * MATRIX_COLUMNS);
+	CHECK(Bitmap < Arrays);
+	ResetMatrix();
+}
+
+/** Presses are reported straight away. Releases are only reported once the
+ *  switch has stayed released for DEBOUNCE_RELEASE_MS, so bounces after a
+ *  press are ignored. */
+static void TestDebounceRelease(void)
+{
+	uint8_t Ms;
+
+	ResetMatrix();
+	SampleRow(ROW_U_L, 1 << COLUMN_U_B);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(TakeEvents(HID_KEYBOARD_SC_U, 1) == 1);
+
+	/* Bounce: released, pressed, released again, each for under the
+	 * debounce time. */
+	StubSetMilliseconds(1);
+	SampleRow(ROW_U_L, 0);
+	StubSetMilliseconds(2);
+	SampleRow(ROW_U_L, 1 << COLUMN_U_B);
+	StubSetMilliseconds(3);
+	SampleRow(ROW_U_L, 0);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+
+	/* Then it stays released. The timing restarted at 3 ms. */
+	for (Ms = 4; Ms < 3 + DEBOUNCE_RELEASE_MS; Ms++)
+	{
+		StubSetMilliseconds(Ms);
+		SampleRow(ROW_U_L, 0);
+		CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+	}
+	StubSetMilliseconds(3 + DEBOUNCE_RELEASE_MS);
+	SampleRow(ROW_U_L, 0);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_U]);
+	CHECK(DebouncePending[ROW_U_L] == 0);
+	/* The bounces gave no events, and the release gave one. */
+	CHECK(TakeEvents(HID_KEYBOARD_SC_U, 0) == 1);
+}
+
+/** A modifier is one switch, even though it appears in every row, so it
+ *  has one debouncer. If it bounces while a pass is part way through, the
+ *  rows sampled after the bounce must not release it, and once it is let
+ *  go it must be released after DEBOUNCE_RELEASE_MS, not once per row. */
+static void TestSharedColumnDebounce(void)
+{
+	uint8_t Row;
+	uint8_t Pass;
+
+	ResetMatrix();
+	for (Pass = 0; Pass < 2 + DEBOUNCE_RELEASE_MS; Pass++)
+	{
+		StubSetMilliseconds(Pass);
+		for (Row = 0; Row < MATRIX_ROWS; Row++)
+		{
+			/* Pressed during the first pass, with a bounce in row 4, then
+			 * released from then on. */
+			if ((Pass == 0) && (Row != 4))
+				SampleRow(Row, 1 << COLUMN_LEFT_SHIFT);
+			else
+				SampleRow(Row, 0);
+			if (Pass == 0)
+				CHECK(KeyPressed[HID_KEYBOARD_SC_LEFT_SHIFT]);
+		}
+		if (Pass < DEBOUNCE_RELEASE_MS)
+			CHECK(KeyPressed[HID_KEYBOARD_SC_LEFT_SHIFT]);
+	}
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_LEFT_SHIFT]);
+	CHECK(SharedPending == 0);
+}
+
+/** A modifier is one switch, even though it appears in every row. Bouncing
+ *  while a pass is part way through must give one press, and the release
+ *  must give one release, rather than an event per row. */
+static void TestSharedColumnOneEvent(void)
+{
+	struct KeyEvent Event;
+	uint8_t Presses;
+	uint8_t Releases;
+	uint8_t Row;
+	uint8_t Pass;
+
+	ResetMatrix();
+	Presses = 0;
+	Releases = 0;
+	for (Pass = 0; Pass < 2 + DEBOUNCE_RELEASE_MS; Pass++)
+	{
+		StubSetMilliseconds(Pass);
+		for (Row = 0; Row < MATRIX_ROWS; Row++)
+		{
+			/* Pressed during the first pass, with a bounce in row 4, then
+			 * released from then on. */
+			if ((Pass == 0) && (Row != 4))
+				SampleRow(Row, 1 << COLUMN_LEFT_SHIFT);
+			else
+				SampleRow(Row, 0);
+		}
+		while (KeyboardPeekEvent(&Event))
+		{
+			if (Event.ScanCode == HID_KEYBOARD_SC_LEFT_SHIFT)
+			{
+				if (Event.Pressed)
+					Presses++;
+				else
+					Releases++;
+			}
+			KeyboardRemoveEvent();
+		}
+	}
+	CHECK(Presses == 1);
+	CHECK(Releases == 1);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_LEFT_SHIFT]);
+}
+
+/** Keys which are ghosts must not give events. */
+static void TestGhostGivesNoEvent(void)
+{
+	uint16_t Longest;
+
+	ResetMatrix();
+	SetSwitch(ROW_U_L, COLUMN_U_B, 1);
+	SetSwitch(ROW_U_L, COLUMN_L_J, 1);
+	SetSwitch(ROW_B_J, COLUMN_U_B, 1);
+	ScanUntilDebounced(&Longest);
+	CHECK(!KeyPressed[HID_KEYBOARD_SC_J]);
+	CHECK(TakeEvents(HID_KEYBOARD_SC_J, 1) == 0);
+}
+
+/** Once the queue is full, further events are dropped and
+ *  KeyEventQueueOverflow is set, but KeyPressed stays correct. The events
+ *  which were queued come out in the order the keys changed in. */
+static void TestKeyEventQueueOverflow(void)
+{
+	struct KeyEvent Event;
+	uint8_t Events;
+	uint8_t Column;
+
+	ResetMatrix();
+	/* Every key in the row but one gives a press, then one release... */
+	SampleRow(ROW_U_L, 0xffff);
+	StubSetMilliseconds(1);
+	SampleRow(ROW_U_L, 0xffff & ~(1 << 1));
+	StubSetMilliseconds(1 + DEBOUNCE_RELEASE_MS);
+	SampleRow(ROW_U_L, 0xffff & ~(1 << 1));
+	CHECK(!KeyEventQueueOverflow);
+	/* ...which fills the queue, so this press doesn't fit. */
+	SampleRow(ROW_U_L, 0xffff);
+	CHECK(KeyEventQueueOverflow);
+	CHECK(KeyPressed[KeyboardMatrix[ROW_U_L][1]]);
+
+	Events = 0;
+	Column = 0;
+	while (KeyboardPeekEvent(&Event))
+	{
+		while (KeyboardMatrix[ROW_U_L][Column] == 0x00)
+			Column++;
+		if (Column < MATRIX_COLUMNS)
+		{
+			CHECK(Event.ScanCode == KeyboardMatrix[ROW_U_L][Column]);
+			CHECK(Event.Pressed);
+			Column++;
+		}
+		else
+		{
+			CHECK(Event.ScanCode == KeyboardMatrix[ROW_U_L][1]);
+			CHECK(!Event.Pressed);
+		}
+		KeyboardRemoveEvent();
+		Events++;
+	}
+	CHECK(Events == KEY_EVENT_QUEUE_SIZE);
+}
+
+/** While the bus is suspended, a key which was already down doesn't count
+ *  as a new press until it has been released, but any other key does. */
+static void TestSuspendIgnoresHeldKeys(void)
+{
+	uint16_t Longest;
+
+	ResetMatrix();
+	SetSwitch(ROW_U_L, COLUMN_U_B, 1);
+	ScanUntilDebounced(&Longest);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+
+	KeyboardSuspend();
+	CHECK(PCICR & (1 << PCIE0));
+	CHECK(!KeyboardNewKeyDown());
+	SetSwitch(ROW_B_J, COLUMN_L_J, 1);
+	CHECK(KeyboardNewKeyDown());
+	SetSwitch(ROW_B_J, COLUMN_L_J, 0);
+	CHECK(!KeyboardNewKeyDown());
+
+	/* Releasing the held key and pressing it again is a new press. */
+	SetSwitch(ROW_U_L, COLUMN_U_B, 0);
+	CHECK(!KeyboardNewKeyDown());
+	SetSwitch(ROW_U_L, COLUMN_U_B, 1);
+	CHECK(KeyboardNewKeyDown());
+
+	KeyboardResume();
+	CHECK(!(PCICR & (1 << PCIE0)));
+	CHECK(MatrixActive);
+	ScanUntilDebounced(&Longest);
+	CHECK(KeyPressed[HID_KEYBOARD_SC_U]);
+}
+
+int main(void)
+{
+	printf("TestKeyboardSwitchMatrix\n");
+	RUN_TEST(TestScanNeverStalls);
+	RUN_TEST(TestCalibration);
+	RUN_TEST(TestIdleCheck);
+	RUN_TEST(TestColumnSamplingMatches);
+	RUN_TEST(TestColumnSamplingBenchmark);
+	RUN_TEST(TestGhostBitmapsMatchArrays);
+	RUN_TEST(TestSampleRowMatchesArrays);
+	RUN_TEST(TestGhostRectangle);
+	RUN_TEST(TestGhostNotReported);
+	RUN_TEST(TestGhostFreeColumn);
+	RUN_TEST(TestGhostCombinations);
+	RUN_TEST(TestGhostWorstCaseBenchmark);
+	RUN_TEST(TestDebounceRelease);
+	RUN_TEST(TestSharedColumnDebounce);
+	RUN_TEST(TestSharedColumnOneEvent);
+	RUN_TEST(TestGhostGivesNoEvent);
+	RUN_TEST(TestKeyEventQueueOverflow);
+	RUN_TEST(TestSuspendIgnoresHeldKeys);
+	return TestResult("TestKeyboardSwitchMatrix");
+}
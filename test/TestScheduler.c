@@ -0,0 +1,175 @@
+/** \file
+ *
+ *  Tests for the main loop scheduler in Scheduler.c. Interrupts are played
+ *  by handlers which the stub cli() and sleep_cpu() run, so that a test can
+ *  choose whether an interrupt arrives just before the scheduler disables
+ *  interrupts, or while the CPU is asleep.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#include <string.h>
+#include "Test.h"
+#include "../Scheduler.c"
+
+/** How far away (in microseconds) the deadlines used by the tests are. */
+#define DEADLINE_US			500
+/** How late (in microseconds) the deadline interrupt is, see DeadlineWake(). */
+#define LATENESS_US			3
+
+/** Put the scheduler back in its start-up state, with nothing asked for and
+ *  nothing counted. */
+static void ResetScheduler(void)
+{
+	memset(SchedulerTaskWakes, 0, sizeof(SchedulerTaskWakes));
+	SchedulerOtherWakes = 0;
+	SchedulerTickWakes = 0;
+	SchedulerBusyPasses = 0;
+	SchedulerMaxLateness = 0;
+	RunNowRequested = 0;
+	WakeTimeRequested = 0;
+	StubInterrupt = NULL;
+	StubWakeInterrupt = NULL;
+	StubSleepCount = 0;
+	TIMSK1 = 0;
+}
+
+/** An interrupt which gives the keyboard task work, like the USB start of
+ *  frame. */
+static void KeyboardInterrupt(void)
+{
+	SchedulerRunNow(SCHEDULER_TASK_KEYBOARD);
+}
+
+/** The millisecond tick, which gives no task work. */
+static void TickInterrupt(void)
+{
+	StubAdvanceTime(TIMER1_COUNTS_PER_US);
+}
+
+/** The compare B match, a little after the deadline. */
+static void DeadlineWake(void)
+{
+	StubAdvanceTime((uint16_t)(OCR1B - TCNT1) + LATENESS_US * TIMER1_COUNTS_PER_US);
+	TIMER1_COMPB_vect();
+}
+
+/** A task with work to do straight away keeps the CPU awake. */
+static void TestRunNowSkipsSleep(void)
+{
+	ResetScheduler();
+	SchedulerRunAt(SCHEDULER_TASK_MOUSE, TCNT1 + DEADLINE_US * TIMER1_COUNTS_PER_US);
+	SchedulerRunNow(SCHEDULER_TASK_KEYBOARD);
+	SchedulerSleep();
+	CHECK(StubSleepCount == 0);
+	CHECK(SchedulerBusyPasses == 1);
+	CHECK(!(TIMSK1 & (1 << OCIE1B)));
+
+	/* Nothing carries over to the next pass. */
+	StubWakeInterrupt = TickInterrupt;
+	SchedulerSleep();
+	CHECK(StubSleepCount == 1);
+	CHECK(SchedulerTickWakes == 1);
+}
+
+/** An interrupt which gives a task work after the tasks have looked for
+ *  work, but before the CPU goes to sleep, must not be lost: the CPU would
+ *  sleep until the next interrupt, with the work left waiting. */
+static void TestInterruptBeforeSleep(void)
+{
+	ResetScheduler();
+	StubInterrupt = KeyboardInterrupt;
+	SchedulerSleep();
+	CHECK(StubSleepCount == 0);
+	CHECK(SchedulerBusyPasses == 1);
+	CHECK(SchedulerOtherWakes == 0);
+
+	/* The same with a deadline armed, which must be disarmed again. */
+	ResetScheduler();
+	SchedulerRunAt(SCHEDULER_TASK_MOUSE, TCNT1 + DEADLINE_US * TIMER1_COUNTS_PER_US);
+	StubInterrupt = KeyboardInterrupt;
+	SchedulerSleep();
+	CHECK(StubSleepCount == 0);
+	CHECK(SchedulerBusyPasses == 1);
+	CHECK(SchedulerTaskWakes[SCHEDULER_TASK_MOUSE] == 0);
+	CHECK(!(TIMSK1 & (1 << OCIE1B)));
+}
+
+/** Wakes are counted by what woke the CPU. */
+static void TestWakeCounters(void)
+{
+	ResetScheduler();
+	StubWakeInterrupt = TickInterrupt;
+	SchedulerSleep();
+	CHECK(StubSleepCount == 1);
+	CHECK(SchedulerTickWakes == 1);
+	CHECK(SchedulerOtherWakes == 0);
+
+	StubWakeInterrupt = KeyboardInterrupt;
+	SchedulerSleep();
+	CHECK(StubSleepCount == 2);
+	CHECK(SchedulerTickWakes == 1);
+	CHECK(SchedulerOtherWakes == 1);
+	CHECK(SchedulerBusyPasses == 0);
+
+	/* The tick before a deadline isn't the deadline's wake. */
+	SchedulerRunAt(SCHEDULER_TASK_MOUSE, TCNT1 + DEADLINE_US * TIMER1_COUNTS_PER_US);
+	StubWakeInterrupt = TickInterrupt;
+	SchedulerSleep();
+	CHECK(SchedulerTickWakes == 2);
+	CHECK(SchedulerTaskWakes[SCHEDULER_TASK_MOUSE] == 0);
+	CHECK(!(TIMSK1 & (1 << OCIE1B)));
+}
+
+/** The CPU sleeps until the earliest deadline, which is counted for the
+ *  task which asked for it, along with how late the wake was. */
+static void TestDeadlineWake(void)
+{
+	uint16_t Deadline;
+
+	ResetScheduler();
+	Deadline = TCNT1 + DEADLINE_US * TIMER1_COUNTS_PER_US;
+	SchedulerRunAt(SCHEDULER_TASK_KEYBOARD, Deadline + 100);
+	SchedulerRunAt(SCHEDULER_TASK_MOUSE, Deadline);
+	SchedulerRunAt(SCHEDULER_TASK_USB, Deadline + 200);
+	StubWakeInterrupt = DeadlineWake;
+	SchedulerSleep();
+	CHECK(StubSleepCount == 1);
+	CHECK(OCR1B == Deadline);
+	CHECK(SchedulerTaskWakes[SCHEDULER_TASK_MOUSE] == 1);
+	CHECK(SchedulerTaskWakes[SCHEDULER_TASK_KEYBOARD] == 0);
+	CHECK(SchedulerTaskWakes[SCHEDULER_TASK_USB] == 0);
+	CHECK(SchedulerOtherWakes == 0);
+	CHECK(SchedulerTickWakes == 0);
+	CHECK(SchedulerMaxLateness >= LATENESS_US);
+	CHECK(SchedulerMaxLateness <= LATENESS_US + 1);
+	CHECK(!(TIMSK1 & (1 << OCIE1B)));
+}
+
+/** A deadline which is too close, or has passed, isn't slept for. */
+static void TestDeadlineTooSoon(void)
+{
+	ResetScheduler();
+	SchedulerRunAt(SCHEDULER_TASK_KEYBOARD, TCNT1 + (SCHEDULER_MIN_SLEEP_US / 2) * TIMER1_COUNTS_PER_US);
+	SchedulerSleep();
+	CHECK(StubSleepCount == 0);
+	CHECK(SchedulerBusyPasses == 1);
+	CHECK(!(TIMSK1 & (1 << OCIE1B)));
+
+	SchedulerRunAt(SCHEDULER_TASK_KEYBOARD, TCNT1 - TIMER1_COUNTS_PER_US);
+	SchedulerSleep();
+	CHECK(StubSleepCount == 0);
+	CHECK(SchedulerBusyPasses == 2);
+	CHECK(SchedulerTaskWakes[SCHEDULER_TASK_KEYBOARD] == 0);
+}
+
+int main(void)
+{
+	printf("TestScheduler\n");
+	RUN_TEST(TestRunNowSkipsSleep);
+	RUN_TEST(TestInterruptBeforeSleep);
+	RUN_TEST(TestWakeCounters);
+	RUN_TEST(TestDeadlineWake);
+	RUN_TEST(TestDeadlineTooSoon);
+	return TestResult("TestScheduler");
+}
@@ -0,0 +1,91 @@
+/** \file
+ *
+ *  Stand-in for the LUFA USB driver header, for host tests. The HID and
+ *  standard request definitions (such as keyboard scan codes) are pulled in
+ *  from the real LUFA tree. The device and endpoint functions which the
+ *  firmware calls are replaced by a fake USB device, in StubUSB.c, which
+ *  records each packet written to an IN endpoint so that a test can play
+ *  the host.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#ifndef _TEST_STUB_USB_H_
+#define _TEST_STUB_USB_H_
+
+#define __INCLUDE_FROM_USB_DRIVER
+#define __INCLUDE_FROM_HID_DRIVER
+#include <stdbool.h>
+#include <LUFA/Drivers/USB/Core/StdRequestType.h>
+#include <LUFA/Drivers/USB/Class/Common/HIDClassCommon.h>
+
+/* Macros: */
+#define ENDPOINT_DIR_IN				0x80
+#define ENDPOINT_DIR_OUT			0x00
+#define EP_TYPE_INTERRUPT			0x03
+#define ENDPOINT_CONTROLEP			0
+
+/** Number of endpoints the fake device has. */
+#define STUB_USB_ENDPOINTS			4
+/** Number of packets each IN endpoint remembers, see StubUSBPacket(). */
+#define STUB_USB_PACKETS			256
+/** Most banks an endpoint can have. */
+#define STUB_USB_BANKS				2
+/** Largest packet the fake device can record. */
+#define STUB_USB_PACKET_SIZE		64
+
+/* Enums: */
+enum USB_Device_States_t
+{
+	DEVICE_STATE_Unattached = 0,
+	DEVICE_STATE_Powered = 1,
+	DEVICE_STATE_Default = 2,
+	DEVICE_STATE_Addressed = 3,
+	DEVICE_STATE_Configured = 4,
+	DEVICE_STATE_Suspended = 5,
+};
+
+/* Type Defines: */
+/** A packet which the firmware sent on an IN endpoint. */
+struct StubUSBPacket
+{
+	uint8_t Length;
+	uint8_t Data[STUB_USB_PACKET_SIZE];
+};
+
+/* Exported Variables: */
+extern volatile uint8_t USB_DeviceState;
+extern USB_Request_Header_t USB_ControlRequest;
+extern bool USB_Device_RemoteWakeupEnabled;
+extern unsigned int StubRemoteWakeups;
+
+/* Function Prototypes: */
+extern void USB_Init(void);
+extern void USB_USBTask(void);
+extern void USB_Device_EnableSOFEvents(void);
+extern void USB_Device_SendRemoteWakeup(void);
+extern bool Endpoint_ConfigureEndpoint(const uint8_t Address, const uint8_t Type, const uint16_t Size, const uint8_t Banks);
+extern void Endpoint_SelectEndpoint(const uint8_t Address);
+extern void Endpoint_ResetEndpoint(const uint8_t Address);
+extern bool Endpoint_IsReadWriteAllowed(void);
+extern bool Endpoint_IsSETUPReceived(void);
+extern bool Endpoint_IsINReady(void);
+extern bool Endpoint_IsOUTReceived(void);
+extern uint8_t Endpoint_Write_Stream_LE(const void *const Buffer, uint16_t Length, uint16_t *const BytesProcessed);
+extern uint8_t Endpoint_Write_Control_Stream_LE(const void *const Buffer, uint16_t Length);
+extern uint8_t Endpoint_GetBusyBanks(void);
+extern uint8_t Endpoint_Read_8(void);
+extern void Endpoint_Write_8(const uint8_t Data);
+extern void Endpoint_ClearIN(void);
+extern void Endpoint_ClearOUT(void);
+extern void Endpoint_ClearSETUP(void);
+extern void Endpoint_ClearStatusStage(void);
+
+extern void StubUSBReset(void);
+extern void StubUSBPoll(const uint8_t Address);
+extern void StubUSBOut(const uint8_t Address, const void *Data, const uint8_t Length);
+extern void StubUSBSetup(void);
+extern uint16_t StubUSBPacketCount(const uint8_t Address);
+extern const struct StubUSBPacket *StubUSBPacket(const uint8_t Address, const uint16_t Index);
+
+#endif // #ifndef _TEST_STUB_USB_H_
@@ -0,0 +1,2 @@
+/* Host test stub: everything is declared by <avr/io.h>. */
+#include <avr/io.h>
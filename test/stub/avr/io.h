@@ -0,0 +1,133 @@
+/** \file
+ *
+ *  Stand-in for the avr-libc headers, so that the firmware can be compiled
+ *  and tested on the host. Registers are plain variables, which the tests
+ *  set up and inspect, and are defined in Stubs.c. The sleep and the
+ *  watchdog do nothing, and time only passes when a test (or a busy-wait)
+ *  advances it, see StubAdvanceTime().
+ *
+ *  Interrupts are simulated by the tests calling the interrupt handlers.
+ *  To test code which must not miss an interrupt, a test can set
+ *  StubInterrupt to a handler which the next cli() runs, as if the
+ *  interrupt had happened just before interrupts were disabled, and
+ *  StubWakeInterrupt to a handler which sleep_cpu() runs, as the interrupt
+ *  which wakes the CPU.
+ *
+ *  This file is licensed as described by the file BSD.txt
+ */
+
+#ifndef _TEST_STUB_AVR_IO_H_
+#define _TEST_STUB_AVR_IO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef STUB_DEFINE_REGISTERS
+#define STUB_REGISTER(Type, Name)	volatile Type Name
+#else
+#define STUB_REGISTER(Type, Name)	extern volatile Type Name
+#endif
+
+STUB_REGISTER(uint8_t, SREG);
+STUB_REGISTER(uint8_t, MCUCR);
+STUB_REGISTER(uint8_t, MCUSR);
+STUB_REGISTER(uint8_t, PINA);
+STUB_REGISTER(uint8_t, PINB);
+STUB_REGISTER(uint8_t, PINC);
+STUB_REGISTER(uint8_t, PIND);
+STUB_REGISTER(uint8_t, PINE);
+STUB_REGISTER(uint8_t, PINF);
+STUB_REGISTER(uint8_t, PORTA);
+STUB_REGISTER(uint8_t, PORTB);
+STUB_REGISTER(uint8_t, PORTC);
+STUB_REGISTER(uint8_t, PORTD);
+STUB_REGISTER(uint8_t, PORTE);
+STUB_REGISTER(uint8_t, PORTF);
+STUB_REGISTER(uint8_t, DDRA);
+STUB_REGISTER(uint8_t, DDRB);
+STUB_REGISTER(uint8_t, DDRC);
+STUB_REGISTER(uint8_t, DDRD);
+STUB_REGISTER(uint8_t, DDRE);
+STUB_REGISTER(uint8_t, DDRF);
+STUB_REGISTER(uint8_t, PCICR);
+STUB_REGISTER(uint8_t, PCIFR);
+STUB_REGISTER(uint8_t, PCMSK0);
+STUB_REGISTER(uint8_t, WDTCSR);
+STUB_REGISTER(uint8_t, EICRA);
+STUB_REGISTER(uint8_t, EIFR);
+STUB_REGISTER(uint8_t, EIMSK);
+STUB_REGISTER(uint8_t, TCCR1A);
+STUB_REGISTER(uint8_t, TCCR1B);
+STUB_REGISTER(uint8_t, TCCR1C);
+STUB_REGISTER(uint8_t, TIFR1);
+STUB_REGISTER(uint8_t, TIMSK1);
+STUB_REGISTER(uint16_t, TCNT1);
+STUB_REGISTER(uint16_t, OCR1A);
+STUB_REGISTER(uint16_t, OCR1B);
+STUB_REGISTER(uint16_t, OCR1C);
+
+#define PCIE0		0
+#define PCIF0		0
+#define WDRF		3
+#define WDIE		6
+#define WDCE		4
+#define WDE			3
+#define ISC10		2
+#define ISC11		3
+#define INT1		1
+#define INTF1		1
+#define CS01		1
+#define OCIE1A		1
+#define OCIE1B		2
+#define OCIE1C		3
+#define OCF1A		1
+#define OCF1B		2
+#define OCF1C		3
+
+#define _BV(x)					(1 << (x))
+#define ISR(Vector, ...)		void Vector(void)
+#define EMPTY_INTERRUPT(Vector)	void Vector(void) {}
+#define PROGMEM
+#define pgm_read_byte(Address)	(*(const uint8_t *)(Address))
+#define pgm_read_word(Address)	(*(const uint16_t *)(Address))
+
+#define ATOMIC_BLOCK(Type)		for (uint8_t __Once = 1; __Once; __Once = 0)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define SLEEP_MODE_IDLE			0
+#define SLEEP_MODE_PWR_DOWN		2
+
+/* Simulated time and interrupts, see Stubs.c. */
+extern void StubAdvanceTime(uint16_t Counts);
+extern void (*StubInterrupt)(void);
+extern void (*StubWakeInterrupt)(void);
+extern unsigned int StubSleepCount;
+
+static inline void sei(void) {}
+static inline void cli(void)
+{
+	void (*Handler)(void) = StubInterrupt;
+
+	StubInterrupt = NULL;
+	if (Handler)
+		Handler();
+}
+static inline void _delay_ms(double Milliseconds) { StubAdvanceTime((uint16_t)(Milliseconds * 2000)); }
+static inline void _delay_us(double Microseconds) { StubAdvanceTime((uint16_t)(Microseconds * 2)); }
+static inline void wdt_reset(void) {}
+static inline void wdt_disable(void) {}
+static inline void set_sleep_mode(uint8_t Mode) { (void)Mode; }
+static inline void sleep_enable(void) {}
+static inline void sleep_disable(void) {}
+static inline void sleep_cpu(void)
+{
+	void (*Handler)(void) = StubWakeInterrupt;
+
+	StubSleepCount++;
+	StubWakeInterrupt = NULL;
+	if (Handler)
+		Handler();
+}
+
+#endif // #ifndef _TEST_STUB_AVR_IO_H_
@@ -0,0 +1,5 @@
+/* Host test stub: the clock prescaler is always 1. */
+#include <avr/io.h>
+
+#define clock_div_1				0
+#define clock_prescale_set(x)	((void)(x))